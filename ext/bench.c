@@ -0,0 +1,702 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "error.h"
+#include "golomb.h"
+#include "kernels.h"
+#include "module.h"
+#include "lzss.h"
+#include "stream.h"
+
+// Helpers for the benchmark: a deterministic generator of synthetic images
+// and TLG streams, and direct access to the LZSS codec. Nothing in here is
+// meant for real data.
+
+#define TLG5_MAGIC "TLG5.0\x00raw\x1A"
+#define TLG6_MAGIC "TLG6.0\x00raw\x1A"
+#define MAGIC_SIZE 11
+#define TLG5_HEADER_SIZE 13
+#define TLG6_BLOCK_SIZE 8
+#define TLG6_FILTER_TYPE_COUNT 32
+#define GOLOMB_MAX_UNARY 24
+#define RUN_MAX 40
+#define RUN_GAMMA_SIZE 11
+
+typedef struct
+{
+    uint64_t state;
+} Random;
+
+static inline uint64_t random_next(Random *random)
+{
+    // splitmix64
+    uint64_t z = (random->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t random_below(Random *random, const uint32_t limit)
+{
+    return (random_next(random) >> 32) * limit >> 32;
+}
+
+static inline int random_chance(Random *random, const double probability)
+{
+    return (random_next(random) >> 11) * (1.0 / (1ULL << 53)) < probability;
+}
+
+static int bench_alpha_mode_parse(const char *name, int *mode)
+{
+    static const char *names[] = {"opaque", "binary", "full"};
+    for (int i = 0; i < 3; i++)
+    {
+        if (!strcmp(names[i], name))
+        {
+            *mode = i;
+            return 1;
+        }
+    }
+    PyErr_SetString(PyExc_ValueError, "Unknown alpha mode");
+    return 0;
+}
+
+// Lays out RGBA pixels as runs of a colour that drifts from the pixel above.
+// Entropy is the chance of a run ending at any pixel and scales how far the
+// next colour strays, so 0 gives flat areas and 1 gives noise.
+static PyObject *bench_synthesize_pixels(PyObject *self, PyObject *args)
+{
+    unsigned int width, height;
+    unsigned long long seed;
+    double entropy;
+    const char *alpha_name;
+    int alpha_mode;
+
+    if (!PyArg_ParseTuple(
+            args, "IIKds", &width, &height, &seed, &entropy, &alpha_name))
+    {
+        return NULL;
+    }
+    if (!bench_alpha_mode_parse(alpha_name, &alpha_mode))
+        return NULL;
+
+    PyObject *output = PyBytes_FromStringAndSize(
+        NULL, (Py_ssize_t)width * height * 4);
+    if (!output)
+        return NULL;
+    unsigned char *pixels = (unsigned char*)PyBytes_AS_STRING(output);
+
+    Random random = {seed};
+    const uint32_t spread = 1 + (uint32_t)(entropy * 255);
+    unsigned char current[4] = {0, 0, 0, 255};
+    for (size_t y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            unsigned char *pixel = pixels + (y * width + x) * 4;
+            if (random_chance(&random, entropy) || (!x && !y))
+            {
+                const unsigned char *base = y ? pixel - width * 4 : current;
+                for (int c = 0; c < 4; c++)
+                {
+                    current[c] = base[c]
+                        + random_below(&random, spread)
+                        - spread / 2;
+                }
+                if (alpha_mode == 0)
+                    current[3] = 255;
+                else if (alpha_mode == 1)
+                    current[3] = current[3] & 0x80 ? 255 : 0;
+            }
+            memcpy(pixel, current, 4);
+        }
+    }
+    return output;
+}
+
+typedef struct
+{
+    unsigned char *data;
+    size_t bit_count;
+} BitWriter;
+
+static inline void bit_writer_put(
+    BitWriter *writer, const uint32_t value, const int count)
+{
+    for (int i = 0; i < count; i++, writer->bit_count++)
+    {
+        const size_t bit = writer->bit_count;
+        if ((value >> i) & 1)
+            writer->data[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+static inline void bit_writer_put_zeros(BitWriter *writer, const int count)
+{
+    writer->bit_count += count;
+}
+
+// Elias gamma code as read by the TLG6 decoder: the length in unary, then
+// the bits below the leading one, least significant first.
+static inline void bit_writer_put_gamma(BitWriter *writer, uint32_t value)
+{
+    int count = 0;
+    for (uint32_t t = value >> 1; t; t >>= 1)
+        count++;
+    bit_writer_put_zeros(writer, count);
+    bit_writer_put(writer, 1, 1);
+    bit_writer_put(writer, value, count);
+}
+
+// Golomb codes a channel of random residuals, alternating runs of zeros and
+// of non-zero values the way the decoder expects them.
+static void bench_golomb_write(
+    BitWriter *writer,
+    const size_t value_count,
+    Random *random,
+    const double zero_chance,
+    const int magnitude)
+{
+    int zero = random_chance(random, zero_chance);
+    bit_writer_put(writer, !zero, 1);
+    int n = GOLOMB_N_COUNT - 1;
+    int a = 0;
+    for (size_t i = 0; i < value_count; zero ^= 1)
+    {
+        size_t run = 1 + random_below(random, RUN_MAX);
+        if (run > value_count - i)
+            run = value_count - i;
+        bit_writer_put_gamma(writer, run);
+        i += run;
+        if (zero)
+            continue;
+
+        for (size_t j = 0; j < run; j++)
+        {
+            int e = 1 + random_below(random, magnitude);
+            if (random_below(random, 2))
+                e = -e;
+            if (a >= GOLOMB_A_COUNT)
+                a = 0;
+            if (n >= GOLOMB_N_COUNT)
+                n = 0;
+            const int k = golomb_bit_size_table[a][n];
+            int m = (e >= 0 ? 2 * e : -2 * e - 1) - 1;
+            if (m >> k >= GOLOMB_MAX_UNARY)
+                m = 1;
+            bit_writer_put_zeros(writer, m >> k);
+            bit_writer_put(writer, 1, 1);
+            bit_writer_put(writer, m, k);
+            a += m >> 1;
+            if (--n < 0)
+            {
+                a >>= 1;
+                n = GOLOMB_N_COUNT - 1;
+            }
+        }
+    }
+}
+
+static void bench_tlg6_dict_init(unsigned char *dict)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            for (int k = 0; k < 4; k++) *dict++ = i;
+            for (int k = 0; k < 4; k++) *dict++ = j;
+        }
+    }
+}
+
+// Writes a TLG6 stream with random filter types and random Golomb coded
+// residuals. The decoder does all the work real images make it do, even
+// though the pixels it produces mean nothing.
+static PyObject *bench_synthesize_tlg6(PyObject *self, PyObject *args)
+{
+    unsigned int width, height, channel_count;
+    unsigned long long seed;
+    double entropy;
+    Stream *stream = NULL;
+    unsigned char *filter_types = NULL;
+    unsigned char *filter_types_comp = NULL;
+    BitWriter writer = {0};
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(
+            args, "IIIKd", &width, &height, &channel_count, &seed, &entropy))
+    {
+        return NULL;
+    }
+    if (!width || !height || (channel_count != 3 && channel_count != 4))
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid image parameters");
+        return NULL;
+    }
+
+    Random random = {seed};
+    const double zero_chance = 1.0 - entropy;
+    const int magnitude = 1 + (int)(entropy * 126);
+    const size_t x_block_count = (width - 1) / TLG6_BLOCK_SIZE + 1;
+    const size_t y_block_count = (height - 1) / TLG6_BLOCK_SIZE + 1;
+    const size_t filter_type_count = x_block_count * y_block_count;
+
+    stream = stream_create_empty();
+    filter_types = PyMem_RawMalloc(filter_type_count);
+    // a value takes at most a unary prefix, a stop bit and eight plain bits,
+    // plus the gamma code of a run it may be alone in
+    const size_t band_size = (size_t)width * TLG6_BLOCK_SIZE;
+    const size_t bit_pool_size =
+        (band_size * (GOLOMB_MAX_UNARY + 9 + RUN_GAMMA_SIZE) + 7) / 8;
+    writer.data = PyMem_RawMalloc(bit_pool_size);
+    if (!stream || !filter_types || !writer.data)
+    {
+        error_set_no_memory();
+        goto end;
+    }
+
+    for (size_t i = 0; i < filter_type_count; i++)
+        filter_types[i] = random_below(&random, TLG6_FILTER_TYPE_COUNT);
+    unsigned char dict[4096];
+    size_t dict_pos = 0;
+    size_t filter_types_comp_size;
+    bench_tlg6_dict_init(dict);
+    filter_types_comp = lzss_compress(
+        filter_types,
+        filter_type_count,
+        &filter_types_comp_size,
+        dict,
+        &dict_pos);
+    if (!filter_types_comp)
+        goto end;
+
+    if (!stream_write_data(
+            stream, (const unsigned char*)TLG6_MAGIC, MAGIC_SIZE)
+        || !stream_write_u8(stream, channel_count)
+        || !stream_write_u8(stream, 0)
+        || !stream_write_u8(stream, 0)
+        || !stream_write_u8(stream, 0)
+        || !stream_write_u32_le(stream, width)
+        || !stream_write_u32_le(stream, height)
+        || !stream_write_u32_le(stream, 0)
+        || !stream_write_u32_le(stream, filter_types_comp_size)
+        || !stream_write_data(
+            stream, filter_types_comp, filter_types_comp_size))
+    {
+        goto end;
+    }
+
+    for (size_t y = 0; y < height; y += TLG6_BLOCK_SIZE)
+    {
+        const size_t row_count = height - y < TLG6_BLOCK_SIZE
+            ? height - y
+            : TLG6_BLOCK_SIZE;
+        for (size_t c = 0; c < channel_count; c++)
+        {
+            memset(writer.data, 0, bit_pool_size);
+            writer.bit_count = 0;
+            bench_golomb_write(
+                &writer,
+                row_count * width,
+                &random,
+                zero_chance,
+                magnitude);
+            if (!stream_write_u32_le(stream, writer.bit_count)
+                || !stream_write_data(
+                    stream, writer.data, (writer.bit_count + 7) / 8))
+            {
+                goto end;
+            }
+        }
+    }
+
+    output = PyBytes_FromStringAndSize((char*)stream->data, stream->size);
+
+end:
+    if (stream)
+        stream_destroy(stream);
+    PyMem_RawFree(filter_types);
+    PyMem_RawFree(filter_types_comp);
+    PyMem_RawFree(writer.data);
+    if (!output && !PyErr_Occurred())
+        error_raise_pending();
+    return output;
+}
+
+// Recompresses the blocks of a raw TLG5 stream with LZSS, keeping each one
+// stored when compression doesn't pay off.
+static PyObject *bench_compress_tlg5(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+    Stream *source = NULL;
+    Stream *target = NULL;
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*", &input))
+        return NULL;
+
+    source = stream_create_for_data(input.buf, input.len);
+    target = stream_create_empty();
+    if (!source || !target)
+        goto end;
+
+    unsigned char *header;
+    uint8_t channel_count;
+    uint32_t width, height, block_height;
+    if (input.len < MAGIC_SIZE
+        || memcmp(input.buf, TLG5_MAGIC, MAGIC_SIZE))
+    {
+        error_set(PyExc_ValueError, "Not a TLG5 image");
+        goto end;
+    }
+    if (!stream_read_view(
+            source, &header, MAGIC_SIZE + TLG5_HEADER_SIZE))
+    {
+        goto end;
+    }
+    source->pos = MAGIC_SIZE;
+    if (!stream_read_u8(source, &channel_count)
+        || !stream_read_u32_le(source, &width)
+        || !stream_read_u32_le(source, &height)
+        || !stream_read_u32_le(source, &block_height))
+    {
+        goto end;
+    }
+    if (!height || !block_height)
+    {
+        error_set(PyExc_ValueError, "Invalid image parameters");
+        goto end;
+    }
+    const size_t block_count = (height - 1) / block_height + 1;
+    if (!stream_skip(source, block_count * 4))
+        goto end;
+
+    if (!stream_write_data(target, header, MAGIC_SIZE + TLG5_HEADER_SIZE))
+        goto end;
+    const size_t block_sizes_offset = target->pos;
+    for (size_t i = 0; i < block_count; i++)
+    {
+        if (!stream_write_u32_le(target, 0))
+            goto end;
+    }
+
+    unsigned char dict[4096] = {0};
+    size_t dict_pos = 0;
+    for (size_t i = 0; i < block_count; i++)
+    {
+        const size_t block_start = target->pos;
+        for (size_t c = 0; c < channel_count; c++)
+        {
+            uint8_t mark;
+            uint32_t size;
+            unsigned char *data;
+            if (!stream_read_u8(source, &mark)
+                || !stream_read_u32_le(source, &size)
+                || !stream_read_view(source, &data, size))
+            {
+                goto end;
+            }
+            if (mark != 1)
+            {
+                error_set(PyExc_ValueError, "Image is already compressed");
+                goto end;
+            }
+
+            unsigned char new_dict[4096];
+            size_t new_dict_pos = dict_pos;
+            size_t comp_size;
+            memcpy(new_dict, dict, sizeof(dict));
+            unsigned char *comp = lzss_compress(
+                data, size, &comp_size, new_dict, &new_dict_pos);
+            if (!comp)
+                goto end;
+            int result;
+            if (comp_size < size)
+            {
+                memcpy(dict, new_dict, sizeof(dict));
+                dict_pos = new_dict_pos;
+                result = stream_write_u8(target, 0)
+                    && stream_write_u32_le(target, comp_size)
+                    && stream_write_data(target, comp, comp_size);
+            }
+            else
+            {
+                result = stream_write_u8(target, 1)
+                    && stream_write_u32_le(target, size)
+                    && stream_write_data(target, data, size);
+            }
+            PyMem_RawFree(comp);
+            if (!result)
+                goto end;
+        }
+
+        const size_t block_end = target->pos;
+        target->pos = block_sizes_offset + i * 4;
+        if (!stream_write_u32_le(target, block_end - block_start))
+            goto end;
+        target->pos = block_end;
+    }
+
+    output = PyBytes_FromStringAndSize((char*)target->data, target->size);
+
+end:
+    if (source)
+        stream_destroy(source);
+    if (target)
+        stream_destroy(target);
+    PyBuffer_Release(&input);
+    if (!output && !PyErr_Occurred())
+        error_raise_pending();
+    return output;
+}
+
+static PyObject *bench_lzss_compress(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+    unsigned char *comp = NULL;
+    size_t comp_size = 0;
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*", &input))
+        return NULL;
+
+    unsigned char dict[4096] = {0};
+    size_t dict_pos = 0;
+    Py_BEGIN_ALLOW_THREADS
+    comp = lzss_compress(input.buf, input.len, &comp_size, dict, &dict_pos);
+    Py_END_ALLOW_THREADS
+    if (comp)
+        output = PyBytes_FromStringAndSize((char*)comp, comp_size);
+    else
+        error_raise_pending();
+
+    PyMem_RawFree(comp);
+    PyBuffer_Release(&input);
+    return output;
+}
+
+static PyObject *bench_lzss_decompress(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+    Py_ssize_t output_size;
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*n", &input, &output_size))
+        return NULL;
+    if (output_size < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid size");
+        goto end;
+    }
+
+    output = PyBytes_FromStringAndSize(NULL, output_size);
+    if (!output)
+        goto end;
+
+    unsigned char dict[4096] = {0};
+    size_t dict_pos = 0;
+    size_t produced;
+    Py_BEGIN_ALLOW_THREADS
+    produced = lzss_decompress(
+        input.buf,
+        input.len,
+        (unsigned char*)PyBytes_AS_STRING(output),
+        output_size,
+        dict,
+        &dict_pos);
+    Py_END_ALLOW_THREADS
+    if (produced != (size_t)output_size)
+    {
+        PyErr_SetString(PyExc_ValueError, "Truncated data");
+        Py_CLEAR(output);
+    }
+
+end:
+    PyBuffer_Release(&input);
+    return output;
+}
+
+#define VERIFY_MAX_SIZE 300
+
+static void bench_fill(Random *random, void *data, const size_t size)
+{
+    unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+        bytes[i] = random_next(random);
+}
+
+// Runs one kernel of the given level and of the scalar reference on the same
+// random input of every size up to VERIFY_MAX_SIZE, so that the tails of the
+// vector loops get covered too. Returns the name of the first kernel whose
+// output differs, or NULL.
+static const char *bench_verify_level(const Kernels *kernels, Random *random)
+{
+    const Kernels *reference = &kernels_scalar;
+    uint8_t planes[4 * VERIFY_MAX_SIZE];
+    Pixel top_line[VERIFY_MAX_SIZE];
+    union
+    {
+        unsigned char bytes[4 * VERIFY_MAX_SIZE];
+        uint32_t words[VERIFY_MAX_SIZE];
+        Pixel pixels[VERIFY_MAX_SIZE];
+    } expected, actual;
+
+    for (size_t size = 0; size <= VERIFY_MAX_SIZE; size++)
+    {
+        const size_t byte_size = 4 * size;
+        const uint32_t key = random_next(random);
+
+        bench_fill(random, expected.bytes, byte_size);
+        memcpy(actual.bytes, expected.bytes, byte_size);
+        reference->xor_words(expected.bytes, byte_size - size % 4, key);
+        kernels->xor_words(actual.bytes, byte_size - size % 4, key);
+        if (memcmp(expected.bytes, actual.bytes, byte_size))
+            return "xor_words";
+
+        reference->xor_bytes(expected.bytes, size, key);
+        kernels->xor_bytes(actual.bytes, size, key);
+        if (memcmp(expected.bytes, actual.bytes, byte_size))
+            return "xor_bytes";
+
+        bench_fill(random, planes, sizeof(planes));
+        bench_fill(random, top_line, sizeof(top_line));
+        const uint8_t *row_planes[4] = {
+            planes,
+            planes + VERIFY_MAX_SIZE,
+            planes + VERIFY_MAX_SIZE * 2,
+            planes + VERIFY_MAX_SIZE * 3,
+        };
+        for (int use_alpha = 0; use_alpha < 2; use_alpha++)
+        {
+            for (int has_top = 0; has_top < 2; has_top++)
+            {
+                const Pixel *top = has_top ? top_line : NULL;
+                reference->tlg5_reconstruct_row(
+                    expected.pixels, top, row_planes, size, use_alpha);
+                kernels->tlg5_reconstruct_row(
+                    actual.pixels, top, row_planes, size, use_alpha);
+                if (memcmp(expected.bytes, actual.bytes, byte_size))
+                    return "tlg5_reconstruct_row";
+            }
+        }
+
+        reference->tlg6_interleave(expected.words, planes, size);
+        kernels->tlg6_interleave(actual.words, planes, size);
+        if (memcmp(expected.bytes, actual.bytes, byte_size))
+            return "tlg6_interleave";
+
+        Tlg6TransformStep steps[3];
+        const int step_count = random_below(random, 4);
+        for (int i = 0; i < step_count; i++)
+        {
+            steps[i].target = random_below(random, 3);
+            steps[i].source =
+                (steps[i].target + 1 + random_below(random, 2)) % 3;
+            steps[i].factor = 1 + random_below(random, 2);
+        }
+        reference->tlg6_transform(expected.words, size, steps, step_count);
+        kernels->tlg6_transform(actual.words, size, steps, step_count);
+        if (memcmp(expected.bytes, actual.bytes, byte_size))
+            return "tlg6_transform";
+    }
+    return NULL;
+}
+
+static PyObject *bench_verify_kernels(PyObject *self, PyObject *args)
+{
+    unsigned long long seed;
+    if (!PyArg_ParseTuple(args, "K", &seed))
+        return NULL;
+
+    PyObject *result = PyDict_New();
+    if (!result)
+        return NULL;
+    for (int level = CPU_SCALAR + 1; level < CPU_LEVEL_COUNT; level++)
+    {
+        const Kernels *kernels = kernels_for_level(level);
+        if (!kernels)
+            continue;
+        Random random = {seed};
+        const char *failure = bench_verify_level(kernels, &random);
+        PyObject *value = failure
+            ? PyUnicode_FromString(failure)
+            : (Py_INCREF(Py_None), Py_None);
+        if (!value
+            || PyDict_SetItemString(result, cpu_level_name(level), value))
+        {
+            Py_XDECREF(value);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    return result;
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "synthesize_pixels",
+        bench_synthesize_pixels,
+        METH_VARARGS,
+        "Generate RGBA pixels from a seed, an entropy level in [0, 1] and an "
+        "alpha mode (opaque, binary or full)"
+    },
+    {
+        "synthesize_tlg6",
+        bench_synthesize_tlg6,
+        METH_VARARGS,
+        "Generate a TLG6 stream of random residuals from a seed and an "
+        "entropy level in [0, 1]"
+    },
+    {
+        "compress_tlg5",
+        bench_compress_tlg5,
+        METH_VARARGS,
+        "Recompress the blocks of a raw TLG5 stream with LZSS"
+    },
+    {
+        "lzss_compress",
+        bench_lzss_compress,
+        METH_VARARGS,
+        "Compress data with LZSS, starting from an empty dictionary"
+    },
+    {
+        "lzss_decompress",
+        bench_lzss_decompress,
+        METH_VARARGS,
+        "Decompress LZSS data of a known size"
+    },
+    {
+        "verify_kernels",
+        bench_verify_kernels,
+        METH_VARARGS,
+        "Check the kernels of every level this CPU runs against the scalar "
+        "ones on random input; maps each level to the first kernel that "
+        "differs, or None"
+    },
+    KERNELS_METHODS,
+    {NULL, NULL, 0, NULL}
+};
+
+static int bench_exec(PyObject *module)
+{
+    kernels_init();
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, bench_exec},
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib.tlg._bench",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__bench(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
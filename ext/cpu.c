@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+static const char *cpu_level_names[CPU_LEVEL_COUNT] = {
+    [CPU_SCALAR] = "scalar",
+    [CPU_SSE2] = "sse2",
+    [CPU_AVX2] = "avx2",
+    [CPU_AVX512] = "avx512",
+};
+
+CpuLevel cpu_detect(void)
+{
+#if CPU_X86 && defined(__GNUC__)
+    // the checks include whether the OS saves the wider registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw"))
+    {
+        return CPU_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return CPU_SSE2;
+#endif
+    return CPU_SCALAR;
+}
+
+CpuLevel cpu_select(void)
+{
+    const CpuLevel detected = cpu_detect();
+    const char *name = getenv("TLG_CPU");
+    if (!name)
+        return detected;
+    for (int level = 0; level < CPU_LEVEL_COUNT; level++)
+    {
+        if (!strcmp(cpu_level_names[level], name))
+            return level < (int)detected ? (CpuLevel)level : detected;
+    }
+    return detected;
+}
+
+const char *cpu_level_name(const CpuLevel level)
+{
+    return cpu_level_names[level];
+}
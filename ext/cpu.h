@@ -0,0 +1,30 @@
+#ifndef CPU_H
+#define CPU_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#else
+#define CPU_X86 0
+#endif
+
+// Instruction set levels the codec kernels are built for, from the portable
+// scalar reference up. Every level implies the ones below it.
+typedef enum
+{
+    CPU_SCALAR,
+    CPU_SSE2,
+    CPU_AVX2,
+    CPU_AVX512,
+    CPU_LEVEL_COUNT
+} CpuLevel;
+
+// The best level this CPU runs, as told by cpuid.
+CpuLevel cpu_detect(void);
+
+// The level the kernels should use: the detected one, unless TLG_CPU names a
+// lower one. Levels the CPU can't run are never picked.
+CpuLevel cpu_select(void);
+
+const char *cpu_level_name(const CpuLevel level);
+
+#endif
@@ -0,0 +1,947 @@
+#include <Python.h>
+#include <pythread.h>
+#include "decode.h"
+#include "error.h"
+#include "format.h"
+#include "pool.h"
+#include "scratch.h"
+
+// What to make of an image: all of it, a region of it or a thumbnail of it,
+// in a given pixel format
+typedef struct
+{
+    int has_region;
+    DecodeRegion region;
+    uint32_t scale;
+    Format format;
+} DecodeOptions;
+
+typedef enum
+{
+    DECODE_FULL,
+    DECODE_REGION,
+    DECODE_THUMBNAIL,
+} DecodeMode;
+
+typedef struct
+{
+    const Codec *codec;
+    Py_buffer input;
+    uint32_t image_width;
+    uint32_t image_height;
+    DecodeRegion region;
+    uint32_t scale;
+    Format format;
+    uint32_t output_width;
+    uint32_t output_height;
+    PyObject *output_image_data;
+    unsigned char *image_data;
+    int opaque;
+    Error error;
+} DecodeJob;
+
+typedef struct
+{
+    DecodeJob *jobs;
+    Scratch **scratches;
+} DecodeBatch;
+
+// Where the sinks put finished rows, converted to the requested format
+typedef struct
+{
+    unsigned char *data;
+    Format format;
+    size_t row_size;
+    int opaque;
+} SinkOutput;
+
+// Writes the rows of a region of the image to the output. When the region
+// spans whole rows and no conversion is needed, they are reconstructed in
+// place; otherwise, and for the rows above the region, two scratch rows take
+// turns.
+typedef struct
+{
+    RowSink base;
+    SinkOutput output;
+    DecodeRegion region;
+    uint32_t image_width;
+    int in_place;
+    Pixel *rows;
+} RegionSink;
+
+// Shrinks the image by box filtering while it's being decoded. Only two
+// full-size rows are kept around, plus the running sums of the current row of
+// boxes.
+typedef struct
+{
+    RowSink base;
+    SinkOutput output;
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t scale;
+    uint32_t scale_shift;
+    uint32_t thumbnail_width;
+    Pixel *rows;
+    uint64_t *sums;
+    Pixel *boxes;
+} ThumbnailSink;
+
+// The tuple returned for a decoded image. It unpacks as (width, height, data)
+// like it always did; the rest is only reachable by name.
+static PyStructSequence_Field decode_result_fields[] = {
+    {"width", NULL},
+    {"height", NULL},
+    {"data", NULL},
+    {"opaque", "Whether every pixel has an alpha of 0xFF"},
+    {"format", "The pixel format of data"},
+    {NULL, NULL},
+};
+
+static PyStructSequence_Desc decode_result_desc = {
+    "DecodedImage", NULL, decode_result_fields, 3,
+};
+
+typedef struct
+{
+    PyObject_HEAD
+    const Codec *codec;
+    PyTypeObject *result_type;
+    Scratch *scratch;
+    PyThread_type_lock lock;
+} Decoder;
+
+// The two scratch rows are set apart by a little more than a row, so that
+// reading one while writing the other doesn't keep hitting the same cache
+// sets.
+#define SINK_ROW_PADDING 16
+
+static void sink_output_init(SinkOutput *output, const DecodeJob *job)
+{
+    output->data = job->image_data;
+    output->format = job->format;
+    output->row_size = job->output_width * format_pixel_size(job->format);
+    output->opaque = 1;
+}
+
+static void sink_output_row(
+    SinkOutput *output,
+    const uint32_t y,
+    const Pixel *row,
+    const uint32_t width)
+{
+    if (output->opaque && !format_is_opaque(row, width))
+        output->opaque = 0;
+    format_convert(
+        output->format, output->data + y * output->row_size, row, width);
+}
+
+static Pixel *sink_rows_get(Scratch *scratch, const uint32_t image_width)
+{
+    return (Pixel*)scratch_get(
+        scratch,
+        SCRATCH_SINK_ROWS,
+        2 * ((size_t)image_width + SINK_ROW_PADDING) * sizeof(Pixel));
+}
+
+static inline Pixel *sink_row(
+    Pixel *rows, const uint32_t image_width, const uint32_t y)
+{
+    return rows + (size_t)(y & 1) * (image_width + SINK_ROW_PADDING);
+}
+
+static Pixel *region_sink_row_begin(RowSink *base, const uint32_t y)
+{
+    RegionSink *sink = (RegionSink*)base;
+    if (sink->in_place && y >= sink->region.y)
+    {
+        return (Pixel*)sink->output.data
+            + (size_t)(y - sink->region.y) * sink->image_width;
+    }
+    return sink_row(sink->rows, sink->image_width, y);
+}
+
+static void region_sink_row_end(RowSink *base, const uint32_t y)
+{
+    RegionSink *sink = (RegionSink*)base;
+    if (y < sink->region.y)
+        return;
+    if (sink->in_place)
+    {
+        const Pixel *row = (Pixel*)sink->output.data
+            + (size_t)(y - sink->region.y) * sink->image_width;
+        if (sink->output.opaque && !format_is_opaque(row, sink->image_width))
+            sink->output.opaque = 0;
+        return;
+    }
+    sink_output_row(
+        &sink->output,
+        y - sink->region.y,
+        sink_row(sink->rows, sink->image_width, y) + sink->region.x,
+        sink->region.width);
+}
+
+static int region_sink_init(
+    RegionSink *sink, const DecodeJob *job, Scratch *scratch)
+{
+    sink->base.width = job->region.x + job->region.width;
+    sink->base.height = job->region.y + job->region.height;
+    sink->base.row_begin = region_sink_row_begin;
+    sink->base.row_end = region_sink_row_end;
+    sink_output_init(&sink->output, job);
+    sink->region = job->region;
+    sink->image_width = job->image_width;
+    sink->in_place = job->format == FORMAT_RGBA
+        && job->region.x == 0
+        && job->region.width == job->image_width;
+    sink->rows = NULL;
+    if (!sink->in_place || job->region.y > 0)
+    {
+        sink->rows = sink_rows_get(scratch, job->image_width);
+        if (!sink->rows)
+            return 0;
+    }
+    return 1;
+}
+
+static Pixel *thumbnail_sink_row_begin(RowSink *base, const uint32_t y)
+{
+    ThumbnailSink *sink = (ThumbnailSink*)base;
+    return sink_row(sink->rows, sink->image_width, y);
+}
+
+// Spreads the channels of a pixel over the 16-bit lanes of a 64-bit integer,
+// as R, B, G, A from the lowest lane up. A whole 8x8 box sums up without
+// overflowing a lane, so a box takes a single add per pixel.
+static inline uint64_t thumbnail_sink_spread(const Pixel *pixel)
+{
+    uint32_t value;
+    memcpy(&value, pixel, sizeof(value));
+    return (value & 0x00FF00FF) | ((uint64_t)(value & 0xFF00FF00) << 24);
+}
+
+// the scale is passed as a constant so that the box loop gets unrolled
+static inline void thumbnail_sink_accumulate(
+    uint64_t *sums,
+    const Pixel *row,
+    const uint32_t image_width,
+    const uint32_t scale)
+{
+    const uint32_t box_count = image_width / scale;
+    for (uint32_t x = 0; x < box_count; x++)
+    {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < scale; i++)
+            sum += thumbnail_sink_spread(row + i);
+        *sums++ += sum;
+        row += scale;
+    }
+    for (uint32_t i = 0; i < image_width % scale; i++)
+        *sums += thumbnail_sink_spread(row + i);
+}
+
+// Turns box sums into rounded averages. Rather than dividing, it multiplies
+// by a reciprocal that is exact for sums of up to 64 pixels.
+static inline void thumbnail_sink_emit(
+    Pixel *target,
+    const uint64_t *sums,
+    const uint32_t box_count,
+    const uint32_t pixel_count)
+{
+    const uint64_t reciprocal =
+        ((1u << 24) + pixel_count - 1) / pixel_count;
+    const uint64_t rounding = (pixel_count / 2) * 0x0001000100010001ull;
+    for (uint32_t x = 0; x < box_count; x++)
+    {
+        const uint64_t sum = sums[x] + rounding;
+        target[x].r = ((sum & 0xFFFF) * reciprocal) >> 24;
+        target[x].b = (((sum >> 16) & 0xFFFF) * reciprocal) >> 24;
+        target[x].g = (((sum >> 32) & 0xFFFF) * reciprocal) >> 24;
+        target[x].a = (((sum >> 48) & 0xFFFF) * reciprocal) >> 24;
+    }
+}
+
+static void thumbnail_sink_row_end(RowSink *base, const uint32_t y)
+{
+    ThumbnailSink *sink = (ThumbnailSink*)base;
+    const Pixel *row = sink_row(sink->rows, sink->image_width, y);
+    uint64_t *sums = sink->sums;
+
+    switch (sink->scale)
+    {
+        case 2:
+            thumbnail_sink_accumulate(sums, row, sink->image_width, 2);
+            break;
+        case 4:
+            thumbnail_sink_accumulate(sums, row, sink->image_width, 4);
+            break;
+        default:
+            thumbnail_sink_accumulate(sums, row, sink->image_width, 8);
+            break;
+    }
+
+    const uint32_t box_y = y & (sink->scale - 1);
+    if (box_y != sink->scale - 1 && y != sink->image_height - 1)
+        return;
+
+    // boxes at the right and bottom edges may be cut short
+    Pixel *target = sink->boxes;
+    const uint32_t box_count = sink->image_width >> sink->scale_shift;
+    thumbnail_sink_emit(
+        target, sums, box_count, sink->scale * (box_y + 1));
+    if (box_count < sink->thumbnail_width)
+    {
+        thumbnail_sink_emit(
+            target + box_count,
+            sums + box_count,
+            1,
+            (sink->image_width & (sink->scale - 1)) * (box_y + 1));
+    }
+    memset(sums, 0, sink->thumbnail_width * sizeof(uint64_t));
+    sink_output_row(
+        &sink->output, y >> sink->scale_shift, target, sink->thumbnail_width);
+}
+
+static int thumbnail_sink_init(
+    ThumbnailSink *sink, const DecodeJob *job, Scratch *scratch)
+{
+    sink->base.width = job->image_width;
+    sink->base.height = job->image_height;
+    sink->base.row_begin = thumbnail_sink_row_begin;
+    sink->base.row_end = thumbnail_sink_row_end;
+    sink_output_init(&sink->output, job);
+    sink->image_width = job->image_width;
+    sink->image_height = job->image_height;
+    sink->scale = job->scale;
+    sink->scale_shift = 0;
+    while ((1u << sink->scale_shift) < job->scale)
+        sink->scale_shift++;
+    sink->thumbnail_width = job->output_width;
+
+    sink->rows = sink_rows_get(scratch, job->image_width);
+    if (!sink->rows)
+        return 0;
+    const size_t sums_size = (size_t)job->output_width * sizeof(uint64_t);
+    sink->sums = (uint64_t*)scratch_get(scratch, SCRATCH_SINK_SUMS, sums_size);
+    if (!sink->sums)
+        return 0;
+    memset(sink->sums, 0, sums_size);
+    sink->boxes = (Pixel*)scratch_get(
+        scratch,
+        SCRATCH_SINK_BOXES,
+        (size_t)job->output_width * sizeof(Pixel));
+    if (!sink->boxes)
+        return 0;
+    return 1;
+}
+
+// Acquires the input and allocates the output while the GIL is still held.
+// Returns 0 only on Python-level failures; codec failures (such as a bad
+// header) are kept in job->error so that a batch can carry on without them.
+static int decode_job_prepare(
+    DecodeJob *job,
+    const Codec *codec,
+    PyObject *source,
+    const DecodeOptions *options)
+{
+    assert(job);
+    assert(codec);
+    assert(source);
+    assert(options);
+
+    const DecodeRegion *region = options->has_region ? &options->region : NULL;
+    const uint32_t scale = options->scale;
+    job->codec = codec;
+    job->scale = scale;
+    job->format = options->format;
+    job->opaque = 0;
+    job->output_image_data = NULL;
+    job->image_data = NULL;
+    job->error.type = NULL;
+    job->error.message = NULL;
+
+    if (PyObject_GetBuffer(source, &job->input, PyBUF_SIMPLE) < 0)
+        return 0;
+
+    if (!codec->read_size(
+        job->input.buf,
+        job->input.len,
+        &job->image_width,
+        &job->image_height))
+    {
+        error_fetch(&job->error);
+        return 1;
+    }
+
+    if (!region)
+    {
+        job->region.x = 0;
+        job->region.y = 0;
+        job->region.width = job->image_width;
+        job->region.height = job->image_height;
+    }
+    else if (!region->width
+        || !region->height
+        || region->width > job->image_width
+        || region->height > job->image_height
+        || region->x > job->image_width - region->width
+        || region->y > job->image_height - region->height)
+    {
+        error_set(PyExc_ValueError, "Region out of bounds");
+        error_fetch(&job->error);
+        return 1;
+    }
+    else
+        job->region = *region;
+
+    job->output_width = (job->region.width + scale - 1) / scale;
+    job->output_height = (job->region.height + scale - 1) / scale;
+    job->output_image_data = PyBytes_FromStringAndSize(
+        NULL,
+        (size_t)job->output_width
+            * job->output_height
+            * format_pixel_size(job->format));
+    if (!job->output_image_data)
+    {
+        PyBuffer_Release(&job->input);
+        return 0;
+    }
+    job->image_data = (unsigned char*)PyBytes_AS_STRING(
+        job->output_image_data);
+    return 1;
+}
+
+static void decode_job_run(DecodeJob *job, Scratch *scratch)
+{
+    assert(job);
+    assert(scratch);
+    RegionSink region_sink;
+    ThumbnailSink thumbnail_sink;
+    RowSink *sink;
+    if (!job->output_image_data)
+        return;
+    SinkOutput *output;
+    if (job->scale > 1)
+    {
+        sink = &thumbnail_sink.base;
+        output = &thumbnail_sink.output;
+        if (!thumbnail_sink_init(&thumbnail_sink, job, scratch))
+            goto fail;
+    }
+    else
+    {
+        sink = &region_sink.base;
+        output = &region_sink.output;
+        if (!region_sink_init(&region_sink, job, scratch))
+            goto fail;
+    }
+    if (job->codec->decode(job->input.buf, job->input.len, scratch, sink))
+    {
+        job->opaque = output->opaque;
+        return;
+    }
+fail:
+    error_fetch(&job->error);
+}
+
+static void decode_batch_task(void *context, size_t worker, size_t index)
+{
+    DecodeBatch *batch = context;
+    decode_job_run(&batch->jobs[index], batch->scratches[worker]);
+}
+
+static PyObject *decode_job_build_output(
+    DecodeJob *job, PyTypeObject *result_type)
+{
+    assert(job);
+    assert(job->output_image_data);
+    assert(result_type);
+    PyObject *output = PyStructSequence_New(result_type);
+    if (!output)
+        return NULL;
+    PyObject *items[] = {
+        PyLong_FromLong(job->output_width),
+        PyLong_FromLong(job->output_height),
+        job->output_image_data,
+        PyBool_FromLong(job->opaque),
+        PyUnicode_FromString(format_name(job->format)),
+    };
+    Py_INCREF(job->output_image_data);
+    for (int i = 0; i < 5; i++)
+    {
+        if (!items[i])
+        {
+            for (int j = i; j < 5; j++)
+                Py_XDECREF(items[j]);
+            Py_DECREF(output);
+            return NULL;
+        }
+        PyStructSequence_SET_ITEM(output, i, items[i]);
+    }
+    return output;
+}
+
+static void decode_job_release(DecodeJob *job)
+{
+    assert(job);
+    Py_XDECREF(job->output_image_data);
+    PyBuffer_Release(&job->input);
+}
+
+static PyObject *decode_job_finish(
+    DecodeJob *job, PyTypeObject *result_type)
+{
+    PyObject *output = job->error.type
+        ? error_raise(&job->error)
+        : decode_job_build_output(job, result_type);
+    decode_job_release(job);
+    return output;
+}
+
+static DecodeState *decode_state(PyObject *module)
+{
+    return (DecodeState*)PyModule_GetState(module);
+}
+
+static PyObject *decode_one(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *source,
+    const DecodeOptions *options)
+{
+    DecodeJob job;
+
+    Scratch *scratch = scratch_create();
+    if (!scratch)
+        return error_raise_pending();
+
+    if (!decode_job_prepare(&job, codec, source, options))
+    {
+        scratch_destroy(scratch);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    decode_job_run(&job, scratch);
+    scratch_destroy(scratch);
+    Py_END_ALLOW_THREADS
+
+    return decode_job_finish(&job, decode_state(module)->result_type);
+}
+
+static int decode_u32_parse(PyObject *source, uint32_t *target)
+{
+    long value = PyLong_AsLong(source);
+    if (value == -1 && PyErr_Occurred())
+        return 0;
+    if (value < 0 || value > UINT32_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "Region out of bounds");
+        return 0;
+    }
+    *target = value;
+    return 1;
+}
+
+static int decode_scale_parse(PyObject *source, uint32_t *scale)
+{
+    long value = PyLong_AsLong(source);
+    if (value == -1 && PyErr_Occurred())
+        return 0;
+    if (value != 1 && value != 2 && value != 4 && value != 8)
+    {
+        PyErr_SetString(PyExc_ValueError, "Scale must be 1, 2, 4 or 8");
+        return 0;
+    }
+    *scale = value;
+    return 1;
+}
+
+// format is the only keyword argument any of the entry points take
+static int decode_keywords_parse(
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames,
+    Format *format)
+{
+    *format = FORMAT_RGBA;
+    if (!kwnames)
+        return 1;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(kwnames); i++)
+    {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        if (PyUnicode_CompareWithASCIIString(name, "format"))
+        {
+            PyErr_Format(
+                PyExc_TypeError, "Unexpected keyword argument %S", name);
+            return 0;
+        }
+        const char *value = PyUnicode_AsUTF8(args[nargs + i]);
+        if (!value)
+            return 0;
+        if (!format_from_name(value, format))
+        {
+            PyErr_Format(
+                PyExc_ValueError, "Unsupported format %s", value);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int decode_options_parse(
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames,
+    const DecodeMode mode,
+    DecodeOptions *options)
+{
+    options->has_region = mode == DECODE_REGION;
+    options->scale = 1;
+    if (!decode_keywords_parse(args, nargs, kwnames, &options->format))
+        return 0;
+
+    switch (mode)
+    {
+        case DECODE_FULL:
+            if (nargs != 1)
+            {
+                PyErr_SetString(
+                    PyExc_TypeError, "Expected exactly one argument");
+                return 0;
+            }
+            return 1;
+
+        case DECODE_REGION:
+            if (nargs != 5)
+            {
+                PyErr_SetString(
+                    PyExc_TypeError, "Expected exactly five arguments");
+                return 0;
+            }
+            return decode_u32_parse(args[1], &options->region.x)
+                && decode_u32_parse(args[2], &options->region.y)
+                && decode_u32_parse(args[3], &options->region.width)
+                && decode_u32_parse(args[4], &options->region.height);
+
+        case DECODE_THUMBNAIL:
+            if (nargs != 2)
+            {
+                PyErr_SetString(
+                    PyExc_TypeError, "Expected exactly two arguments");
+                return 0;
+            }
+            return decode_scale_parse(args[1], &options->scale);
+    }
+    return 0;
+}
+
+PyObject *decode_single(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames)
+{
+    DecodeOptions options;
+    if (!decode_options_parse(args, nargs, kwnames, DECODE_FULL, &options))
+        return NULL;
+    return decode_one(module, codec, args[0], &options);
+}
+
+PyObject *decode_region(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames)
+{
+    DecodeOptions options;
+    if (!decode_options_parse(args, nargs, kwnames, DECODE_REGION, &options))
+        return NULL;
+    return decode_one(module, codec, args[0], &options);
+}
+
+PyObject *decode_thumbnail(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames)
+{
+    DecodeOptions options;
+    if (!decode_options_parse(
+        args, nargs, kwnames, DECODE_THUMBNAIL, &options))
+    {
+        return NULL;
+    }
+    return decode_one(module, codec, args[0], &options);
+}
+
+PyObject *decode_many(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames)
+{
+    PyObject *output = NULL;
+    PyObject *sequence = NULL;
+    DecodeBatch batch = {NULL, NULL};
+    DecodeOptions options;
+    size_t worker_count = 0;
+    Py_ssize_t prepared_count = 0;
+    size_t scratch_count = 0;
+
+    options.has_region = 0;
+    options.scale = 1;
+    if (!decode_keywords_parse(args, nargs, kwnames, &options.format))
+        goto end;
+    if (nargs < 1 || nargs > 3)
+    {
+        PyErr_SetString(PyExc_TypeError, "Expected one to three arguments");
+        goto end;
+    }
+    if (nargs >= 2)
+    {
+        worker_count = PyLong_AsSize_t(args[1]);
+        if (worker_count == (size_t)-1 && PyErr_Occurred())
+            goto end;
+    }
+    if (nargs == 3 && !decode_scale_parse(args[2], &options.scale))
+        goto end;
+
+    sequence = PySequence_Fast(args[0], "Expected a sequence of buffers");
+    if (!sequence)
+        goto end;
+
+    const Py_ssize_t job_count = PySequence_Fast_GET_SIZE(sequence);
+    batch.jobs = PyMem_RawMalloc(
+        sizeof(DecodeJob) * (job_count ? job_count : 1));
+    if (!batch.jobs)
+    {
+        PyErr_SetNone(PyExc_MemoryError);
+        goto end;
+    }
+
+    PyObject **items = PySequence_Fast_ITEMS(sequence);
+    for (Py_ssize_t i = 0; i < job_count; i++)
+    {
+        if (!decode_job_prepare(&batch.jobs[i], codec, items[i], &options))
+            goto end;
+        prepared_count++;
+    }
+
+    // every worker reuses its scratch buffers across all images it decodes
+    const size_t actual_worker_count = pool_worker_count(
+        job_count, worker_count);
+    batch.scratches = PyMem_RawMalloc(
+        sizeof(Scratch*) * actual_worker_count);
+    if (!batch.scratches)
+    {
+        PyErr_SetNone(PyExc_MemoryError);
+        goto end;
+    }
+    for (; scratch_count < actual_worker_count; scratch_count++)
+    {
+        batch.scratches[scratch_count] = scratch_create();
+        if (!batch.scratches[scratch_count])
+        {
+            error_raise_pending();
+            goto end;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pool_run(decode_batch_task, &batch, job_count, actual_worker_count);
+    Py_END_ALLOW_THREADS
+
+    // failed images don't fail the whole batch: their slots hold the
+    // exception instead of the decoded image
+    output = PyList_New(job_count);
+    if (!output)
+        goto end;
+    for (Py_ssize_t i = 0; i < job_count; i++)
+    {
+        PyObject *item = batch.jobs[i].error.type
+            ? error_create_exception(&batch.jobs[i].error)
+            : decode_job_build_output(
+                &batch.jobs[i], decode_state(module)->result_type);
+        if (!item)
+        {
+            Py_CLEAR(output);
+            goto end;
+        }
+        PyList_SET_ITEM(output, i, item);
+    }
+
+end:
+    for (size_t i = 0; i < scratch_count; i++)
+        scratch_destroy(batch.scratches[i]);
+    if (batch.scratches)
+        PyMem_RawFree(batch.scratches);
+    for (Py_ssize_t i = 0; i < prepared_count; i++)
+        decode_job_release(&batch.jobs[i]);
+    if (batch.jobs)
+        PyMem_RawFree(batch.jobs);
+    Py_XDECREF(sequence);
+    return output;
+}
+
+PyObject *decoder_new(
+    PyTypeObject *type, PyObject *args, PyObject *kwds, const Codec *codec)
+{
+    static char *keywords[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", keywords))
+        return NULL;
+
+    // Decoder types can't be subclassed, so this is always the module that
+    // created the type
+    PyObject *module = PyType_GetModule(type);
+    if (!module)
+        return NULL;
+
+    Decoder *self = (Decoder*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->codec = codec;
+    self->result_type = decode_state(module)->result_type;
+    Py_INCREF(self->result_type);
+    self->scratch = scratch_create();
+    self->lock = PyThread_allocate_lock();
+    if (!self->scratch || !self->lock)
+    {
+        Py_DECREF(self);
+        PyErr_SetNone(PyExc_MemoryError);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static void decoder_dealloc(Decoder *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    if (self->scratch)
+        scratch_destroy(self->scratch);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    Py_XDECREF(self->result_type);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject *decoder_run(
+    Decoder *self,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames,
+    const DecodeMode mode)
+{
+    DecodeJob job;
+    DecodeOptions options;
+    if (!decode_options_parse(args, nargs, kwnames, mode, &options))
+        return NULL;
+    if (!decode_job_prepare(&job, self->codec, args[0], &options))
+        return NULL;
+
+    // the scratch buffers can't be shared, so concurrent calls on the same
+    // decoder take turns
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    decode_job_run(&job, self->scratch);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    return decode_job_finish(&job, self->result_type);
+}
+
+static PyObject *decoder_decode(
+    Decoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decoder_run(self, args, nargs, kwnames, DECODE_FULL);
+}
+
+static PyObject *decoder_decode_region(
+    Decoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decoder_run(self, args, nargs, kwnames, DECODE_REGION);
+}
+
+static PyObject *decoder_decode_thumbnail(
+    Decoder *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decoder_run(self, args, nargs, kwnames, DECODE_THUMBNAIL);
+}
+
+static PyMethodDef decoder_methods[] = {
+    {
+        "decode",
+        (PyCFunction)(void(*)(void))decoder_decode,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode an image, reusing the scratch buffers of earlier calls"
+    },
+    {
+        "decode_region",
+        (PyCFunction)(void(*)(void))decoder_decode_region,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode part of an image, given as (data, x, y, width, height)"
+    },
+    {
+        "decode_thumbnail",
+        (PyCFunction)(void(*)(void))decoder_decode_thumbnail,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode an image shrunk by a factor of 2, 4 or 8"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyObject *decoder_type_create(
+    PyObject *module, const char *name, newfunc tp_new)
+{
+    PyType_Slot slots[] = {
+        {Py_tp_new, tp_new},
+        {Py_tp_dealloc, decoder_dealloc},
+        {Py_tp_methods, decoder_methods},
+        {0, NULL},
+    };
+    PyType_Spec spec = {
+        name, sizeof(Decoder), 0, Py_TPFLAGS_DEFAULT, slots,
+    };
+    return PyType_FromModuleAndSpec(module, &spec, NULL);
+}
+
+int decode_module_init(PyObject *module)
+{
+    DecodeState *state = decode_state(module);
+    state->result_type = PyStructSequence_NewType(&decode_result_desc);
+    if (!state->result_type)
+        return 0;
+    Py_INCREF(state->result_type);
+    if (PyModule_AddObject(
+        module, "DecodedImage", (PyObject*)state->result_type))
+    {
+        Py_DECREF(state->result_type);
+        return 0;
+    }
+    return 1;
+}
+
+int decode_module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    DecodeState *state = decode_state(module);
+    if (state)
+        Py_VISIT(state->result_type);
+    return 0;
+}
+
+int decode_module_clear(PyObject *module)
+{
+    DecodeState *state = decode_state(module);
+    if (state)
+        Py_CLEAR(state->result_type);
+    return 0;
+}
+
+void decode_module_free(void *module)
+{
+    decode_module_clear((PyObject*)module);
+}
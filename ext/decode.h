@@ -0,0 +1,115 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <Python.h>
+#include "pixel.h"
+#include "scratch.h"
+
+// codecs may use the scratch slots below this one; the rest belong to the
+// row sinks
+#define SCRATCH_SINK_ROWS 5
+#define SCRATCH_SINK_SUMS 6
+#define SCRATCH_SINK_BOXES 7
+
+// Receives the image from a codec row by row. Codecs reconstruct row y into
+// the buffer returned by row_begin, which holds a full image row, and hand it
+// back with row_end. The buffer of the previous row stays valid until row_end
+// is called for the next one, so codecs can predict from it. Codecs only need
+// to reconstruct the leftmost width pixels of the topmost height rows; they
+// may reconstruct more, but must not rely on anything past width in the
+// previous row.
+typedef struct RowSink
+{
+    uint32_t width;
+    uint32_t height;
+    Pixel *(*row_begin)(struct RowSink *sink, const uint32_t y);
+    void (*row_end)(struct RowSink *sink, const uint32_t y);
+} RowSink;
+
+// Entry points of a single image format. Both functions run without the GIL
+// and must report failures through error_set().
+typedef struct
+{
+    int (*read_size)(
+        const unsigned char *data,
+        const size_t data_size,
+        uint32_t *image_width,
+        uint32_t *image_height);
+    int (*decode)(
+        const unsigned char *data,
+        const size_t data_size,
+        Scratch *scratch,
+        RowSink *sink);
+} Codec;
+
+typedef struct
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} DecodeRegion;
+
+// State of every module that decodes images. Their module definitions set
+// m_size to sizeof(DecodeState) and m_traverse, m_clear and m_free to the
+// decode_module_* functions below.
+typedef struct
+{
+    PyTypeObject *result_type;
+} DecodeState;
+
+// Entry points behind the module functions, all METH_FASTCALL |
+// METH_KEYWORDS, which pass their module along. Each of them takes an
+// optional format keyword naming the pixel format of the output (RGBA, BGRA,
+// RGB or RGBa) and returns a DecodedImage, which unpacks as (width, height,
+// data) and also tells whether the image is opaque.
+
+// Takes (data).
+PyObject *decode_single(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames);
+
+// Takes (data, x, y, width, height) and decodes only that part of the image.
+PyObject *decode_region(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames);
+
+// Takes (data, scale) and decodes the image shrunk by a factor of 2, 4 or 8,
+// averaging each scale x scale box of pixels.
+PyObject *decode_thumbnail(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames);
+
+// Takes (sequence of data[, worker_count[, scale]]) and decodes all of them
+// in parallel. Images that fail to decode get the exception in their slot.
+PyObject *decode_many(
+    PyObject *module,
+    const Codec *codec,
+    PyObject *const *args,
+    Py_ssize_t nargs,
+    PyObject *kwnames);
+
+// Creates the DecodedImage type of a module, from its exec slot.
+int decode_module_init(PyObject *module);
+int decode_module_traverse(PyObject *module, visitproc visit, void *arg);
+int decode_module_clear(PyObject *module);
+void decode_module_free(void *module);
+
+// A Python Decoder object keeps its scratch buffers alive between calls. Each
+// module creates its own Decoder type, whose tp_new passes the module's codec
+// on to decoder_new.
+PyObject *decoder_type_create(
+    PyObject *module, const char *name, newfunc tp_new);
+PyObject *decoder_new(
+    PyTypeObject *type, PyObject *args, PyObject *kwds, const Codec *codec);
+
+#endif
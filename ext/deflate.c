@@ -0,0 +1,244 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include <zlib.h>
+#include "error.h"
+#include "module.h"
+#include "pool.h"
+
+#define DEFAULT_CHUNK_SIZE (128 * 1024)
+#define MIN_CHUNK_SIZE (32 * 1024)
+#define WINDOW_SIZE (32 * 1024)
+#define HEADER_SIZE 2
+#define TRAILER_SIZE 4
+// a sync flush ends with an empty stored block, after up to a byte of padding
+#define FLUSH_MARKER_SIZE 6
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    uLong adler;
+    Error error;
+} DeflateChunk;
+
+typedef struct
+{
+    const unsigned char *input;
+    size_t input_size;
+    size_t chunk_size;
+    size_t chunk_count;
+    int level;
+    DeflateChunk *chunks;
+} DeflateJob;
+
+// Compresses one chunk into raw deflate data. Every chunk but the last ends
+// on a sync flush, which leaves the stream byte aligned and without a final
+// block, so the chunks can simply be concatenated. Priming each chunk with
+// the tail of the previous one keeps the ratio close to that of a single
+// stream.
+static void deflate_chunk_task(void *context, size_t worker, size_t index)
+{
+    DeflateJob *job = context;
+    DeflateChunk *chunk = &job->chunks[index];
+    const size_t start = index * job->chunk_size;
+    const size_t size = start + job->chunk_size < job->input_size
+        ? job->chunk_size
+        : job->input_size - start;
+    const int is_last = index + 1 == job->chunk_count;
+    z_stream stream = {0};
+
+    chunk->adler = adler32(1, job->input + start, size);
+
+    if (deflateInit2(
+            &stream,
+            job->level,
+            Z_DEFLATED,
+            -MAX_WBITS,
+            8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        error_set_no_memory();
+        error_fetch(&chunk->error);
+        return;
+    }
+
+    const size_t capacity = deflateBound(&stream, size) + FLUSH_MARKER_SIZE;
+    chunk->data = PyMem_RawMalloc(capacity);
+    if (!chunk->data)
+    {
+        error_set_no_memory();
+        goto end;
+    }
+
+    if (start)
+    {
+        const size_t dictionary_size = start < WINDOW_SIZE
+            ? start
+            : WINDOW_SIZE;
+        deflateSetDictionary(
+            &stream, job->input + start - dictionary_size, dictionary_size);
+    }
+
+    stream.next_in = (Bytef*)(job->input + start);
+    stream.avail_in = size;
+    stream.next_out = chunk->data;
+    stream.avail_out = capacity;
+    const int result = deflate(&stream, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (result != (is_last ? Z_STREAM_END : Z_OK) || stream.avail_in)
+    {
+        error_set(PyExc_RuntimeError, "Compression failed");
+        goto end;
+    }
+    chunk->size = capacity - stream.avail_out;
+
+end:
+    deflateEnd(&stream);
+    error_fetch(&chunk->error);
+}
+
+static void deflate_header_write(unsigned char *target, const int level)
+{
+    // FLEVEL only hints at the level used; inflaters ignore it
+    const int flevel = level == Z_DEFAULT_COMPRESSION ? 2
+        : level < 2 ? 0
+        : level < 6 ? 1
+        : level == 6 ? 2
+        : 3;
+    const unsigned int header = (0x78 << 8) | (flevel << 6);
+    target[0] = header >> 8;
+    target[1] = (header & 0xFF) + (31 - header % 31) % 31;
+}
+
+static PyObject *deflate_compress(
+    PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {
+        "data", "level", "chunk_size", "worker_count", NULL};
+    Py_buffer input = {0};
+    int level = Z_DEFAULT_COMPRESSION;
+    Py_ssize_t chunk_size = DEFAULT_CHUNK_SIZE;
+    Py_ssize_t worker_count = 0;
+    DeflateJob job = {0};
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwargs,
+            "y*|inn",
+            keywords,
+            &input,
+            &level,
+            &chunk_size,
+            &worker_count))
+    {
+        return NULL;
+    }
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid compression level");
+        goto end;
+    }
+    if (chunk_size < MIN_CHUNK_SIZE)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid chunk size");
+        goto end;
+    }
+    if (worker_count < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid worker count");
+        goto end;
+    }
+
+    job.input = input.buf;
+    job.input_size = input.len;
+    job.chunk_size = chunk_size;
+    job.chunk_count = input.len ? (input.len - 1) / chunk_size + 1 : 1;
+    job.level = level;
+    job.chunks = PyMem_RawCalloc(job.chunk_count, sizeof(DeflateChunk));
+    if (!job.chunks)
+    {
+        PyErr_SetNone(PyExc_MemoryError);
+        goto end;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pool_run(
+        deflate_chunk_task,
+        &job,
+        job.chunk_count,
+        pool_worker_count(job.chunk_count, worker_count));
+    Py_END_ALLOW_THREADS
+
+    size_t output_size = HEADER_SIZE + TRAILER_SIZE;
+    for (size_t i = 0; i < job.chunk_count; i++)
+    {
+        if (job.chunks[i].error.type)
+        {
+            error_raise(&job.chunks[i].error);
+            goto end;
+        }
+        output_size += job.chunks[i].size;
+    }
+
+    output = PyBytes_FromStringAndSize(NULL, output_size);
+    if (!output)
+        goto end;
+    unsigned char *target = (unsigned char*)PyBytes_AS_STRING(output);
+    deflate_header_write(target, level);
+    target += HEADER_SIZE;
+
+    uLong adler = job.chunks[0].adler;
+    for (size_t i = 0; i < job.chunk_count; i++)
+    {
+        memcpy(target, job.chunks[i].data, job.chunks[i].size);
+        target += job.chunks[i].size;
+        if (i)
+        {
+            const size_t size = i + 1 < job.chunk_count
+                ? job.chunk_size
+                : job.input_size - i * job.chunk_size;
+            adler = adler32_combine(adler, job.chunks[i].adler, size);
+        }
+    }
+    target[0] = adler >> 24;
+    target[1] = adler >> 16;
+    target[2] = adler >> 8;
+    target[3] = adler;
+
+end:
+    if (job.chunks)
+    {
+        for (size_t i = 0; i < job.chunk_count; i++)
+            PyMem_RawFree(job.chunks[i].data);
+        PyMem_RawFree(job.chunks);
+    }
+    PyBuffer_Release(&input);
+    return output;
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "compress",
+        (PyCFunction)deflate_compress,
+        METH_VARARGS | METH_KEYWORDS,
+        "Compress data into a zlib stream, deflating chunks of it in parallel"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyModuleDef_Slot module_slots[] = {
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib._deflate",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__deflate(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
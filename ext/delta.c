@@ -0,0 +1,451 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#include "error.h"
+#include "hash.h"
+#include "module.h"
+
+// A delta rebuilds one archive from the previous version of it. It is laid
+// out as follows, all numbers little endian:
+//
+//   magic "ARCDELTA", u32 version, u32 name size, name (UTF-8)
+//   u64 source size, u64 source XXH64, u64 target size, u64 target XXH64
+//   u64 operation count, then per operation:
+//     u32 origin (0: source archive, 1: delta file), u32 zero,
+//     u64 offset within the origin, u64 size
+//   the payloads the operations refer to
+//
+// The operations write the target from start to end. lib/delta.py writes
+// deltas; this only applies them.
+#define DELTA_MAGIC "ARCDELTA"
+#define DELTA_MAGIC_SIZE 8
+#define DELTA_VERSION 1
+#define DELTA_MAX_NAME_SIZE 4096
+#define DELTA_SIZES_SIZE (5 * 8)
+#define DELTA_OPERATION_SIZE 24
+#define DELTA_ORIGIN_SOURCE 0
+#define DELTA_ORIGIN_PATCH 1
+#define BUFFER_SIZE (1024 * 1024)
+
+typedef struct
+{
+    uint32_t origin;
+    uint64_t offset;
+    uint64_t size;
+} DeltaOperation;
+
+typedef struct
+{
+    int source_fd;
+    int patch_fd;
+    int target_fd;
+    unsigned char *buffer;
+    // errno of a failed system call; anything else goes through error_set
+    int error_number;
+} ApplyJob;
+
+static uint32_t read_u32_le(const unsigned char *data)
+{
+    return (uint32_t)data[0]
+        | (uint32_t)data[1] << 8
+        | (uint32_t)data[2] << 16
+        | (uint32_t)data[3] << 24;
+}
+
+static uint64_t read_u64_le(const unsigned char *data)
+{
+    return (uint64_t)read_u32_le(data) | (uint64_t)read_u32_le(data + 4) << 32;
+}
+
+static int fail_errno(ApplyJob *job)
+{
+    job->error_number = errno ? errno : EIO;
+    return 0;
+}
+
+// pread where there is one. Elsewhere the read is positioned by hand and
+// the descriptor's position put back afterwards, so that callers reading
+// through a buffered file object are not thrown off either way.
+static ssize_t read_at(
+    const int fd, void *data, const size_t size, const uint64_t offset)
+{
+#ifdef _WIN32
+    const __int64 position = _lseeki64(fd, 0, SEEK_CUR);
+    if (position < 0 || _lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+        return -1;
+    const int count = read(
+        fd, data, size < INT_MAX ? (unsigned int)size : INT_MAX);
+    const int saved_errno = errno;
+    if (_lseeki64(fd, position, SEEK_SET) < 0)
+        return -1;
+    errno = saved_errno;
+    return count;
+#else
+    return pread(fd, data, size, offset);
+#endif
+}
+
+static int read_exact(
+    ApplyJob *job,
+    const int fd,
+    void *data,
+    const size_t size,
+    const uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t count = read_at(
+            fd, (unsigned char*)data + done, size - done, offset + done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return fail_errno(job);
+        if (!count)
+        {
+            error_set(PyExc_ValueError, "Unexpected end of file");
+            return 0;
+        }
+        done += count;
+    }
+    return 1;
+}
+
+static int write_all(
+    ApplyJob *job, const unsigned char *data, const size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t count = write(job->target_fd, data + done, size - done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return fail_errno(job);
+        done += count;
+    }
+    return 1;
+}
+
+static int file_size(ApplyJob *job, const int fd, uint64_t *size)
+{
+#ifdef _WIN32
+    struct _stati64 info;
+    if (_fstati64(fd, &info))
+        return fail_errno(job);
+#else
+    struct stat info;
+    if (fstat(fd, &info))
+        return fail_errno(job);
+#endif
+    *size = info.st_size;
+    return 1;
+}
+
+static int hash_range(
+    ApplyJob *job, const int fd, const uint64_t size, uint64_t *digest)
+{
+    Hash hash;
+    hash_init(&hash, 0);
+    for (uint64_t offset = 0; offset < size; offset += BUFFER_SIZE)
+    {
+        const size_t chunk_size = size - offset < BUFFER_SIZE
+            ? size - offset
+            : BUFFER_SIZE;
+        if (!read_exact(job, fd, job->buffer, chunk_size, offset))
+            return 0;
+        hash_update(&hash, job->buffer, chunk_size);
+    }
+    *digest = hash_digest(&hash);
+    return 1;
+}
+
+// Appends a range of another file to the target. copy_file_range lets the
+// kernel move the data, sharing extents where the file system supports it;
+// where it can't be used the data goes through the buffer.
+static int copy_range(
+    ApplyJob *job, const int fd, uint64_t offset, uint64_t size)
+{
+#ifdef __linux__
+    while (size)
+    {
+        loff_t source_offset = offset;
+        const ssize_t count = copy_file_range(
+            fd, &source_offset, job->target_fd, NULL, size, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0
+            && (errno == ENOSYS
+                || errno == EXDEV
+                || errno == EINVAL
+                || errno == EOPNOTSUPP))
+        {
+            break;
+        }
+        if (count < 0)
+            return fail_errno(job);
+        if (!count)
+        {
+            error_set(PyExc_ValueError, "Unexpected end of file");
+            return 0;
+        }
+        offset += count;
+        size -= count;
+    }
+#endif
+
+    while (size)
+    {
+        const size_t chunk_size = size < BUFFER_SIZE ? size : BUFFER_SIZE;
+        if (!read_exact(job, fd, job->buffer, chunk_size, offset)
+            || !write_all(job, job->buffer, chunk_size))
+        {
+            return 0;
+        }
+        offset += chunk_size;
+        size -= chunk_size;
+    }
+    return 1;
+}
+
+static int delta_apply_job(ApplyJob *job)
+{
+    unsigned char header[DELTA_MAGIC_SIZE + 8];
+    unsigned char sizes[DELTA_SIZES_SIZE];
+    DeltaOperation *operations = NULL;
+    int ret = 0;
+
+    uint64_t patch_size;
+    if (!file_size(job, job->patch_fd, &patch_size)
+        || !read_exact(job, job->patch_fd, header, sizeof(header), 0))
+    {
+        goto end;
+    }
+    if (memcmp(header, DELTA_MAGIC, DELTA_MAGIC_SIZE))
+    {
+        error_set(PyExc_ValueError, "Not a delta");
+        goto end;
+    }
+    if (read_u32_le(header + DELTA_MAGIC_SIZE) != DELTA_VERSION)
+    {
+        error_set(PyExc_ValueError, "Unsupported delta version");
+        goto end;
+    }
+    const uint32_t name_size = read_u32_le(header + DELTA_MAGIC_SIZE + 4);
+    if (name_size > DELTA_MAX_NAME_SIZE)
+    {
+        error_set(PyExc_ValueError, "Corrupt delta");
+        goto end;
+    }
+    uint64_t position = sizeof(header) + name_size;
+    if (!read_exact(job, job->patch_fd, sizes, sizeof(sizes), position))
+        goto end;
+    position += sizeof(sizes);
+    const uint64_t source_size = read_u64_le(sizes);
+    const uint64_t source_hash = read_u64_le(sizes + 8);
+    const uint64_t target_size = read_u64_le(sizes + 16);
+    const uint64_t target_hash = read_u64_le(sizes + 24);
+    const uint64_t operation_count = read_u64_le(sizes + 32);
+
+    // the source is checked in full before anything is written, so a delta
+    // is never applied on top of the wrong archive
+    uint64_t size;
+    uint64_t digest;
+    if (!file_size(job, job->source_fd, &size))
+        goto end;
+    if (size != source_size
+        || !hash_range(job, job->source_fd, size, &digest)
+        || digest != source_hash)
+    {
+        if (!job->error_number)
+        {
+            error_set(
+                PyExc_ValueError,
+                "The archive is not the one the delta was made from");
+        }
+        goto end;
+    }
+
+    if (operation_count > (patch_size - position) / DELTA_OPERATION_SIZE)
+    {
+        error_set(PyExc_ValueError, "Corrupt delta");
+        goto end;
+    }
+    operations = PyMem_RawMalloc(operation_count * sizeof(DeltaOperation) + 1);
+    if (!operations)
+    {
+        error_set_no_memory();
+        goto end;
+    }
+    uint64_t total_size = 0;
+    for (uint64_t i = 0; i < operation_count; i++)
+    {
+        unsigned char data[DELTA_OPERATION_SIZE];
+        if (!read_exact(job, job->patch_fd, data, sizeof(data), position))
+            goto end;
+        position += sizeof(data);
+        DeltaOperation *operation = &operations[i];
+        operation->origin = read_u32_le(data);
+        operation->offset = read_u64_le(data + 8);
+        operation->size = read_u64_le(data + 16);
+        const uint64_t origin_size = operation->origin == DELTA_ORIGIN_SOURCE
+            ? source_size
+            : patch_size;
+        if ((operation->origin != DELTA_ORIGIN_SOURCE
+                && operation->origin != DELTA_ORIGIN_PATCH)
+            || operation->size > origin_size
+            || operation->offset > origin_size - operation->size
+            || operation->size > UINT64_MAX - total_size)
+        {
+            error_set(PyExc_ValueError, "Corrupt delta");
+            goto end;
+        }
+        total_size += operation->size;
+    }
+    if (total_size != target_size)
+    {
+        error_set(PyExc_ValueError, "Corrupt delta");
+        goto end;
+    }
+
+    for (uint64_t i = 0; i < operation_count; i++)
+    {
+        const DeltaOperation *operation = &operations[i];
+        if (!copy_range(
+                job,
+                operation->origin == DELTA_ORIGIN_SOURCE
+                    ? job->source_fd
+                    : job->patch_fd,
+                operation->offset,
+                operation->size))
+        {
+            goto end;
+        }
+    }
+
+    // read back what actually landed on disk
+    if (!file_size(job, job->target_fd, &size))
+        goto end;
+    if (size != target_size
+        || !hash_range(job, job->target_fd, size, &digest)
+        || digest != target_hash)
+    {
+        if (!job->error_number)
+        {
+            error_set(
+                PyExc_ValueError,
+                "The patched archive does not match the delta");
+        }
+        goto end;
+    }
+    ret = 1;
+
+end:
+    PyMem_RawFree(operations);
+    return ret;
+}
+
+static PyObject *raise_job_error(const ApplyJob *job)
+{
+    if (job->error_number)
+    {
+        errno = job->error_number;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return error_raise_pending();
+}
+
+static PyObject *delta_apply(PyObject *self, PyObject *args)
+{
+    ApplyJob job = {0};
+    if (!PyArg_ParseTuple(
+            args, "iii", &job.source_fd, &job.patch_fd, &job.target_fd))
+    {
+        return NULL;
+    }
+
+    job.buffer = PyMem_RawMalloc(BUFFER_SIZE);
+    if (!job.buffer)
+        return PyErr_NoMemory();
+
+    int ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = delta_apply_job(&job);
+    Py_END_ALLOW_THREADS
+
+    PyMem_RawFree(job.buffer);
+    if (!ok)
+        return raise_job_error(&job);
+    Py_RETURN_NONE;
+}
+
+static PyObject *delta_hash_file(PyObject *self, PyObject *args)
+{
+    ApplyJob job = {0};
+    int fd;
+    if (!PyArg_ParseTuple(args, "i", &fd))
+        return NULL;
+
+    job.buffer = PyMem_RawMalloc(BUFFER_SIZE);
+    if (!job.buffer)
+        return PyErr_NoMemory();
+
+    int ok;
+    uint64_t size = 0;
+    uint64_t digest = 0;
+    Py_BEGIN_ALLOW_THREADS
+    ok = file_size(&job, fd, &size) && hash_range(&job, fd, size, &digest);
+    Py_END_ALLOW_THREADS
+
+    PyMem_RawFree(job.buffer);
+    if (!ok)
+        return raise_job_error(&job);
+    return Py_BuildValue("KK", size, digest);
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "apply",
+        delta_apply,
+        METH_VARARGS,
+        "Write the archive a delta makes of the source archive to the target, "
+        "given as file descriptors, checking both against the delta's hashes"
+    },
+    {
+        "hash_file",
+        delta_hash_file,
+        METH_VARARGS,
+        "Size and XXH64 of the whole file behind a file descriptor"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static int delta_exec(PyObject *module)
+{
+    return PyModule_AddIntConstant(module, "VERSION", DELTA_VERSION);
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, delta_exec},
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib._delta",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__delta(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
@@ -0,0 +1,126 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include "kernels.h"
+#include "module.h"
+#include "tables.h"
+
+static PyObject *engine_xor_words(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+    unsigned int key;
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*I", &input, &key))
+        return NULL;
+
+    output = PyBytes_FromStringAndSize(input.buf, input.len);
+    if (output)
+    {
+        kernels_get()->xor_words(
+            (unsigned char*)PyBytes_AS_STRING(output), input.len, key);
+    }
+    PyBuffer_Release(&input);
+    return output;
+}
+
+static PyObject *engine_xor_name(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+    Py_buffer name = {0};
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*y*", &input, &name))
+        return NULL;
+    if (!name.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "Empty name");
+        goto end;
+    }
+
+    output = PyBytes_FromStringAndSize(input.buf, input.len);
+    if (output)
+    {
+        // the data is split into as many blocks as the name has bytes, each
+        // XORed with one of them; the last block and the remainder are left
+        // as they are
+        unsigned char *data = (unsigned char*)PyBytes_AS_STRING(output);
+        const unsigned char *name_data = name.buf;
+        const size_t block_size = input.len / name.len;
+        for (Py_ssize_t i = 0; i + 1 < name.len; i++)
+        {
+            kernels_get()->xor_bytes(
+                data + i * block_size, block_size, name_data[i]);
+        }
+    }
+
+end:
+    PyBuffer_Release(&name);
+    PyBuffer_Release(&input);
+    return output;
+}
+
+// ECMA-182 CRC-64, not reflected, with all ones as both the initial value and
+// the final XOR. It only ever hashes file names, so a byte-wise table is all
+// it takes.
+static PyObject *engine_crc64(PyObject *self, PyObject *args)
+{
+    Py_buffer input = {0};
+
+    if (!PyArg_ParseTuple(args, "y*", &input))
+        return NULL;
+
+    const unsigned char *data = input.buf;
+    uint64_t crc = UINT64_MAX;
+    for (Py_ssize_t i = 0; i < input.len; i++)
+        crc = crc64_table[(crc >> 56) ^ data[i]] ^ (crc << 8);
+    PyBuffer_Release(&input);
+    return PyLong_FromUnsignedLongLong(crc ^ UINT64_MAX);
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "xor_words",
+        engine_xor_words,
+        METH_VARARGS,
+        "XOR every whole little endian 32-bit word of data with a key"
+    },
+    {
+        "xor_name",
+        engine_xor_name,
+        METH_VARARGS,
+        "XOR data with a name, one equal block per byte of the name but the "
+        "last"
+    },
+    {
+        "crc64",
+        engine_crc64,
+        METH_VARARGS,
+        "ECMA-182 CRC-64 of data, as used for file name hashes"
+    },
+    KERNELS_METHODS,
+    {NULL, NULL, 0, NULL}
+};
+
+static int engine_exec(PyObject *module)
+{
+    kernels_init();
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, engine_exec},
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib._engine",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__engine(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
@@ -0,0 +1,55 @@
+#include <Python.h>
+#include "error.h"
+
+static _Thread_local Error pending_error = {NULL, NULL};
+
+void error_set(PyObject *type, const char *message)
+{
+    assert(type);
+    pending_error.type = type;
+    pending_error.message = message;
+}
+
+void error_set_no_memory(void)
+{
+    error_set(PyExc_MemoryError, NULL);
+}
+
+int error_fetch(Error *error)
+{
+    assert(error);
+    *error = pending_error;
+    pending_error.type = NULL;
+    pending_error.message = NULL;
+    return error->type != NULL;
+}
+
+PyObject *error_raise(const Error *error)
+{
+    assert(error);
+    if (!error->type)
+        PyErr_SetString(PyExc_SystemError, "Error reported without details");
+    else if (error->message)
+        PyErr_SetString(error->type, error->message);
+    else
+        PyErr_SetNone(error->type);
+    return NULL;
+}
+
+PyObject *error_raise_pending(void)
+{
+    Error error;
+    error_fetch(&error);
+    return error_raise(&error);
+}
+
+PyObject *error_create_exception(const Error *error)
+{
+    assert(error);
+    if (!error->type)
+        return PyObject_CallFunction(
+            PyExc_SystemError, "s", "Error reported without details");
+    if (error->message)
+        return PyObject_CallFunction(error->type, "s", error->message);
+    return PyObject_CallFunction(error->type, NULL);
+}
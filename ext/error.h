@@ -0,0 +1,24 @@
+#ifndef ERROR_H
+#define ERROR_H
+
+#include <Python.h>
+
+// Codec code may run on threads that don't hold the GIL, so it can't touch
+// the Python error indicator directly. Instead, it records a pending error
+// per thread, which is turned into a Python exception once the GIL is held
+// again.
+typedef struct
+{
+    PyObject *type;
+    const char *message;
+} Error;
+
+void error_set(PyObject *type, const char *message);
+void error_set_no_memory(void);
+int error_fetch(Error *error);
+
+PyObject *error_raise(const Error *error);
+PyObject *error_raise_pending(void);
+PyObject *error_create_exception(const Error *error);
+
+#endif
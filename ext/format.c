@@ -0,0 +1,207 @@
+#include <Python.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "format.h"
+#include "stats.h"
+
+static const struct
+{
+    const char *name;
+    size_t pixel_size;
+} format_infos[] = {
+    [FORMAT_RGBA] = {"RGBA", 4},
+    [FORMAT_BGRA] = {"BGRA", 4},
+    [FORMAT_RGB] = {"RGB", 3},
+    [FORMAT_RGBA_PREMULTIPLIED] = {"RGBa", 4},
+};
+
+#define FORMAT_COUNT (sizeof(format_infos) / sizeof(format_infos[0]))
+
+int format_from_name(const char *name, Format *format)
+{
+    assert(name);
+    assert(format);
+    for (size_t i = 0; i < FORMAT_COUNT; i++)
+    {
+        if (!strcmp(format_infos[i].name, name))
+        {
+            *format = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *format_name(const Format format)
+{
+    return format_infos[format].name;
+}
+
+size_t format_pixel_size(const Format format)
+{
+    return format_infos[format].pixel_size;
+}
+
+static inline uint32_t format_load(const Pixel *source)
+{
+    uint32_t value;
+    memcpy(&value, source, sizeof(value));
+    return value;
+}
+
+static inline void format_store(unsigned char *target, const uint32_t value)
+{
+    memcpy(target, &value, sizeof(value));
+}
+
+// x * a / 255, rounded
+static inline uint8_t format_premultiply(const uint8_t x, const uint8_t a)
+{
+    const uint32_t t = x * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void format_convert_bgra(
+    unsigned char *target, const Pixel *source, const size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i mask_ga = _mm_set1_epi32(0xFF00FF00);
+    const __m128i mask_b = _mm_set1_epi32(0x000000FF);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(source + i));
+        __m128i y = _mm_or_si128(
+            _mm_and_si128(x, mask_ga),
+            _mm_or_si128(
+                _mm_and_si128(_mm_srli_epi32(x, 16), mask_b),
+                _mm_slli_epi32(_mm_and_si128(x, mask_b), 16)));
+        _mm_storeu_si128((__m128i*)(target + i * 4), y);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const uint32_t x = format_load(source + i);
+        format_store(
+            target + i * 4,
+            (x & 0xFF00FF00) | ((x >> 16) & 0xFF) | ((x & 0xFF) << 16));
+    }
+}
+
+static void format_convert_rgb(
+    unsigned char *target, const Pixel *source, const size_t count)
+{
+    // four pixels make three whole words
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint32_t p0 = format_load(source + i);
+        const uint32_t p1 = format_load(source + i + 1);
+        const uint32_t p2 = format_load(source + i + 2);
+        const uint32_t p3 = format_load(source + i + 3);
+        format_store(target, (p0 & 0xFFFFFF) | (p1 << 24));
+        format_store(target + 4, ((p1 >> 8) & 0xFFFF) | (p2 << 16));
+        format_store(target + 8, ((p2 >> 16) & 0xFF) | (p3 << 8));
+        target += 12;
+    }
+    for (; i < count; i++)
+    {
+        *target++ = source[i].r;
+        *target++ = source[i].g;
+        *target++ = source[i].b;
+    }
+}
+
+static void format_convert_premultiplied(
+    unsigned char *target, const Pixel *source, const size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(128);
+    const __m128i mask_alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(source + i));
+        __m128i halves[2] = {
+            _mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+        for (int j = 0; j < 2; j++)
+        {
+            __m128i alpha = _mm_shufflehi_epi16(
+                _mm_shufflelo_epi16(halves[j], _MM_SHUFFLE(3, 3, 3, 3)),
+                _MM_SHUFFLE(3, 3, 3, 3));
+            __m128i t = _mm_add_epi16(
+                _mm_mullo_epi16(halves[j], alpha), rounding);
+            t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            halves[j] = _mm_or_si128(
+                _mm_andnot_si128(mask_alpha, t),
+                _mm_and_si128(mask_alpha, halves[j]));
+        }
+        _mm_storeu_si128(
+            (__m128i*)(target + i * 4),
+            _mm_packus_epi16(halves[0], halves[1]));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const uint8_t a = source[i].a;
+        target[i * 4 + 0] = format_premultiply(source[i].r, a);
+        target[i * 4 + 1] = format_premultiply(source[i].g, a);
+        target[i * 4 + 2] = format_premultiply(source[i].b, a);
+        target[i * 4 + 3] = a;
+    }
+}
+
+void format_convert(
+    const Format format,
+    unsigned char *target,
+    const Pixel *source,
+    const size_t count)
+{
+    assert(target);
+    assert(source);
+    STATS_BEGIN(start_clock);
+    switch (format)
+    {
+        case FORMAT_RGBA:
+            memcpy(target, source, count * sizeof(Pixel));
+            break;
+        case FORMAT_BGRA:
+            format_convert_bgra(target, source, count);
+            break;
+        case FORMAT_RGB:
+            format_convert_rgb(target, source, count);
+            break;
+        case FORMAT_RGBA_PREMULTIPLIED:
+            format_convert_premultiplied(target, source, count);
+            break;
+    }
+    STATS_END(
+        STATS_CONVERT,
+        start_clock,
+        count * sizeof(Pixel),
+        count * format_pixel_size(format));
+}
+
+int format_is_opaque(const Pixel *source, const size_t count)
+{
+    assert(source);
+    size_t i = 0;
+    uint32_t all = 0xFFFFFFFF;
+#ifdef __SSE2__
+    __m128i all_wide = _mm_set1_epi32(-1);
+    for (; i + 4 <= count; i += 4)
+    {
+        all_wide = _mm_and_si128(
+            all_wide, _mm_loadu_si128((const __m128i*)(source + i)));
+    }
+    all_wide = _mm_and_si128(all_wide, _mm_srli_si128(all_wide, 8));
+    all_wide = _mm_and_si128(all_wide, _mm_srli_si128(all_wide, 4));
+    all = _mm_cvtsi128_si32(all_wide);
+#endif
+    for (; i < count; i++)
+        all &= format_load(source + i);
+    return (all >> 24) == 0xFF;
+}
@@ -0,0 +1,32 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include "pixel.h"
+
+// Layouts decoded pixels can be delivered in, named after the matching PIL
+// raw modes. RGBa is RGBA with the colour channels premultiplied by alpha.
+typedef enum
+{
+    FORMAT_RGBA,
+    FORMAT_BGRA,
+    FORMAT_RGB,
+    FORMAT_RGBA_PREMULTIPLIED,
+} Format;
+
+int format_from_name(const char *name, Format *format);
+const char *format_name(const Format format);
+size_t format_pixel_size(const Format format);
+
+// Packs RGBA pixels into the given format. The target must not overlap the
+// source.
+void format_convert(
+    const Format format,
+    unsigned char *target,
+    const Pixel *source,
+    const size_t count);
+
+// Tells whether every pixel has an alpha of 0xFF.
+int format_is_opaque(const Pixel *source, const size_t count);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef GOLOMB_H
+#define GOLOMB_H
+
+#include <stdint.h>
+
+#define GOLOMB_N_COUNT 4
+#define GOLOMB_A_COUNT (GOLOMB_N_COUNT * 2 * 128)
+
+// Number of plain bits that follow the unary part of a TLG6 Golomb code,
+// indexed by the running sum of recent magnitudes and the position within
+// the current group of four values. Defined with the other generated tables.
+extern const uint8_t golomb_bit_size_table[GOLOMB_A_COUNT][GOLOMB_N_COUNT];
+
+#endif
@@ -0,0 +1,233 @@
+#include <Python.h>
+#include <pythread.h>
+#include <string.h>
+#include "hash.h"
+
+#define PRIME_1 0x9E3779B185EBCA87ULL
+#define PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME_3 0x165667B19E3779F9ULL
+#define PRIME_4 0x85EBCA77C2B2AE63ULL
+#define PRIME_5 0x27D4EB2F165667C5ULL
+
+#define STRIPE_SIZE 32
+
+static inline uint64_t hash_rotate(const uint64_t x, const int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t hash_read_u64(const unsigned char *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash_read_u32(const unsigned char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_round(uint64_t accumulator, const uint64_t input)
+{
+    accumulator += input * PRIME_2;
+    accumulator = hash_rotate(accumulator, 31);
+    return accumulator * PRIME_1;
+}
+
+static inline uint64_t hash_merge(uint64_t accumulator, const uint64_t value)
+{
+    accumulator ^= hash_round(0, value);
+    return accumulator * PRIME_1 + PRIME_4;
+}
+
+static void hash_stripe(Hash *hash, const unsigned char *data)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        hash->accumulators[i] = hash_round(
+            hash->accumulators[i], hash_read_u64(data + i * 8));
+    }
+}
+
+void hash_init(Hash *hash, const uint64_t seed)
+{
+    assert(hash);
+    hash->accumulators[0] = seed + PRIME_1 + PRIME_2;
+    hash->accumulators[1] = seed + PRIME_2;
+    hash->accumulators[2] = seed;
+    hash->accumulators[3] = seed - PRIME_1;
+    hash->buffer_size = 0;
+    hash->total_size = 0;
+    hash->seed = seed;
+}
+
+void hash_update(Hash *hash, const void *data, size_t data_size)
+{
+    assert(hash);
+    const unsigned char *input = data;
+    hash->total_size += data_size;
+
+    if (hash->buffer_size)
+    {
+        size_t fill = STRIPE_SIZE - hash->buffer_size;
+        if (fill > data_size)
+            fill = data_size;
+        memcpy(hash->buffer + hash->buffer_size, input, fill);
+        hash->buffer_size += fill;
+        input += fill;
+        data_size -= fill;
+        if (hash->buffer_size < STRIPE_SIZE)
+            return;
+        hash_stripe(hash, hash->buffer);
+        hash->buffer_size = 0;
+    }
+
+    for (; data_size >= STRIPE_SIZE; data_size -= STRIPE_SIZE)
+    {
+        hash_stripe(hash, input);
+        input += STRIPE_SIZE;
+    }
+
+    memcpy(hash->buffer, input, data_size);
+    hash->buffer_size = data_size;
+}
+
+uint64_t hash_digest(const Hash *hash)
+{
+    assert(hash);
+    const uint64_t *accumulators = hash->accumulators;
+    uint64_t result;
+    if (hash->total_size >= STRIPE_SIZE)
+    {
+        result = hash_rotate(accumulators[0], 1)
+            + hash_rotate(accumulators[1], 7)
+            + hash_rotate(accumulators[2], 12)
+            + hash_rotate(accumulators[3], 18);
+        for (int i = 0; i < 4; i++)
+            result = hash_merge(result, accumulators[i]);
+    }
+    else
+        result = hash->seed + PRIME_5;
+    result += hash->total_size;
+
+    const unsigned char *tail = hash->buffer;
+    size_t tail_size = hash->buffer_size;
+    for (; tail_size >= 8; tail_size -= 8, tail += 8)
+    {
+        result ^= hash_round(0, hash_read_u64(tail));
+        result = hash_rotate(result, 27) * PRIME_1 + PRIME_4;
+    }
+    if (tail_size >= 4)
+    {
+        result ^= hash_read_u32(tail) * PRIME_1;
+        result = hash_rotate(result, 23) * PRIME_2 + PRIME_3;
+        tail += 4;
+        tail_size -= 4;
+    }
+    for (; tail_size; tail_size--, tail++)
+    {
+        result ^= *tail * PRIME_5;
+        result = hash_rotate(result, 11) * PRIME_1;
+    }
+
+    result ^= result >> 33;
+    result *= PRIME_2;
+    result ^= result >> 29;
+    result *= PRIME_3;
+    result ^= result >> 32;
+    return result;
+}
+
+typedef struct
+{
+    PyObject_HEAD
+    Hash hash;
+    PyThread_type_lock lock;
+} Hasher;
+
+static PyObject *hasher_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *keywords[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "", keywords))
+        return NULL;
+
+    Hasher *self = (Hasher*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    hash_init(&self->hash, 0);
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock)
+    {
+        Py_DECREF(self);
+        PyErr_SetNone(PyExc_MemoryError);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+static void hasher_dealloc(Hasher *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject *hasher_update(Hasher *self, PyObject *args)
+{
+    Py_buffer data = {0};
+    if (!PyArg_ParseTuple(args, "y*", &data))
+        return NULL;
+
+    // whole images go through here, so let other threads run meanwhile
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    hash_update(&self->hash, data.buf, data.len);
+    PyThread_release_lock(self->lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *hasher_digest(Hasher *self, PyObject *Py_UNUSED(args))
+{
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    const uint64_t digest = hash_digest(&self->hash);
+    PyThread_release_lock(self->lock);
+    return PyLong_FromUnsignedLongLong(digest);
+}
+
+static PyMethodDef hasher_methods[] = {
+    {
+        "update",
+        (PyCFunction)hasher_update,
+        METH_VARARGS,
+        "Feed more data into the hash"
+    },
+    {
+        "digest",
+        (PyCFunction)hasher_digest,
+        METH_NOARGS,
+        "Return the 64-bit XXH64 digest of everything fed so far"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+PyObject *hasher_type_create(const char *name)
+{
+    PyType_Slot slots[] = {
+        {Py_tp_new, hasher_new},
+        {Py_tp_dealloc, hasher_dealloc},
+        {Py_tp_methods, hasher_methods},
+        {0, NULL},
+    };
+    PyType_Spec spec = {
+        name, sizeof(Hasher), 0, Py_TPFLAGS_DEFAULT, slots,
+    };
+    return PyType_FromSpec(&spec);
+}
@@ -0,0 +1,26 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <Python.h>
+#include <stdint.h>
+
+// Streaming XXH64, used to fingerprint decoded pixels. Feeding the same bytes
+// in any split gives the same digest.
+typedef struct
+{
+    uint64_t accumulators[4];
+    unsigned char buffer[32];
+    size_t buffer_size;
+    uint64_t total_size;
+    uint64_t seed;
+} Hash;
+
+void hash_init(Hash *hash, const uint64_t seed);
+void hash_update(Hash *hash, const void *data, size_t data_size);
+uint64_t hash_digest(const Hash *hash);
+
+// Creates a Python Hasher type wrapping the above, with update(data) and
+// digest() methods.
+PyObject *hasher_type_create(const char *name);
+
+#endif
@@ -0,0 +1,61 @@
+#include <Python.h>
+#include <pthread.h>
+#include "kernels.h"
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const Kernels *kernels_selected = &kernels_scalar;
+static CpuLevel kernels_selected_level = CPU_SCALAR;
+
+const Kernels *kernels_for_level(const CpuLevel level)
+{
+    if (level > cpu_detect())
+        return NULL;
+    switch (level)
+    {
+        case CPU_SCALAR:
+            return &kernels_scalar;
+#if CPU_X86
+        case CPU_SSE2:
+            return &kernels_sse2;
+        case CPU_AVX2:
+            return &kernels_avx2;
+        case CPU_AVX512:
+            return &kernels_avx512;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static void kernels_select(void)
+{
+    const CpuLevel level = cpu_select();
+    const Kernels *kernels = kernels_for_level(level);
+    if (kernels)
+    {
+        kernels_selected = kernels;
+        kernels_selected_level = level;
+    }
+}
+
+// every module calls this from its exec slot, possibly in several
+// interpreters at once, but the choice is only ever made once per process
+void kernels_init(void)
+{
+    pthread_once(&kernels_once, kernels_select);
+}
+
+const Kernels *kernels_get(void)
+{
+    return kernels_selected;
+}
+
+CpuLevel kernels_level(void)
+{
+    return kernels_selected_level;
+}
+
+PyObject *kernels_level_get(PyObject *self, PyObject *args)
+{
+    return PyUnicode_FromString(cpu_level_name(kernels_selected_level));
+}
@@ -0,0 +1,88 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <Python.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "pixel.h"
+
+// The CpuLevel values as plain numbers, so that kernels_impl.h can select
+// code for its level with the preprocessor
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+#define KERNEL_AVX512 3
+
+// One step of a TLG6 colour transform: adds the source channel of a BGRA
+// word, factor times, to its target channel. Channels are byte indices.
+typedef struct
+{
+    uint8_t target;
+    uint8_t source;
+    uint8_t factor;
+} Tlg6TransformStep;
+
+// The hot loops of the codecs, built once per instruction set level from
+// kernels_impl.h. Modules call them through the table kernels_get() returns,
+// which is picked when the module is initialized, so a single build runs on
+// any x86-64 machine and still uses the widest registers it has.
+typedef struct
+{
+    // XORs every whole 32-bit little endian word with key; the tail is left
+    // as is.
+    void (*xor_words)(unsigned char *data, size_t size, uint32_t key);
+
+    // XORs every byte with key.
+    void (*xor_bytes)(unsigned char *data, size_t size, uint8_t key);
+
+    // Rebuilds one row of a TLG5 block from the B, G, R and A residual
+    // planes. top_line is NULL for the first row of the image, and planes[3]
+    // is ignored unless use_alpha is set.
+    void (*tlg5_reconstruct_row)(
+        Pixel *line,
+        const Pixel *top_line,
+        const uint8_t *const *planes,
+        size_t width,
+        int use_alpha);
+
+    // Weaves pixel_count bytes of each of the B, G, R and A planes, stored
+    // one after another, into BGRA words.
+    void (*tlg6_interleave)(
+        uint32_t *target, const uint8_t *planes, size_t pixel_count);
+
+    // Applies the steps of a colour transform to count BGRA words, in order.
+    void (*tlg6_transform)(
+        uint32_t *data,
+        size_t count,
+        const Tlg6TransformStep *steps,
+        int step_count);
+} Kernels;
+
+extern const Kernels kernels_scalar;
+#if CPU_X86
+extern const Kernels kernels_sse2;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_avx512;
+#endif
+
+// Picks the kernels for this CPU; called from module init.
+void kernels_init(void);
+const Kernels *kernels_get(void);
+CpuLevel kernels_level(void);
+
+// The kernels of a given level, or NULL if this build or CPU lacks it.
+const Kernels *kernels_for_level(const CpuLevel level);
+
+PyObject *kernels_level_get(PyObject *self, PyObject *args);
+
+#define KERNELS_METHODS \
+    { \
+        "cpu_level", \
+        kernels_level_get, \
+        METH_NOARGS, \
+        "Instruction set level the codec kernels run at, picked from cpuid " \
+        "and the TLG_CPU environment variable" \
+    }
+
+#endif
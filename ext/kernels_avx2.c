@@ -0,0 +1,21 @@
+// headers with code of their own come before the target switch
+#include "kernels.h"
+
+#if CPU_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx2")
+#endif
+
+#define KERNEL_LEVEL KERNEL_AVX2
+#define KERNEL(name) name##_avx2
+#define KERNELS_TABLE kernels_avx2
+#include "kernels_impl.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+// headers with code of their own come before the target switch
+#include "kernels.h"
+
+#if CPU_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx512bw"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("avx512f,avx512bw")
+#endif
+
+#define KERNEL_LEVEL KERNEL_AVX512
+#define KERNEL(name) name##_avx512
+#define KERNELS_TABLE kernels_avx512
+#include "kernels_impl.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
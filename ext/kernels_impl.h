@@ -0,0 +1,373 @@
+// Body of the codec kernels, included once by each of the kernels_*.c files.
+// Those define KERNEL_LEVEL, KERNEL(name) and KERNELS_TABLE, and enable the
+// matching instruction set before including this. The scalar loops double as
+// the tails of the vector ones, and at the scalar level as the reference the
+// others are checked against.
+#include <string.h>
+#include "kernels.h"
+#if KERNEL_LEVEL >= KERNEL_SSE2
+#include <immintrin.h>
+#endif
+
+#if KERNEL_LEVEL == KERNEL_AVX512
+typedef __m512i Vec;
+#define VEC_SIZE 64
+#define vec_load(p) _mm512_loadu_si512((const void*)(p))
+#define vec_store(p, x) _mm512_storeu_si512((void*)(p), x)
+#define vec_set1_8 _mm512_set1_epi8
+#define vec_set1_32 _mm512_set1_epi32
+#define vec_xor _mm512_xor_si512
+#define vec_and _mm512_and_si512
+#define vec_add8 _mm512_add_epi8
+#define vec_sll32(x, n) _mm512_sll_epi32(x, _mm_cvtsi32_si128(n))
+#define vec_srl32(x, n) _mm512_srl_epi32(x, _mm_cvtsi32_si128(n))
+#elif KERNEL_LEVEL == KERNEL_AVX2
+typedef __m256i Vec;
+#define VEC_SIZE 32
+#define vec_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define vec_store(p, x) _mm256_storeu_si256((__m256i*)(p), x)
+#define vec_set1_8 _mm256_set1_epi8
+#define vec_set1_32 _mm256_set1_epi32
+#define vec_xor _mm256_xor_si256
+#define vec_and _mm256_and_si256
+#define vec_add8 _mm256_add_epi8
+#define vec_sll32(x, n) _mm256_sll_epi32(x, _mm_cvtsi32_si128(n))
+#define vec_srl32(x, n) _mm256_srl_epi32(x, _mm_cvtsi32_si128(n))
+#elif KERNEL_LEVEL == KERNEL_SSE2
+typedef __m128i Vec;
+#define VEC_SIZE 16
+#define vec_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define vec_store(p, x) _mm_storeu_si128((__m128i*)(p), x)
+#define vec_set1_8 _mm_set1_epi8
+#define vec_set1_32 _mm_set1_epi32
+#define vec_xor _mm_xor_si128
+#define vec_and _mm_and_si128
+#define vec_add8 _mm_add_epi8
+#define vec_sll32(x, n) _mm_sll_epi32(x, _mm_cvtsi32_si128(n))
+#define vec_srl32(x, n) _mm_srl_epi32(x, _mm_cvtsi32_si128(n))
+#endif
+
+static void KERNEL(xor_words)(
+    unsigned char *data, const size_t size, const uint32_t key)
+{
+    const size_t word_end = size & ~(size_t)3;
+    size_t i = 0;
+#ifdef VEC_SIZE
+    // x86 is little endian, so the key splats straight into the words
+    const Vec keys = vec_set1_32((int)key);
+    for (; i + VEC_SIZE <= word_end; i += VEC_SIZE)
+        vec_store(data + i, vec_xor(vec_load(data + i), keys));
+#endif
+    for (; i < word_end; i += 4)
+    {
+        data[i + 0] ^= key;
+        data[i + 1] ^= key >> 8;
+        data[i + 2] ^= key >> 16;
+        data[i + 3] ^= key >> 24;
+    }
+}
+
+static void KERNEL(xor_bytes)(
+    unsigned char *data, const size_t size, const uint8_t key)
+{
+    size_t i = 0;
+#ifdef VEC_SIZE
+    const Vec keys = vec_set1_8((char)key);
+    for (; i + VEC_SIZE <= size; i += VEC_SIZE)
+        vec_store(data + i, vec_xor(vec_load(data + i), keys));
+#endif
+    for (; i < size; i++)
+        data[i] ^= key;
+}
+
+// Each pixel is its residual plus the pixel above plus the residuals left of
+// it, so the vector loops run a prefix sum over the pixels of a register and
+// carry its last lane into the next one.
+static void KERNEL(tlg5_reconstruct_row)(
+    Pixel *line,
+    const Pixel *top_line,
+    const uint8_t *const *planes,
+    const size_t width,
+    const int use_alpha)
+{
+    const uint8_t *b = planes[0];
+    const uint8_t *g = planes[1];
+    const uint8_t *r = planes[2];
+    const uint8_t *a = use_alpha ? planes[3] : NULL;
+    // sum of the residuals left of x, as an RGBA word
+    uint32_t carry = 0;
+    size_t x = 0;
+
+#if KERNEL_LEVEL == KERNEL_AVX512
+    const __m512i alpha = _mm512_set1_epi32(use_alpha ? 0 : 0xFF000000);
+    const __m512i lane_shift_1 = _mm512_setr_epi32(
+        0, 0, 0, 0, 3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11);
+    const __m512i lane_shift_2 = _mm512_setr_epi32(
+        0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 3, 3, 7, 7, 7, 7);
+    __m512i sum = _mm512_setzero_si512();
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i gg = _mm_loadu_si128((const __m128i*)(g + x));
+        const __m128i bb = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i*)(b + x)), gg);
+        const __m128i rr = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i*)(r + x)), gg);
+        __m512i p = _mm512_or_si512(
+            _mm512_or_si512(
+                _mm512_cvtepu8_epi32(rr),
+                _mm512_slli_epi32(_mm512_cvtepu8_epi32(gg), 8)),
+            _mm512_slli_epi32(_mm512_cvtepu8_epi32(bb), 16));
+        if (a)
+        {
+            p = _mm512_or_si512(p, _mm512_slli_epi32(
+                _mm512_cvtepu8_epi32(
+                    _mm_loadu_si128((const __m128i*)(a + x))),
+                24));
+        }
+        p = _mm512_add_epi8(p, _mm512_bslli_epi128(p, 4));
+        p = _mm512_add_epi8(p, _mm512_bslli_epi128(p, 8));
+        p = _mm512_add_epi8(
+            p, _mm512_maskz_permutexvar_epi32(0xFFF0, lane_shift_1, p));
+        p = _mm512_add_epi8(
+            p, _mm512_maskz_permutexvar_epi32(0xFF00, lane_shift_2, p));
+        p = _mm512_add_epi8(p, sum);
+        sum = _mm512_permutexvar_epi32(_mm512_set1_epi32(15), p);
+        if (top_line)
+            p = _mm512_add_epi8(p, _mm512_loadu_si512(top_line + x));
+        _mm512_storeu_si512(line + x, _mm512_or_si512(p, alpha));
+    }
+    carry = _mm_cvtsi128_si32(_mm512_castsi512_si128(sum));
+#elif KERNEL_LEVEL == KERNEL_AVX2
+    const __m256i alpha = _mm256_set1_epi32(use_alpha ? 0 : 0xFF000000);
+    __m256i sum = _mm256_setzero_si256();
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m128i gg = _mm_loadl_epi64((const __m128i*)(g + x));
+        const __m128i bb = _mm_add_epi8(
+            _mm_loadl_epi64((const __m128i*)(b + x)), gg);
+        const __m128i rr = _mm_add_epi8(
+            _mm_loadl_epi64((const __m128i*)(r + x)), gg);
+        __m256i p = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cvtepu8_epi32(rr),
+                _mm256_slli_epi32(_mm256_cvtepu8_epi32(gg), 8)),
+            _mm256_slli_epi32(_mm256_cvtepu8_epi32(bb), 16));
+        if (a)
+        {
+            p = _mm256_or_si256(p, _mm256_slli_epi32(
+                _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const __m128i*)(a + x))),
+                24));
+        }
+        p = _mm256_add_epi8(p, _mm256_slli_si256(p, 4));
+        p = _mm256_add_epi8(p, _mm256_slli_si256(p, 8));
+        // the high lane also needs the total of the low one
+        p = _mm256_add_epi8(p, _mm256_shuffle_epi32(
+            _mm256_permute2x128_si256(p, p, 0x08), 0xFF));
+        p = _mm256_add_epi8(p, sum);
+        sum = _mm256_permutevar8x32_epi32(p, _mm256_set1_epi32(7));
+        if (top_line)
+        {
+            p = _mm256_add_epi8(
+                p, _mm256_loadu_si256((const __m256i*)(top_line + x)));
+        }
+        _mm256_storeu_si256(
+            (__m256i*)(line + x), _mm256_or_si256(p, alpha));
+    }
+    carry = _mm256_cvtsi256_si32(sum);
+#elif KERNEL_LEVEL == KERNEL_SSE2
+    const __m128i alpha = _mm_set1_epi32(use_alpha ? 0 : 0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i gg = _mm_loadu_si128((const __m128i*)(g + x));
+        const __m128i bb = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i*)(b + x)), gg);
+        const __m128i rr = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i*)(r + x)), gg);
+        const __m128i aa =
+            a ? _mm_loadu_si128((const __m128i*)(a + x)) : zero;
+        const __m128i rg_low = _mm_unpacklo_epi8(rr, gg);
+        const __m128i rg_high = _mm_unpackhi_epi8(rr, gg);
+        const __m128i ba_low = _mm_unpacklo_epi8(bb, aa);
+        const __m128i ba_high = _mm_unpackhi_epi8(bb, aa);
+        const __m128i pixels[4] = {
+            _mm_unpacklo_epi16(rg_low, ba_low),
+            _mm_unpackhi_epi16(rg_low, ba_low),
+            _mm_unpacklo_epi16(rg_high, ba_high),
+            _mm_unpackhi_epi16(rg_high, ba_high),
+        };
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i p = pixels[i];
+            p = _mm_add_epi8(p, _mm_slli_si128(p, 4));
+            p = _mm_add_epi8(p, _mm_slli_si128(p, 8));
+            p = _mm_add_epi8(p, sum);
+            sum = _mm_shuffle_epi32(p, 0xFF);
+            if (top_line)
+            {
+                p = _mm_add_epi8(p, _mm_loadu_si128(
+                    (const __m128i*)(top_line + x + i * 4)));
+            }
+            _mm_storeu_si128(
+                (__m128i*)(line + x + i * 4), _mm_or_si128(p, alpha));
+        }
+    }
+    carry = _mm_cvtsi128_si32(sum);
+#endif
+
+    Pixel prev_pixel;
+    memcpy(&prev_pixel, &carry, sizeof(prev_pixel));
+    for (; x < width; x++)
+    {
+        Pixel pixel;
+        pixel.b = b[x];
+        pixel.g = g[x];
+        pixel.r = r[x];
+        pixel.a = a ? a[x] : 0;
+        pixel.b += pixel.g;
+        pixel.r += pixel.g;
+
+        prev_pixel.r += pixel.r;
+        prev_pixel.g += pixel.g;
+        prev_pixel.b += pixel.b;
+        prev_pixel.a += pixel.a;
+
+        Pixel *target_pixel = line + x;
+        *target_pixel = prev_pixel;
+        if (top_line)
+        {
+            const Pixel *top_pixel = top_line + x;
+            target_pixel->r += top_pixel->r;
+            target_pixel->g += top_pixel->g;
+            target_pixel->b += top_pixel->b;
+            target_pixel->a += top_pixel->a;
+        }
+        if (!a)
+            target_pixel->a = 0xFF;
+    }
+}
+
+static void KERNEL(tlg6_interleave)(
+    uint32_t *target, const uint8_t *planes, const size_t pixel_count)
+{
+    const uint8_t *b = planes;
+    const uint8_t *g = planes + pixel_count;
+    const uint8_t *r = planes + pixel_count * 2;
+    const uint8_t *a = planes + pixel_count * 3;
+    size_t i = 0;
+#if KERNEL_LEVEL == KERNEL_AVX512
+    for (; i + 16 <= pixel_count; i += 16)
+    {
+        const __m512i bb = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)(b + i)));
+        const __m512i gg = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)(g + i)));
+        const __m512i rr = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)(r + i)));
+        const __m512i aa = _mm512_cvtepu8_epi32(
+            _mm_loadu_si128((const __m128i*)(a + i)));
+        _mm512_storeu_si512(target + i, _mm512_or_si512(
+            _mm512_or_si512(bb, _mm512_slli_epi32(gg, 8)),
+            _mm512_or_si512(
+                _mm512_slli_epi32(rr, 16), _mm512_slli_epi32(aa, 24))));
+    }
+#elif KERNEL_LEVEL == KERNEL_AVX2
+    for (; i + 32 <= pixel_count; i += 32)
+    {
+        const __m256i bb = _mm256_loadu_si256((const __m256i*)(b + i));
+        const __m256i gg = _mm256_loadu_si256((const __m256i*)(g + i));
+        const __m256i rr = _mm256_loadu_si256((const __m256i*)(r + i));
+        const __m256i aa = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i bg_low = _mm256_unpacklo_epi8(bb, gg);
+        const __m256i bg_high = _mm256_unpackhi_epi8(bb, gg);
+        const __m256i ra_low = _mm256_unpacklo_epi8(rr, aa);
+        const __m256i ra_high = _mm256_unpackhi_epi8(rr, aa);
+        // the unpacks work within lanes: pixels 0-3 and 16-19 and so on
+        const __m256i p0 = _mm256_unpacklo_epi16(bg_low, ra_low);
+        const __m256i p1 = _mm256_unpackhi_epi16(bg_low, ra_low);
+        const __m256i p2 = _mm256_unpacklo_epi16(bg_high, ra_high);
+        const __m256i p3 = _mm256_unpackhi_epi16(bg_high, ra_high);
+        __m256i *out = (__m256i*)(target + i);
+        _mm256_storeu_si256(out, _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256(
+            out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+        _mm256_storeu_si256(
+            out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+        _mm256_storeu_si256(
+            out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+    }
+#elif KERNEL_LEVEL == KERNEL_SSE2
+    for (; i + 16 <= pixel_count; i += 16)
+    {
+        const __m128i bb = _mm_loadu_si128((const __m128i*)(b + i));
+        const __m128i gg = _mm_loadu_si128((const __m128i*)(g + i));
+        const __m128i rr = _mm_loadu_si128((const __m128i*)(r + i));
+        const __m128i aa = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i bg_low = _mm_unpacklo_epi8(bb, gg);
+        const __m128i bg_high = _mm_unpackhi_epi8(bb, gg);
+        const __m128i ra_low = _mm_unpacklo_epi8(rr, aa);
+        const __m128i ra_high = _mm_unpackhi_epi8(rr, aa);
+        __m128i *out = (__m128i*)(target + i);
+        _mm_storeu_si128(out, _mm_unpacklo_epi16(bg_low, ra_low));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_low, ra_low));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_high, ra_high));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_high, ra_high));
+    }
+#endif
+    for (; i < pixel_count; i++)
+    {
+        target[i] = b[i]
+            | ((uint32_t)g[i] << 8)
+            | ((uint32_t)r[i] << 16)
+            | ((uint32_t)a[i] << 24);
+    }
+}
+
+static void KERNEL(tlg6_transform)(
+    uint32_t *data,
+    const size_t count,
+    const Tlg6TransformStep *steps,
+    const int step_count)
+{
+    size_t i = 0;
+#ifdef VEC_SIZE
+    for (; i + VEC_SIZE / 4 <= count; i += VEC_SIZE / 4)
+    {
+        Vec x = vec_load(data + i);
+        for (int j = 0; j < step_count; j++)
+        {
+            const Tlg6TransformStep *step = &steps[j];
+            Vec moved = step->target > step->source
+                ? vec_sll32(x, 8 * (step->target - step->source))
+                : vec_srl32(x, 8 * (step->source - step->target));
+            moved = vec_and(
+                moved, vec_set1_32((int)(0xFFu << (8 * step->target))));
+            if (step->factor == 2)
+                moved = vec_add8(moved, moved);
+            x = vec_add8(x, moved);
+        }
+        vec_store(data + i, x);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        uint8_t channels[4];
+        memcpy(channels, data + i, sizeof(channels));
+        for (int j = 0; j < step_count; j++)
+        {
+            const Tlg6TransformStep *step = &steps[j];
+            channels[step->target] += channels[step->source] * step->factor;
+        }
+        memcpy(data + i, channels, sizeof(channels));
+    }
+}
+
+const Kernels KERNELS_TABLE = {
+    KERNEL(xor_words),
+    KERNEL(xor_bytes),
+    KERNEL(tlg5_reconstruct_row),
+    KERNEL(tlg6_interleave),
+    KERNEL(tlg6_transform),
+};
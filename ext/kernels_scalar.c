@@ -0,0 +1,12 @@
+#include "kernels.h"
+
+// The reference kernels, kept free of vector code so that the others can be
+// checked against them.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("no-tree-vectorize")
+#endif
+
+#define KERNEL_LEVEL KERNEL_SCALAR
+#define KERNEL(name) name##_scalar
+#define KERNELS_TABLE kernels_scalar
+#include "kernels_impl.h"
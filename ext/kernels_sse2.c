@@ -0,0 +1,21 @@
+// headers with code of their own come before the target switch
+#include "kernels.h"
+
+#if CPU_X86
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC target("sse2")
+#endif
+
+#define KERNEL_LEVEL KERNEL_SSE2
+#define KERNEL(name) name##_sse2
+#define KERNELS_TABLE kernels_sse2
+#include "kernels_impl.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#endif
+
+#endif
@@ -1,88 +1,221 @@
 #include <Python.h>
+#include "error.h"
 #include "lzss.h"
+#include "stats.h"
 
-unsigned char *lzss_decompress(
+#define LZSS_RING_SIZE 4096
+#define LZSS_RING_MASK (LZSS_RING_SIZE - 1)
+#define LZSS_MAX_MATCH (18 + 255)
+#define LZSS_MAX_TOKEN 4
+#define LZSS_WIDE_COPY 16
+
+// Reads the byte that lies distance bytes before output_ptr, which is either
+// in the output produced so far or, for the first bytes of a call, still in
+// the ring left behind by the previous call.
+static inline unsigned char lzss_history_byte(
+    const unsigned char *output,
+    const unsigned char *output_ptr,
+    const size_t distance,
+    const unsigned char *dict,
+    const size_t start_pos)
+{
+    const size_t produced = output_ptr - output;
+    if (distance <= produced)
+        return output_ptr[-distance];
+    return dict[(start_pos + produced - distance) & LZSS_RING_MASK];
+}
+
+// Copies a match whose source lies entirely in output. May write up to
+// LZSS_WIDE_COPY - 1 bytes past the end of the match.
+static inline void lzss_copy_match_wide(
+    unsigned char *output_ptr, const size_t distance, const size_t size)
+{
+    const unsigned char *source = output_ptr - distance;
+    if (distance >= 16)
+    {
+        for (size_t i = 0; i < size; i += 16)
+            memcpy(output_ptr + i, source + i, 16);
+    }
+    else if (distance >= 8)
+    {
+        for (size_t i = 0; i < size; i += 8)
+            memcpy(output_ptr + i, source + i, 8);
+    }
+    else
+    {
+        // the match repeats a short pattern. Once 16 bytes of it are laid
+        // out, it can be copied 8 bytes at a time from the nearest multiple
+        // of its period that is at least 8 bytes back.
+        const size_t head = size < 16 ? size : 16;
+        for (size_t i = 0; i < head; i++)
+            output_ptr[i] = source[i];
+        const size_t period = distance * ((8 + distance - 1) / distance);
+        for (size_t i = 16; i < size; i += 8)
+            memcpy(output_ptr + i, output_ptr + i - period, 8);
+    }
+}
+
+size_t lzss_decompress(
     const unsigned char *input,
     const size_t input_size,
+    unsigned char *output,
     const size_t output_size,
     unsigned char *dict,
     size_t *dict_pos)
 {
     assert(input);
+    assert(output);
     assert(dict);
     assert(dict_pos);
 
-    unsigned char *output = PyMem_RawMalloc(output_size);
-    if (!output)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
-        return NULL;
-    }
-
+    STATS_BEGIN(start_clock);
     unsigned char *output_ptr = output;
     const unsigned char *input_ptr = input;
     const unsigned char *input_end = input_ptr + input_size;
     const unsigned char *output_end = output_ptr + output_size;
 
+    // the output doubles as the history window, so the ring is only read
+    // for matches reaching back into previous calls and only written once
+    // at the end
+    const size_t start_pos = *dict_pos;
+
     int flags = 0;
+
+    // as long as a whole token fits in the remaining input and the longest
+    // match plus the slack of a wide copy fits in the remaining output, the
+    // token can be decoded without any bounds checks
+    while (input_end - input_ptr >= LZSS_MAX_TOKEN
+        && output_end - output_ptr >= LZSS_MAX_MATCH + LZSS_WIDE_COPY)
+    {
+        flags >>= 1;
+        if ((flags & 0x100) != 0x100)
+            flags = *input_ptr++ | 0xFF00;
+
+        if ((flags & 1) == 1)
+        {
+            unsigned char x0 = *input_ptr++;
+            unsigned char x1 = *input_ptr++;
+            size_t lookbehind_pos = x0 | ((x1 & 0xF) << 8);
+            size_t lookbehind_size = 3 + ((x1 & 0xF0) >> 4);
+            if (lookbehind_size == 18)
+                lookbehind_size += *input_ptr++;
+
+            const size_t produced = output_ptr - output;
+            const size_t distance =
+                ((start_pos + produced - lookbehind_pos - 1) & LZSS_RING_MASK)
+                + 1;
+            if (distance <= produced)
+            {
+                lzss_copy_match_wide(output_ptr, distance, lookbehind_size);
+                output_ptr += lookbehind_size;
+            }
+            else
+            {
+                for (size_t j = 0; j < lookbehind_size; j++)
+                {
+                    *output_ptr = lzss_history_byte(
+                        output, output_ptr, distance, dict, start_pos);
+                    output_ptr++;
+                }
+            }
+        }
+        else
+        {
+            *output_ptr++ = *input_ptr++;
+        }
+    }
+
     while (input_ptr < input_end)
     {
         flags >>= 1;
         if ((flags & 0x100) != 0x100)
         {
             if (input_ptr >= input_end)
-                return output;
+                goto end;
             flags = *input_ptr++ | 0xFF00;
         }
 
         if ((flags & 1) == 1)
         {
             if (input_ptr >= input_end)
-                return output;
+                goto end;
             unsigned char x0 = *input_ptr++;
             if (input_ptr >= input_end)
-                return output;
+                goto end;
             unsigned char x1 = *input_ptr++;
             size_t lookbehind_pos = x0 | ((x1 & 0xF) << 8);
             size_t lookbehind_size = 3 + ((x1 & 0xF0) >> 4);
             if (lookbehind_size == 18)
             {
                 if (input_ptr >= input_end)
-                    return output;
+                    goto end;
                 lookbehind_size += *input_ptr++;
             }
 
+            const size_t distance =
+                ((start_pos + (output_ptr - output) - lookbehind_pos - 1)
+                    & LZSS_RING_MASK)
+                + 1;
             for (size_t j = 0; j < lookbehind_size; j++)
             {
-                unsigned char c = dict[lookbehind_pos];
                 if (output_ptr >= output_end)
-                    return output;
-                *output_ptr++ = c;
-                dict[*dict_pos] = c;
-                (*dict_pos)++;
-                (*dict_pos) &= 0xFFF;
-                lookbehind_pos++;
-                lookbehind_pos &= 0xFFF;
+                    goto end;
+                *output_ptr = lzss_history_byte(
+                    output, output_ptr, distance, dict, start_pos);
+                output_ptr++;
             }
         }
         else
         {
             if (input_ptr >= input_end)
-                return output;
+                goto end;
             unsigned char c = *input_ptr++;
             if (output_ptr >= output_end)
-                return output;
+                goto end;
             *output_ptr++ = c;
-            dict[*dict_pos] = c;
-            (*dict_pos)++;
-            (*dict_pos) &= 0xFFF;
         }
     }
 
-    return output;
+end:
+    {
+        // carry the last 4 KiB over to the next call
+        const size_t produced = output_ptr - output;
+        const size_t keep =
+            produced < LZSS_RING_SIZE ? produced : LZSS_RING_SIZE;
+        const size_t pos = (start_pos + produced - keep) & LZSS_RING_MASK;
+        const size_t head =
+            keep < LZSS_RING_SIZE - pos ? keep : LZSS_RING_SIZE - pos;
+        memcpy(dict + pos, output_ptr - keep, head);
+        memcpy(dict, output_ptr - keep + head, keep - head);
+        *dict_pos = (start_pos + produced) & LZSS_RING_MASK;
+    }
+
+    // leave no stale scratch data behind if the input ends early
+    memset(output_ptr, 0, output_end - output_ptr);
+    STATS_END(
+        STATS_LZSS_DECOMPRESS,
+        start_clock,
+        input_ptr - input,
+        output_ptr - output);
+    return output_ptr - output;
+}
+
+#define LZSS_MIN_MATCH 3
+#define LZSS_HASH_BITS 15
+#define LZSS_HASH_SIZE (1 << LZSS_HASH_BITS)
+#define LZSS_MAX_CHAIN 32
+#define LZSS_NO_POSITION UINT32_MAX
+
+static inline uint32_t lzss_hash(const unsigned char *data)
+{
+    const uint32_t key = data[0] | (data[1] << 8) | (data[2] << 16);
+    return (key * 2654435761u) >> (32 - LZSS_HASH_BITS);
 }
 
-// dummy implementation
+// Greedy compressor over hash chains. It works on a linear window that holds
+// the ring left behind by the previous call followed by the input, so that
+// matches can reach back into earlier calls the same way the decompressor
+// resolves them.
 unsigned char *lzss_compress(
     const unsigned char *input,
     const size_t input_size,
@@ -92,22 +225,138 @@ unsigned char *lzss_compress(
 {
     assert(input);
     assert(output_size);
+    assert(dict);
+    assert(dict_pos);
 
-    *output_size = input_size + input_size / 8;
-    unsigned char *output = PyMem_RawMalloc(*output_size);
-    if (!output)
+    unsigned char *output = NULL;
+    unsigned char *window = NULL;
+    uint32_t *head = NULL;
+    uint32_t *prev = NULL;
+
+    if (input_size > UINT32_MAX - LZSS_RING_SIZE)
     {
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set(PyExc_ValueError, "Data too large");
         return NULL;
     }
+    const size_t window_size = LZSS_RING_SIZE + input_size;
+    STATS_BEGIN(start_clock);
+
+    // literals cost a flag bit each, and matches are never longer than the
+    // bytes they stand for
+    output = PyMem_RawMalloc(input_size + (input_size + 7) / 8 + 1);
+    window = PyMem_RawMalloc(window_size);
+    head = PyMem_RawMalloc(LZSS_HASH_SIZE * sizeof(uint32_t));
+    prev = PyMem_RawMalloc(window_size * sizeof(uint32_t));
+    if (!output || !window || !head || !prev)
+    {
+        PyMem_RawFree(output);
+        output = NULL;
+        error_set_no_memory();
+        goto end;
+    }
+    STATS_ALLOCATION(input_size + (input_size + 7) / 8 + 1);
+    STATS_ALLOCATION(window_size);
+    STATS_ALLOCATION(LZSS_HASH_SIZE * sizeof(uint32_t));
+    STATS_ALLOCATION(window_size * sizeof(uint32_t));
+
+    const size_t start_pos = *dict_pos;
+    for (size_t i = 0; i < LZSS_RING_SIZE; i++)
+        window[i] = dict[(start_pos + i) & LZSS_RING_MASK];
+    memcpy(window + LZSS_RING_SIZE, input, input_size);
+    for (size_t i = 0; i < LZSS_HASH_SIZE; i++)
+        head[i] = LZSS_NO_POSITION;
 
+    size_t hashed = 0;
+    const size_t hash_limit = window_size - LZSS_MIN_MATCH + 1;
     unsigned char *output_ptr = output;
-    for (size_t i = 0; i < input_size; i++)
+    unsigned char *flags_ptr = NULL;
+    int token_count = 0;
+    size_t pos = LZSS_RING_SIZE;
+    while (pos < window_size)
+    {
+        for (; hashed < pos && hashed < hash_limit; hashed++)
+        {
+            const uint32_t hash = lzss_hash(window + hashed);
+            prev[hashed] = head[hash];
+            head[hash] = hashed;
+        }
+
+        size_t best_size = 0;
+        size_t best_distance = 0;
+        if (pos < hash_limit)
+        {
+            const size_t limit = window_size - pos < LZSS_MAX_MATCH
+                ? window_size - pos
+                : LZSS_MAX_MATCH;
+            uint32_t candidate = head[lzss_hash(window + pos)];
+            for (int depth = 0;
+                candidate != LZSS_NO_POSITION
+                    && pos - candidate <= LZSS_RING_SIZE
+                    && depth < LZSS_MAX_CHAIN;
+                depth++, candidate = prev[candidate])
+            {
+                size_t size = 0;
+                while (size < limit
+                    && window[candidate + size] == window[pos + size])
+                {
+                    size++;
+                }
+                if (size > best_size)
+                {
+                    best_size = size;
+                    best_distance = pos - candidate;
+                    if (size == limit)
+                        break;
+                }
+            }
+        }
+
+        if (token_count % 8 == 0)
+        {
+            flags_ptr = output_ptr++;
+            *flags_ptr = 0;
+        }
+        if (best_size >= LZSS_MIN_MATCH)
+        {
+            *flags_ptr |= 1 << (token_count % 8);
+            const size_t ring_pos =
+                (start_pos + pos - LZSS_RING_SIZE - best_distance)
+                & LZSS_RING_MASK;
+            *output_ptr++ = ring_pos & 0xFF;
+            if (best_size >= 18)
+            {
+                *output_ptr++ = (ring_pos >> 8) | 0xF0;
+                *output_ptr++ = best_size - 18;
+            }
+            else
+            {
+                *output_ptr++ =
+                    (ring_pos >> 8) | ((best_size - LZSS_MIN_MATCH) << 4);
+            }
+            pos += best_size;
+        }
+        else
+        {
+            *output_ptr++ = window[pos++];
+        }
+        token_count++;
+    }
+    *output_size = output_ptr - output;
+
+    // carry the last 4 KiB over to the next call
+    const size_t keep =
+        input_size < LZSS_RING_SIZE ? input_size : LZSS_RING_SIZE;
+    for (size_t i = 0; i < keep; i++)
     {
-        if (i % 8 == 0)
-            *output_ptr++ = 0;
-        *output_ptr++ = input[i];
+        dict[(start_pos + input_size - keep + i) & LZSS_RING_MASK] =
+            input[input_size - keep + i];
     }
+    *dict_pos = (start_pos + input_size) & LZSS_RING_MASK;
+    STATS_END(STATS_LZSS_COMPRESS, start_clock, input_size, *output_size);
 
+end:
+    PyMem_RawFree(window);
+    PyMem_RawFree(head);
+    PyMem_RawFree(prev);
     return output;
 }
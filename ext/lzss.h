@@ -3,13 +3,19 @@
 
 #include <stddef.h>
 
-unsigned char *lzss_decompress(
+// Decompresses into output and returns how many bytes were produced; the
+// rest of output is zeroed.
+size_t lzss_decompress(
     const unsigned char *input,
     const size_t input_size,
+    unsigned char *output,
     const size_t output_size,
     unsigned char *dict,
     size_t *dict_pos);
 
+// Compresses into a newly allocated buffer, which the caller frees with
+// PyMem_RawFree. The dictionary is carried over the same way as for
+// lzss_decompress, so consecutive calls can share it.
 unsigned char *lzss_compress(
     const unsigned char *input,
     const size_t input_size,
@@ -0,0 +1,30 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <Python.h>
+
+// Every extension module uses multi-phase init and keeps whatever Python
+// objects it needs in its module state, never in C globals. That lets it be
+// imported into several interpreters at once, and since the codecs already
+// run without the GIL, free-threaded builds don't need to enable it for them.
+// Module slot arrays end with MODULE_SLOTS.
+
+#if PY_VERSION_HEX >= 0x030C0000
+#define MODULE_SLOT_INTERPRETERS \
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#else
+#define MODULE_SLOT_INTERPRETERS
+#endif
+
+#if PY_VERSION_HEX >= 0x030D0000
+#define MODULE_SLOT_GIL {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#else
+#define MODULE_SLOT_GIL
+#endif
+
+#define MODULE_SLOTS \
+    MODULE_SLOT_INTERPRETERS \
+    MODULE_SLOT_GIL \
+    {0, NULL}
+
+#endif
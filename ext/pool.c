@@ -0,0 +1,112 @@
+#include <Python.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "pool.h"
+
+typedef struct
+{
+    PoolTask task;
+    void *context;
+    size_t task_count;
+    atomic_size_t next_index;
+} PoolState;
+
+typedef struct
+{
+    PoolState *state;
+    size_t worker;
+} PoolWorker;
+
+static size_t pool_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long count = info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? (size_t)count : 1;
+}
+
+size_t pool_worker_count(const size_t task_count, size_t worker_count)
+{
+    if (!worker_count)
+        worker_count = pool_cpu_count();
+    if (worker_count > task_count)
+        worker_count = task_count;
+    return worker_count ? worker_count : 1;
+}
+
+static void *pool_worker(void *arg)
+{
+    PoolWorker *worker = arg;
+    PoolState *state = worker->state;
+    while (1)
+    {
+        size_t index = atomic_fetch_add(&state->next_index, 1);
+        if (index >= state->task_count)
+            break;
+        state->task(state->context, worker->worker, index);
+    }
+    return NULL;
+}
+
+void pool_run(
+    PoolTask task,
+    void *context,
+    const size_t task_count,
+    const size_t worker_count)
+{
+    assert(task);
+
+    PoolState state;
+    state.task = task;
+    state.context = context;
+    state.task_count = task_count;
+    atomic_init(&state.next_index, 0);
+
+    // the calling thread is worker 0, so only worker_count - 1 threads need to
+    // be spawned. If spawning fails, the remaining threads simply pick up more
+    // tasks.
+    PoolWorker main_worker = {&state, 0};
+    PoolWorker *workers = NULL;
+    pthread_t *threads = NULL;
+    size_t thread_count = 0;
+    if (worker_count > 1)
+    {
+        workers = PyMem_RawMalloc(sizeof(PoolWorker) * (worker_count - 1));
+        threads = PyMem_RawMalloc(sizeof(pthread_t) * (worker_count - 1));
+        if (workers && threads)
+        {
+            while (thread_count < worker_count - 1)
+            {
+                workers[thread_count].state = &state;
+                workers[thread_count].worker = thread_count + 1;
+                if (pthread_create(
+                    &threads[thread_count],
+                    NULL,
+                    pool_worker,
+                    &workers[thread_count]))
+                {
+                    break;
+                }
+                thread_count++;
+            }
+        }
+    }
+
+    pool_worker(&main_worker);
+
+    for (size_t i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    if (workers)
+        PyMem_RawFree(workers);
+    if (threads)
+        PyMem_RawFree(threads);
+}
@@ -0,0 +1,24 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef void (*PoolTask)(void *context, size_t worker, size_t index);
+
+// Resolves the number of workers pool_run will use: 0 means one per CPU, and
+// there are never more workers than tasks.
+size_t pool_worker_count(const size_t task_count, size_t worker_count);
+
+// Runs task(context, worker, i) for every i in [0, task_count) on
+// worker_count native threads and returns once all of them are done. worker
+// is in [0, worker_count) and no two threads share it at the same time, so it
+// can index per-worker state. Tasks are handed out dynamically, so uneven
+// workloads still spread well. Must be called without the GIL if tasks can
+// take a while.
+void pool_run(
+    PoolTask task,
+    void *context,
+    const size_t task_count,
+    const size_t worker_count);
+
+#endif
@@ -0,0 +1,56 @@
+#include <Python.h>
+#include "error.h"
+#include "scratch.h"
+#include "stats.h"
+
+Scratch *scratch_create(void)
+{
+    Scratch *scratch = PyMem_RawMalloc(sizeof(Scratch));
+    if (!scratch)
+    {
+        error_set_no_memory();
+        return NULL;
+    }
+    for (int slot = 0; slot < SCRATCH_SLOT_COUNT; slot++)
+    {
+        scratch->data[slot] = NULL;
+        scratch->size[slot] = 0;
+    }
+    return scratch;
+}
+
+void scratch_destroy(Scratch *scratch)
+{
+    assert(scratch);
+    for (int slot = 0; slot < SCRATCH_SLOT_COUNT; slot++)
+        if (scratch->data[slot])
+            PyMem_RawFree(scratch->data[slot]);
+    PyMem_RawFree(scratch);
+}
+
+unsigned char *scratch_get(Scratch *scratch, const int slot, const size_t size)
+{
+    assert(scratch);
+    assert(slot >= 0 && slot < SCRATCH_SLOT_COUNT);
+    if (scratch->data[slot] && scratch->size[slot] >= size)
+        return scratch->data[slot];
+
+    if (scratch->data[slot])
+        PyMem_RawFree(scratch->data[slot]);
+    scratch->data[slot] = PyMem_RawMalloc(size ? size : 1);
+    scratch->size[slot] = scratch->data[slot] ? size : 0;
+    if (!scratch->data[slot])
+    {
+        error_set_no_memory();
+        return NULL;
+    }
+
+#ifdef TLG_STATS
+    size_t total_size = 0;
+    for (int i = 0; i < SCRATCH_SLOT_COUNT; i++)
+        total_size += scratch->size[i];
+    STATS_ALLOCATION(size);
+    STATS_SCRATCH(total_size);
+#endif
+    return scratch->data[slot];
+}
@@ -0,0 +1,25 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+#define SCRATCH_SLOT_COUNT 8
+
+// Working memory that outlives a single decode. Every slot only ever grows,
+// so once a decoder has seen an image of a given size, decoding further
+// images of that size doesn't allocate anymore.
+typedef struct
+{
+    unsigned char *data[SCRATCH_SLOT_COUNT];
+    size_t size[SCRATCH_SLOT_COUNT];
+} Scratch;
+
+Scratch *scratch_create(void);
+void scratch_destroy(Scratch *scratch);
+
+// Returns a buffer of at least the given size. Its previous content is not
+// preserved when it needs to grow.
+unsigned char *scratch_get(
+    Scratch *scratch, const int slot, const size_t size);
+
+#endif
@@ -0,0 +1,737 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "error.h"
+#include "module.h"
+
+// Converts scripts between the game's line format and the editable command
+// format, as (de)coded text. Both directions scan the input once, line by
+// line, without the GIL; the callers take care of the cp932 and UTF-8
+// encodings.
+
+#define NEWLINE_MARKER_SIZE 3
+
+static const Py_UCS4 NEWLINE_MARKER[NEWLINE_MARKER_SIZE] = {'[', 'n', ']'};
+static const Py_UCS4 NAME_OPEN = 0x3010;  // 【
+static const Py_UCS4 NAME_CLOSE = 0x3011;  // 】
+
+typedef struct
+{
+    const Py_UCS4 *data;
+    size_t size;
+} Span;
+
+typedef struct
+{
+    Py_UCS4 *data;
+    size_t size;
+    size_t capacity;
+} Text;
+
+typedef enum
+{
+    WARNING_TOO_MANY_LINES,
+    WARNING_TOO_LONG_LINE,
+} WarningKind;
+
+typedef struct
+{
+    WarningKind kind;
+    size_t line_number;
+} Warning;
+
+typedef struct
+{
+    Warning *items;
+    size_t count;
+    size_t capacity;
+} Warnings;
+
+typedef struct
+{
+    const Py_UCS4 *input;
+    size_t input_size;
+    size_t max_line_count;
+    size_t max_line_length;
+    Text output;
+    // whether a line was written, so the next one needs a newline first
+    int has_output;
+    Warnings warnings;
+    // lines that can't be parsed, as opposed to running out of memory
+    const char *malformed;
+    size_t malformed_line_number;
+} Script;
+
+static inline Span span_make(const Py_UCS4 *data, const size_t size)
+{
+    Span span = {data, size};
+    return span;
+}
+
+static inline Span span_slice(
+    const Span span, const size_t start, const size_t end)
+{
+    return span_make(span.data + start, end - start);
+}
+
+static int span_equals(const Span a, const Span b)
+{
+    return a.size == b.size
+        && !memcmp(a.data, b.data, a.size * sizeof(Py_UCS4));
+}
+
+static int span_equals_ascii(const Span span, const char *ascii)
+{
+    size_t i = 0;
+    for (; ascii[i]; i++)
+    {
+        if (i == span.size || span.data[i] != (unsigned char)ascii[i])
+            return 0;
+    }
+    return i == span.size;
+}
+
+static Span span_lstrip(Span span)
+{
+    while (span.size && Py_UNICODE_ISSPACE(span.data[0]))
+    {
+        span.data++;
+        span.size--;
+    }
+    return span;
+}
+
+static Span span_rstrip(Span span)
+{
+    while (span.size && Py_UNICODE_ISSPACE(span.data[span.size - 1]))
+        span.size--;
+    return span;
+}
+
+// Display width in a fixed-width font: one column below U+0080, two above.
+static inline size_t span_width(const Span span)
+{
+    size_t width = span.size;
+    for (size_t i = 0; i < span.size; i++)
+        width += span.data[i] >= 0x80;
+    return width;
+}
+
+static int text_reserve(Text *text, const size_t extra)
+{
+    if (text->size + extra <= text->capacity)
+        return 1;
+    size_t capacity = text->capacity ? text->capacity : 1024;
+    while (capacity < text->size + extra)
+        capacity *= 2;
+    Py_UCS4 *data = PyMem_RawRealloc(text->data, capacity * sizeof(Py_UCS4));
+    if (!data)
+    {
+        error_set_no_memory();
+        return 0;
+    }
+    text->data = data;
+    text->capacity = capacity;
+    return 1;
+}
+
+static int text_append(Text *text, const Span span)
+{
+    if (!span.size)
+        return 1;
+    if (!text_reserve(text, span.size))
+        return 0;
+    memcpy(text->data + text->size, span.data, span.size * sizeof(Py_UCS4));
+    text->size += span.size;
+    return 1;
+}
+
+static int text_append_char(Text *text, const Py_UCS4 c)
+{
+    if (!text_reserve(text, 1))
+        return 0;
+    text->data[text->size++] = c;
+    return 1;
+}
+
+static int text_append_ascii(Text *text, const char *ascii)
+{
+    const size_t size = strlen(ascii);
+    if (!text_reserve(text, size))
+        return 0;
+    for (size_t i = 0; i < size; i++)
+        text->data[text->size++] = (unsigned char)ascii[i];
+    return 1;
+}
+
+static int script_warn(
+    Script *script, const WarningKind kind, const size_t line_number)
+{
+    Warnings *warnings = &script->warnings;
+    if (warnings->count == warnings->capacity)
+    {
+        const size_t capacity = warnings->capacity
+            ? warnings->capacity * 2
+            : 16;
+        Warning *items = PyMem_RawRealloc(
+            warnings->items, capacity * sizeof(Warning));
+        if (!items)
+        {
+            error_set_no_memory();
+            return 0;
+        }
+        warnings->items = items;
+        warnings->capacity = capacity;
+    }
+    warnings->items[warnings->count].kind = kind;
+    warnings->items[warnings->count].line_number = line_number;
+    warnings->count++;
+    return 1;
+}
+
+static int script_line_begin(Script *script)
+{
+    if (script->has_output && !text_append_char(&script->output, '\n'))
+        return 0;
+    script->has_output = 1;
+    return 1;
+}
+
+static int script_malformed(
+    Script *script, const char *message, const size_t line_number)
+{
+    script->malformed = message;
+    script->malformed_line_number = line_number;
+    return 0;
+}
+
+// Calls line(script, span, line_number) for every line of the input, which
+// start each line they write with script_line_begin.
+static int script_scan(
+    Script *script,
+    int (*line)(Script *script, const Span span, const size_t line_number))
+{
+    const Py_UCS4 *input = script->input;
+    const Py_UCS4 *input_end = input + script->input_size;
+    size_t line_number = 1;
+    for (const Py_UCS4 *start = input; ; line_number++)
+    {
+        const Py_UCS4 *end = start;
+        while (end < input_end && *end != '\n')
+            end++;
+        if (!line(script, span_make(start, end - start), line_number))
+            return 0;
+        if (end == input_end)
+            return 1;
+        start = end + 1;
+    }
+}
+
+// Writes a command line of the decoded script; the argument loses trailing
+// whitespace and is left out along with its space when nothing remains.
+static int decode_command_write(
+    Script *script, const char *command, const Span arg)
+{
+    const Span stripped = span_rstrip(arg);
+    Text *output = &script->output;
+    if (!script_line_begin(script) || !text_append_ascii(output, command))
+        return 0;
+    return !stripped.size
+        || (text_append_char(output, ' ') && text_append(output, stripped));
+}
+
+// Parses 【name】text or 【name,sound】text the way a backtracking match of
+// ^【([^,]*)(?:,(.+))?】(.*)$ would: the name runs up to the first comma if a
+// closing bracket follows at least one character past it (with the sound up
+// to the last closing bracket), and otherwise up to the last closing bracket
+// before the comma.
+static int decode_speech_parse(
+    const Span line, Span *name, Span *sound, Span *text)
+{
+    size_t comma = 0;
+    for (size_t i = 1; i < line.size && !comma; i++)
+    {
+        if (line.data[i] == ',')
+            comma = i;
+    }
+
+    size_t close = line.size;
+    while (close > 1 && line.data[close - 1] != NAME_CLOSE)
+        close--;
+    if (close <= 1)
+        return 0;
+    close--;
+
+    *sound = span_make(NULL, 0);
+    if (comma && close >= comma + 2)
+    {
+        *name = span_slice(line, 1, comma);
+        *sound = span_slice(line, comma + 1, close);
+    }
+    else
+    {
+        if (comma)
+        {
+            close = comma;
+            while (close > 1 && line.data[close - 1] != NAME_CLOSE)
+                close--;
+            if (close <= 1)
+                return 0;
+            close--;
+        }
+        *name = span_slice(line, 1, close);
+    }
+    *text = span_slice(line, close + 1, line.size);
+    return 1;
+}
+
+static int decode_line(
+    Script *script, const Span raw_line, const size_t line_number)
+{
+    const Span line = span_rstrip(span_lstrip(raw_line));
+    Span name;
+    Span sound;
+    Span text;
+
+    if (!line.size)
+        return script_line_begin(script);
+
+    if (line.size >= 2
+        && line.data[0] == NAME_OPEN
+        && line.data[1] == NAME_CLOSE)
+    {
+        return decode_command_write(
+            script, "TEXT", span_slice(line, 2, line.size));
+    }
+
+    if (line.data[0] == NAME_OPEN
+        && decode_speech_parse(line, &name, &sound, &text))
+    {
+        return decode_command_write(script, "SPEAK-CHAR", name)
+            && (!sound.size
+                || decode_command_write(script, "SPEAK-FILE", sound))
+            && decode_command_write(script, "SPEAK-ORIG", text)
+            && decode_command_write(script, "SPEAK-TEXT", text);
+    }
+
+    if (line.data[0] < 0x80)
+        return decode_command_write(script, "CODE", line);
+
+    return decode_command_write(script, "ORIG", line)
+        && decode_command_write(script, "TEXT", line);
+}
+
+typedef struct
+{
+    int has_char;
+    int has_file;
+    int has_orig;
+    Span char_name;
+    Span file;
+    Span orig;
+} EncodeSpeech;
+
+typedef struct
+{
+    // lines written out so far, and whether any of them was too long
+    size_t line_count;
+    int too_long;
+    // the words of the line that's being filled
+    size_t word_count;
+    size_t width;
+} EncodeWrap;
+
+static int encode_wrap_line_begin(Script *script, EncodeWrap *wrap)
+{
+    return !wrap->line_count++
+        || text_append(
+            &script->output, span_make(NEWLINE_MARKER, NEWLINE_MARKER_SIZE));
+}
+
+static int encode_wrap_word(Script *script, EncodeWrap *wrap, const Span word)
+{
+    Text *output = &script->output;
+    const size_t word_width = span_width(word);
+    if (wrap->word_count
+        && wrap->width + 1 + word_width <= script->max_line_length)
+    {
+        wrap->word_count++;
+        wrap->width += 1 + word_width;
+        return text_append_char(output, ' ') && text_append(output, word);
+    }
+
+    if (wrap->word_count && wrap->width > script->max_line_length)
+        wrap->too_long = 1;
+    if (!encode_wrap_line_begin(script, wrap))
+        return 0;
+    wrap->word_count = 1;
+    wrap->width = word_width;
+    return text_append(output, word);
+}
+
+static int encode_wrap_segment(
+    Script *script, EncodeWrap *wrap, const Span segment)
+{
+    if (!segment.size)
+        return encode_wrap_line_begin(script, wrap);
+
+    wrap->word_count = 0;
+    wrap->width = 0;
+    size_t i = 0;
+    while (i < segment.size)
+    {
+        while (i < segment.size && Py_UNICODE_ISSPACE(segment.data[i]))
+            i++;
+        const size_t start = i;
+        while (i < segment.size && !Py_UNICODE_ISSPACE(segment.data[i]))
+            i++;
+        if (i > start
+            && !encode_wrap_word(script, wrap, span_slice(segment, start, i)))
+        {
+            return 0;
+        }
+    }
+    if (wrap->word_count && wrap->width > script->max_line_length)
+        wrap->too_long = 1;
+    return 1;
+}
+
+static int encode_is_opening(const Py_UCS4 c)
+{
+    return c == 0x300C || c == 0x300E || c == 0xFF08;  // 「 『 （
+}
+
+static int encode_is_closing(const Py_UCS4 c)
+{
+    return c == 0xFF09 || c == 0x300F || c == 0x300D;  // ） 』 」
+}
+
+// Word wraps the text of a line, keeping the brackets around it and the
+// explicit [n] line breaks in it.
+static int encode_text_write(
+    Script *script, const Span text, const size_t line_number)
+{
+    size_t start = 0;
+    size_t end = text.size;
+    while (start < end && encode_is_opening(text.data[start]))
+        start++;
+    while (end > start && encode_is_closing(text.data[end - 1]))
+        end--;
+
+    Text *output = &script->output;
+    if (!text_append(output, span_slice(text, 0, start)))
+        return 0;
+
+    EncodeWrap wrap = {0, 0, 0, 0};
+    size_t segment_start = start;
+    for (size_t i = start; ; )
+    {
+        if (i + NEWLINE_MARKER_SIZE <= end
+            && !memcmp(
+                text.data + i,
+                NEWLINE_MARKER,
+                NEWLINE_MARKER_SIZE * sizeof(Py_UCS4)))
+        {
+            if (!encode_wrap_segment(
+                    script, &wrap, span_slice(text, segment_start, i)))
+            {
+                return 0;
+            }
+            i += NEWLINE_MARKER_SIZE;
+            segment_start = i;
+        }
+        else if (i >= end)
+        {
+            if (!encode_wrap_segment(
+                    script, &wrap, span_slice(text, segment_start, end)))
+            {
+                return 0;
+            }
+            break;
+        }
+        else
+            i++;
+    }
+
+    if (wrap.line_count > script->max_line_count
+        && !script_warn(script, WARNING_TOO_MANY_LINES, line_number))
+    {
+        return 0;
+    }
+    if (wrap.too_long
+        && !script_warn(script, WARNING_TOO_LONG_LINE, line_number))
+    {
+        return 0;
+    }
+    return text_append(output, span_slice(text, end, text.size));
+}
+
+// An edited text that matches the original is written back untouched;
+// anything else gets word wrapped.
+static int encode_text_or_orig_write(
+    Script *script,
+    const int has_orig,
+    const Span orig,
+    const Span text,
+    const size_t line_number)
+{
+    if (has_orig && span_equals(orig, text))
+        return text_append(&script->output, orig);
+    return encode_text_write(script, text, line_number);
+}
+
+typedef struct
+{
+    Script base;
+    EncodeSpeech speech;
+    int has_orig;
+    Span orig;
+} EncodeScript;
+
+static int encode_line(
+    Script *base, const Span line, const size_t line_number)
+{
+    EncodeScript *script = (EncodeScript*)base;
+    Text *output = &base->output;
+
+    if (!line.size)
+        return script_line_begin(base);
+
+    // a line without spaces is a bare command, taken as it is; otherwise the
+    // command is the first word after any indentation
+    Span command = line;
+    Span arg = span_make(NULL, 0);
+    for (size_t i = 0; i < line.size; i++)
+    {
+        if (line.data[i] != ' ')
+            continue;
+        command = span_lstrip(line);
+        size_t space = 0;
+        while (space < command.size && command.data[space] != ' ')
+            space++;
+        if (space == command.size)
+        {
+            return script_malformed(
+                base, "Indented command without an argument", line_number);
+        }
+        arg = span_slice(command, space + 1, command.size);
+        command = span_slice(command, 0, space);
+        break;
+    }
+
+    EncodeSpeech *speech = &script->speech;
+    if (span_equals_ascii(command, "SPEAK-CHAR"))
+    {
+        speech->has_char = 1;
+        speech->char_name = arg;
+    }
+    else if (span_equals_ascii(command, "SPEAK-FILE"))
+    {
+        speech->has_file = 1;
+        speech->file = arg;
+    }
+    else if (span_equals_ascii(command, "SPEAK-ORIG"))
+    {
+        speech->has_orig = 1;
+        speech->orig = arg;
+    }
+    else if (span_equals_ascii(command, "SPEAK-TEXT"))
+    {
+        if (!speech->has_char)
+        {
+            return script_malformed(
+                base, "SPEAK-TEXT without SPEAK-CHAR", line_number);
+        }
+        if (!script_line_begin(base)
+            || !text_append_char(output, NAME_OPEN)
+            || !text_append(output, speech->char_name))
+        {
+            return 0;
+        }
+        if (speech->has_file
+            && !(text_append_char(output, ',')
+                && text_append(output, speech->file)))
+        {
+            return 0;
+        }
+        if (!text_append_char(output, NAME_CLOSE)
+            || !encode_text_or_orig_write(
+                base, speech->has_orig, speech->orig, arg, line_number))
+        {
+            return 0;
+        }
+        memset(speech, 0, sizeof(*speech));
+    }
+    else if (span_equals_ascii(command, "ORIG"))
+    {
+        script->has_orig = 1;
+        script->orig = arg;
+    }
+    else if (span_equals_ascii(command, "TEXT"))
+    {
+        if (!script_line_begin(base)
+            || !text_append_char(output, NAME_OPEN)
+            || !text_append_char(output, NAME_CLOSE)
+            || !encode_text_or_orig_write(
+                base, script->has_orig, script->orig, arg, line_number))
+        {
+            return 0;
+        }
+        script->has_orig = 0;
+    }
+    else if (span_equals_ascii(command, "CODE"))
+    {
+        return script_line_begin(base) && text_append(output, arg);
+    }
+    return 1;
+}
+
+static PyObject *script_warnings_build(const Warnings *warnings)
+{
+    static const char *messages[] = {"too many lines", "too long line"};
+    PyObject *output = PyList_New(warnings->count);
+    if (!output)
+        return NULL;
+    for (size_t i = 0; i < warnings->count; i++)
+    {
+        PyObject *item = Py_BuildValue(
+            "(sn)",
+            messages[warnings->items[i].kind],
+            (Py_ssize_t)warnings->items[i].line_number);
+        if (!item)
+        {
+            Py_DECREF(output);
+            return NULL;
+        }
+        PyList_SET_ITEM(output, i, item);
+    }
+    return output;
+}
+
+// Runs a conversion over a str without holding the GIL, and returns the
+// converted str, or a (str, warnings) tuple if with_warnings is set.
+static PyObject *script_convert(
+    Script *script,
+    PyObject *input,
+    int (*line)(Script *script, const Span span, const size_t line_number),
+    const int with_warnings)
+{
+    PyObject *output = NULL;
+    PyObject *text = NULL;
+    PyObject *warnings = NULL;
+    int ok;
+
+    Py_UCS4 *data = PyUnicode_AsUCS4Copy(input);
+    if (!data)
+        return NULL;
+    script->input = data;
+    script->input_size = PyUnicode_GET_LENGTH(input);
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = script_scan(script, line);
+    Py_END_ALLOW_THREADS
+
+    if (!ok)
+    {
+        if (script->malformed)
+        {
+            PyErr_Format(
+                PyExc_ValueError,
+                "%s at line %zu",
+                script->malformed,
+                script->malformed_line_number);
+        }
+        else
+            error_raise_pending();
+        goto end;
+    }
+
+    text = PyUnicode_FromKindAndData(
+        PyUnicode_4BYTE_KIND, script->output.data, script->output.size);
+    if (!text)
+        goto end;
+    if (!with_warnings)
+    {
+        output = text;
+        text = NULL;
+        goto end;
+    }
+    warnings = script_warnings_build(&script->warnings);
+    if (!warnings)
+        goto end;
+    output = PyTuple_Pack(2, text, warnings);
+
+end:
+    Py_XDECREF(text);
+    Py_XDECREF(warnings);
+    PyMem_Free(data);
+    PyMem_RawFree(script->output.data);
+    PyMem_RawFree(script->warnings.items);
+    return output;
+}
+
+static PyObject *script_decode(PyObject *self, PyObject *args)
+{
+    PyObject *input;
+    Script script = {0};
+
+    if (!PyArg_ParseTuple(args, "U", &input))
+        return NULL;
+    return script_convert(&script, input, decode_line, 0);
+}
+
+static PyObject *script_encode(PyObject *self, PyObject *args)
+{
+    PyObject *input;
+    Py_ssize_t max_line_count;
+    Py_ssize_t max_line_length;
+    EncodeScript script = {0};
+
+    if (!PyArg_ParseTuple(
+            args, "Unn", &input, &max_line_count, &max_line_length))
+    {
+        return NULL;
+    }
+    if (max_line_count < 0 || max_line_length < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid line limits");
+        return NULL;
+    }
+    script.base.max_line_count = max_line_count;
+    script.base.max_line_length = max_line_length;
+    return script_convert(&script.base, input, encode_line, 1);
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "decode_script",
+        script_decode,
+        METH_VARARGS,
+        "Turn the text of a game script into editable commands"
+    },
+    {
+        "encode_script",
+        script_encode,
+        METH_VARARGS,
+        "Turn edited commands back into the text of a game script, given "
+        "(text, max_line_count, max_line_length); returns the text and a list "
+        "of (warning, line number)"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyModuleDef_Slot module_slots[] = {
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib._script",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__script(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
@@ -0,0 +1,271 @@
+#include <Python.h>
+#include "stats.h"
+
+#ifdef TLG_STATS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_CLOCK_NAME "tsc"
+#else
+#include <time.h>
+#define STATS_CLOCK_NAME "ns"
+#endif
+
+static const char *stats_stage_names[STATS_STAGE_COUNT] = {
+    [STATS_LZSS_DECOMPRESS] = "lzss_decompress",
+    [STATS_LZSS_COMPRESS] = "lzss_compress",
+    [STATS_TLG5_RECONSTRUCT] = "tlg5_reconstruct",
+    [STATS_TLG5_RESIDUALS] = "tlg5_residuals",
+    [STATS_TLG6_GOLOMB] = "tlg6_golomb",
+    [STATS_TLG6_INTERLEAVE] = "tlg6_interleave",
+    [STATS_TLG6_TRANSFORM] = "tlg6_transform",
+    [STATS_TLG6_PREDICT] = "tlg6_predict",
+    [STATS_CONVERT] = "convert",
+};
+
+typedef struct
+{
+    _Atomic uint64_t calls;
+    _Atomic uint64_t clock;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+} StatsCounters;
+
+typedef struct StatsBlock
+{
+    StatsCounters stages[STATS_STAGE_COUNT];
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t allocated_bytes;
+    _Atomic uint64_t peak_scratch;
+    struct StatsBlock *prev;
+    struct StatsBlock *next;
+} StatsBlock;
+
+// Blocks of live threads are linked into a list; once a thread exits, its
+// counts are folded into the retired block and its own block goes away.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static StatsBlock *stats_live = NULL;
+static StatsBlock stats_retired;
+static uint64_t stats_thread_count = 0;
+static _Thread_local StatsBlock *stats_block = NULL;
+
+static inline uint64_t stats_load(_Atomic uint64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline void stats_store(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+// Only the owning thread writes to its block, so a plain load and store is
+// enough and keeps the hot paths free of locked instructions.
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    stats_store(counter, stats_load(counter) + value);
+}
+
+static inline void stats_max(_Atomic uint64_t *counter, uint64_t value)
+{
+    if (value > stats_load(counter))
+        stats_store(counter, value);
+}
+
+static void stats_block_merge(StatsBlock *target, StatsBlock *source)
+{
+    for (int i = 0; i < STATS_STAGE_COUNT; i++)
+    {
+        StatsCounters *to = &target->stages[i];
+        StatsCounters *from = &source->stages[i];
+        stats_add(&to->calls, stats_load(&from->calls));
+        stats_add(&to->clock, stats_load(&from->clock));
+        stats_add(&to->bytes_in, stats_load(&from->bytes_in));
+        stats_add(&to->bytes_out, stats_load(&from->bytes_out));
+    }
+    stats_add(&target->allocations, stats_load(&source->allocations));
+    stats_add(&target->allocated_bytes, stats_load(&source->allocated_bytes));
+    stats_max(&target->peak_scratch, stats_load(&source->peak_scratch));
+}
+
+static void stats_block_clear(StatsBlock *block)
+{
+    for (int i = 0; i < STATS_STAGE_COUNT; i++)
+    {
+        stats_store(&block->stages[i].calls, 0);
+        stats_store(&block->stages[i].clock, 0);
+        stats_store(&block->stages[i].bytes_in, 0);
+        stats_store(&block->stages[i].bytes_out, 0);
+    }
+    stats_store(&block->allocations, 0);
+    stats_store(&block->allocated_bytes, 0);
+    stats_store(&block->peak_scratch, 0);
+}
+
+static void stats_thread_exit(void *arg)
+{
+    StatsBlock *block = arg;
+    pthread_mutex_lock(&stats_lock);
+    stats_block_merge(&stats_retired, block);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        stats_live = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    pthread_mutex_unlock(&stats_lock);
+    PyMem_RawFree(block);
+}
+
+static void stats_init(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static StatsBlock *stats_block_get(void)
+{
+    if (stats_block)
+        return stats_block;
+
+    pthread_once(&stats_once, stats_init);
+    StatsBlock *block = PyMem_RawCalloc(1, sizeof(StatsBlock));
+    if (!block)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    block->next = stats_live;
+    if (stats_live)
+        stats_live->prev = block;
+    stats_live = block;
+    stats_thread_count++;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, block);
+    stats_block = block;
+    return block;
+}
+
+uint64_t stats_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void stats_stage_add(
+    const StatsStage stage,
+    const uint64_t clock,
+    const size_t bytes_in,
+    const size_t bytes_out)
+{
+    StatsBlock *block = stats_block_get();
+    if (!block)
+        return;
+    stats_add(&block->stages[stage].calls, 1);
+    stats_add(&block->stages[stage].clock, clock);
+    stats_add(&block->stages[stage].bytes_in, bytes_in);
+    stats_add(&block->stages[stage].bytes_out, bytes_out);
+}
+
+void stats_allocation_add(const size_t size)
+{
+    StatsBlock *block = stats_block_get();
+    if (!block)
+        return;
+    stats_add(&block->allocations, 1);
+    stats_add(&block->allocated_bytes, size);
+}
+
+void stats_scratch_add(const size_t size)
+{
+    StatsBlock *block = stats_block_get();
+    if (block)
+        stats_max(&block->peak_scratch, size);
+}
+
+static PyObject *stats_build(
+    StatsBlock *total, const uint64_t thread_count)
+{
+    PyObject *stages = PyDict_New();
+    if (!stages)
+        return NULL;
+    for (int i = 0; i < STATS_STAGE_COUNT; i++)
+    {
+        StatsCounters *counters = &total->stages[i];
+        PyObject *stage = Py_BuildValue(
+            "{sKsKsKsK}",
+            "calls", (unsigned long long)stats_load(&counters->calls),
+            "clock", (unsigned long long)stats_load(&counters->clock),
+            "bytes_in", (unsigned long long)stats_load(&counters->bytes_in),
+            "bytes_out",
+            (unsigned long long)stats_load(&counters->bytes_out));
+        if (!stage
+            || PyDict_SetItemString(stages, stats_stage_names[i], stage))
+        {
+            Py_XDECREF(stage);
+            Py_DECREF(stages);
+            return NULL;
+        }
+        Py_DECREF(stage);
+    }
+    return Py_BuildValue(
+        "{sssNsKsKsKsK}",
+        "clock", STATS_CLOCK_NAME,
+        "stages", stages,
+        "allocations",
+        (unsigned long long)stats_load(&total->allocations),
+        "allocated_bytes",
+        (unsigned long long)stats_load(&total->allocated_bytes),
+        "peak_scratch_bytes",
+        (unsigned long long)stats_load(&total->peak_scratch),
+        "threads",
+        (unsigned long long)thread_count);
+}
+
+PyObject *stats_get(PyObject *self, PyObject *args)
+{
+    StatsBlock total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    stats_block_merge(&total, &stats_retired);
+    for (StatsBlock *block = stats_live; block; block = block->next)
+        stats_block_merge(&total, block);
+    const uint64_t thread_count = stats_thread_count;
+    pthread_mutex_unlock(&stats_lock);
+    return stats_build(&total, thread_count);
+}
+
+// Counters of threads that are busy decoding at the same time may survive
+// the reset, so it's best done while the codecs are idle.
+PyObject *stats_reset(PyObject *self, PyObject *args)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_block_clear(&stats_retired);
+    for (StatsBlock *block = stats_live; block; block = block->next)
+        stats_block_clear(block);
+    stats_thread_count = 0;
+    for (StatsBlock *block = stats_live; block; block = block->next)
+        stats_thread_count++;
+    pthread_mutex_unlock(&stats_lock);
+    Py_RETURN_NONE;
+}
+
+#else
+
+PyObject *stats_get(PyObject *self, PyObject *args)
+{
+    Py_RETURN_NONE;
+}
+
+PyObject *stats_reset(PyObject *self, PyObject *args)
+{
+    Py_RETURN_NONE;
+}
+
+#endif
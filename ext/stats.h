@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <Python.h>
+#include <stdint.h>
+
+// Opt-in instrumentation of the codecs, enabled by building with TLG_STATS
+// defined. Every thread counts into its own block, so the hot paths never
+// contend; get_stats sums the blocks up. Without TLG_STATS, the macros below
+// expand to nothing and get_stats returns None.
+
+typedef enum
+{
+    STATS_LZSS_DECOMPRESS,
+    STATS_LZSS_COMPRESS,
+    STATS_TLG5_RECONSTRUCT,
+    STATS_TLG5_RESIDUALS,
+    STATS_TLG6_GOLOMB,
+    STATS_TLG6_INTERLEAVE,
+    STATS_TLG6_TRANSFORM,
+    STATS_TLG6_PREDICT,
+    STATS_CONVERT,
+    STATS_STAGE_COUNT
+} StatsStage;
+
+#ifdef TLG_STATS
+
+uint64_t stats_clock(void);
+void stats_stage_add(
+    const StatsStage stage,
+    const uint64_t clock,
+    const size_t bytes_in,
+    const size_t bytes_out);
+void stats_allocation_add(const size_t size);
+void stats_scratch_add(const size_t size);
+
+#define STATS_BEGIN(name) const uint64_t name = stats_clock()
+#define STATS_END(stage, name, bytes_in, bytes_out) \
+    stats_stage_add(stage, stats_clock() - name, bytes_in, bytes_out)
+#define STATS_ALLOCATION(size) stats_allocation_add(size)
+#define STATS_SCRATCH(size) stats_scratch_add(size)
+
+#else
+
+#define STATS_BEGIN(name)
+#define STATS_END(stage, name, bytes_in, bytes_out)
+#define STATS_ALLOCATION(size)
+#define STATS_SCRATCH(size)
+
+#endif
+
+PyObject *stats_get(PyObject *self, PyObject *args);
+PyObject *stats_reset(PyObject *self, PyObject *args);
+
+#define STATS_METHODS \
+    { \
+        "get_stats", \
+        stats_get, \
+        METH_NOARGS, \
+        "Per-stage timings and allocation counters summed over all threads, " \
+        "or None if the module was built without TLG_STATS" \
+    }, \
+    { \
+        "reset_stats", \
+        stats_reset, \
+        METH_NOARGS, \
+        "Zero the counters get_stats reports" \
+    }
+
+#endif
@@ -1,5 +1,7 @@
 #include <Python.h>
 #include <string.h>
+#include "error.h"
+#include "stats.h"
 #include "stream.h"
 
 Stream *stream_create_empty(void)
@@ -7,14 +9,14 @@ Stream *stream_create_empty(void)
     Stream *stream = PyMem_RawMalloc(sizeof(Stream));
     if (!stream)
     {
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return NULL;
     }
     stream->data = PyMem_RawMalloc(0);
     if (!stream->data)
     {
         PyMem_RawFree(stream);
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return NULL;
     }
     stream->size = 0;
@@ -28,7 +30,7 @@ Stream *stream_create_for_data(unsigned char *data, size_t data_size)
     Stream *stream = PyMem_RawMalloc(sizeof(Stream));
     if (!stream)
     {
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return NULL;
     }
     stream->data = data;
@@ -49,10 +51,10 @@ void stream_destroy(Stream *stream)
 int stream_read_data(Stream *stream, unsigned char *data, size_t data_size)
 {
     assert(stream);
-    assert(ret);
+    assert(data);
     if (stream->pos + data_size > stream->size)
     {
-        PyErr_SetString(PyExc_ValueError, "Reading beyond EOF");
+        error_set(PyExc_ValueError, "Reading beyond EOF");
         return 0;
     }
     memcpy(data, stream->data + stream->pos, data_size);
@@ -60,13 +62,40 @@ int stream_read_data(Stream *stream, unsigned char *data, size_t data_size)
     return 1;
 }
 
+// like stream_read_data, but points into the stream rather than copying
+int stream_read_view(Stream *stream, unsigned char **data, size_t data_size)
+{
+    assert(stream);
+    assert(data);
+    if (stream->pos + data_size > stream->size)
+    {
+        error_set(PyExc_ValueError, "Reading beyond EOF");
+        return 0;
+    }
+    *data = stream->data + stream->pos;
+    stream->pos += data_size;
+    return 1;
+}
+
+int stream_skip(Stream *stream, size_t data_size)
+{
+    assert(stream);
+    if (stream->pos + data_size > stream->size)
+    {
+        error_set(PyExc_ValueError, "Reading beyond EOF");
+        return 0;
+    }
+    stream->pos += data_size;
+    return 1;
+}
+
 int stream_read_u8(Stream *stream, uint8_t *ret)
 {
     assert(stream);
     assert(ret);
     if (stream->pos + 1 > stream->size)
     {
-        PyErr_SetString(PyExc_ValueError, "Reading beyond EOF");
+        error_set(PyExc_ValueError, "Reading beyond EOF");
         return 0;
     }
     *ret = *(const uint8_t*)(stream->data + stream->pos);
@@ -80,7 +109,7 @@ int stream_read_u32_le(Stream *stream, uint32_t *ret)
     assert(ret);
     if (stream->pos + 4 > stream->size)
     {
-        PyErr_SetString(PyExc_ValueError, "Reading beyond EOF");
+        error_set(PyExc_ValueError, "Reading beyond EOF");
         return 0;
     }
     *ret = *(const uint32_t*)(stream->data + stream->pos);
@@ -93,12 +122,19 @@ static int ensure_stream_size(Stream *stream, size_t how_much)
     size_t new_size = stream->pos + how_much;
     if (new_size <= stream->size)
         return 1;
+    // streams over borrowed data can't grow
+    if (!stream->owns_data)
+    {
+        error_set(PyExc_ValueError, "Writing beyond EOF");
+        return 0;
+    }
     unsigned char *new_data = PyMem_RawRealloc(stream->data, new_size);
     if (!new_data)
     {
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return 0;
     }
+    STATS_ALLOCATION(new_size);
     stream->data = new_data;
     stream->size = new_size;
     return 1;
@@ -107,7 +143,7 @@ static int ensure_stream_size(Stream *stream, size_t how_much)
 int stream_write_data(Stream *stream, const unsigned char *data, size_t data_size)
 {
     assert(stream);
-    assert(ret);
+    assert(data);
     if (!ensure_stream_size(stream, data_size))
         return 0;
     memcpy(stream->data + stream->pos, data, data_size);
@@ -118,7 +154,6 @@ int stream_write_data(Stream *stream, const unsigned char *data, size_t data_siz
 int stream_write_u8(Stream *stream, uint8_t data)
 {
     assert(stream);
-    assert(ret);
     if (!ensure_stream_size(stream, 1))
         return 0;
     *((uint8_t*)(stream->data + stream->pos)) = data;
@@ -129,7 +164,6 @@ int stream_write_u8(Stream *stream, uint8_t data)
 int stream_write_u32_le(Stream *stream, uint32_t data)
 {
     assert(stream);
-    assert(ret);
     if (!ensure_stream_size(stream, 4))
         return 0;
     *((uint32_t*)(stream->data + stream->pos)) = data;
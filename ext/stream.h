@@ -17,6 +17,8 @@ Stream *stream_create_for_data(unsigned char *data, size_t data_size);
 void stream_destroy(Stream *stream);
 
 int stream_read_data(Stream *stream, unsigned char *data, size_t data_size);
+int stream_read_view(Stream *stream, unsigned char **data, size_t data_size);
+int stream_skip(Stream *stream, size_t data_size);
 int stream_read_u8(Stream *stream, uint8_t *ret);
 int stream_read_u32_le(Stream *stream, uint32_t *ret);
 
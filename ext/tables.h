@@ -0,0 +1,20 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+#include "golomb.h"
+
+// Lookup tables that never change. Their definitions are generated by
+// ext/tables.py at build time, so they are plain read-only data that any
+// number of threads and interpreters can share.
+
+// Position of the lowest set bit of a 12-bit value, counting from 1, or 0 for
+// zero; the TLG6 bit reader looks up runs of zeros in it.
+#define TLG6_LEADING_ZERO_TABLE_BITS 12
+#define TLG6_LEADING_ZERO_TABLE_SIZE (1 << TLG6_LEADING_ZERO_TABLE_BITS)
+extern const uint8_t tlg6_leading_zero_table[TLG6_LEADING_ZERO_TABLE_SIZE];
+
+// ECMA-182 CRC-64, not reflected, one byte at a time
+extern const uint64_t crc64_table[256];
+
+#endif
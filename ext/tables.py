@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# Generates the lookup tables declared in tables.h. setup.py runs this before
+# compiling, so the tables end up as read-only data instead of being filled in
+# when a module is first imported.
+import sys
+from typing import Iterable, List
+
+# The lengths of the runs of equal plain bit counts in each column of the
+# TLG6 Golomb table: column n has 3 entries of 0 bits, then 7 of 1 bit and so
+# on.
+GOLOMB_COMPRESSION_TABLE = [
+    [3, 7, 15, 27, 63, 108, 223, 448, 130],
+    [3, 5, 13, 24, 51, 95, 192, 384, 257],
+    [2, 5, 12, 21, 39, 86, 155, 320, 384],
+    [2, 3, 9, 18, 33, 61, 129, 258, 511],
+]
+GOLOMB_N_COUNT = len(GOLOMB_COMPRESSION_TABLE)
+GOLOMB_A_COUNT = GOLOMB_N_COUNT * 2 * 128
+
+TLG6_LEADING_ZERO_TABLE_BITS = 12
+
+CRC64_POLYNOMIAL = 0x42F0E1EBA9EA3693
+MASK_64 = (1 << 64) - 1
+
+
+def golomb_bit_size_table() -> List[List[int]]:
+    columns = []
+    for runs in GOLOMB_COMPRESSION_TABLE:
+        column = [bits for bits, run in enumerate(runs) for _ in range(run)]
+        assert len(column) == GOLOMB_A_COUNT
+        columns.append(column)
+    return [list(row) for row in zip(*columns)]
+
+
+def tlg6_leading_zero_table() -> List[int]:
+    # the position of the lowest set bit, counting from 1, or 0 if there is
+    # none among the low TLG6_LEADING_ZERO_TABLE_BITS bits
+    size = 1 << TLG6_LEADING_ZERO_TABLE_BITS
+    return [0] + [
+        (value & -value).bit_length() for value in range(1, size)]
+
+
+def crc64_table() -> List[int]:
+    table = []
+    for value in range(256):
+        crc = value << 56
+        for _ in range(8):
+            crc = ((crc << 1) & MASK_64) ^ (
+                CRC64_POLYNOMIAL if crc >> 63 else 0)
+        table.append(crc)
+    return table
+
+
+def format_values(values: Iterable[str], indent: str, per_line: int) -> str:
+    values = list(values)
+    return ',\n'.join(
+        indent + ', '.join(values[i:i + per_line])
+        for i in range(0, len(values), per_line))
+
+
+def generate() -> str:
+    golomb_rows = ',\n'.join(
+        '    {' + ', '.join(str(bits) for bits in row) + '}'
+        for row in golomb_bit_size_table())
+    return '''// Generated by ext/tables.py; do not edit.
+#include "tables.h"
+
+const uint8_t golomb_bit_size_table[GOLOMB_A_COUNT][GOLOMB_N_COUNT] =
+{{
+{golomb}
+}};
+
+const uint8_t tlg6_leading_zero_table[TLG6_LEADING_ZERO_TABLE_SIZE] =
+{{
+{leading_zero}
+}};
+
+const uint64_t crc64_table[256] =
+{{
+{crc64}
+}};
+'''.format(
+        golomb=golomb_rows,
+        leading_zero=format_values(
+            (str(value) for value in tlg6_leading_zero_table()), '    ', 16),
+        crc64=format_values(
+            ('0x{:016X}ULL'.format(value) for value in crc64_table()),
+            '    ',
+            3))
+
+
+def main() -> None:
+    if len(sys.argv) != 2:
+        sys.exit('Usage: {} OUTPUT'.format(sys.argv[0]))
+    with open(sys.argv[1], 'w') as handle:
+        handle.write(generate())
+
+
+if __name__ == '__main__':
+    main()
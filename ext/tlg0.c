@@ -0,0 +1,408 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "error.h"
+#include "module.h"
+#include "stats.h"
+#include "stream.h"
+
+#define MAGIC "TLG0.0\x00sds\x1A"
+#define MAGIC_SIZE 11
+
+#define TAGS_CHUNK_NAME "tags"
+#define CHUNK_NAME_SIZE 4
+
+// Reads a "<size>:<data>" string and moves past it.
+static int tlg0_string_read(
+    const unsigned char **pos,
+    const unsigned char *end,
+    const unsigned char **data,
+    size_t *data_size)
+{
+    const unsigned char *p = *pos;
+    size_t size = 0;
+    if (p == end || *p < '0' || *p > '9')
+        return 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        size = size * 10 + (*p++ - '0');
+        if (size > (size_t)(end - p))
+            return 0;
+    }
+    if (p == end || *p++ != ':' || size > (size_t)(end - p))
+        return 0;
+    *data = p;
+    *data_size = size;
+    *pos = p + size;
+    return 1;
+}
+
+// Parses a tags chunk in a single pass, appending (key, value) tuples.
+static int tlg0_tags_read(
+    const unsigned char *data, const size_t data_size, PyObject *tags)
+{
+    const unsigned char *pos = data;
+    const unsigned char *end = data + data_size;
+    while (pos < end)
+    {
+        const unsigned char *key, *value;
+        size_t key_size, value_size;
+        if (!tlg0_string_read(&pos, end, &key, &key_size)
+            || pos == end
+            || *pos++ != '='
+            || !tlg0_string_read(&pos, end, &value, &value_size)
+            || (pos < end && *pos++ != ','))
+        {
+            PyErr_SetString(PyExc_ValueError, "Corrupt tags");
+            return 0;
+        }
+
+        PyObject *tag = Py_BuildValue(
+            "(y#y#)",
+            key,
+            (Py_ssize_t)key_size,
+            value,
+            (Py_ssize_t)value_size);
+        if (!tag)
+            return 0;
+        int result = PyList_Append(tags, tag);
+        Py_DECREF(tag);
+        if (result < 0)
+            return 0;
+    }
+    return 1;
+}
+
+static PyObject *tlg0_read(PyObject *self, PyObject *args)
+{
+    PyObject *input = NULL;
+    Py_buffer input_data = {0};
+    Stream *stream = NULL;
+    PyObject *view = NULL;
+    PyObject *image = NULL;
+    PyObject *tags = NULL;
+    PyObject *output = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &input))
+        goto end;
+    if (PyObject_GetBuffer(input, &input_data, PyBUF_SIMPLE) < 0)
+        goto end;
+
+    if (input_data.len < MAGIC_SIZE
+        || memcmp(input_data.buf, MAGIC, MAGIC_SIZE))
+    {
+        PyErr_SetString(PyExc_ValueError, "Not a TLG0 image");
+        goto end;
+    }
+
+    stream = stream_create_for_data(input_data.buf, input_data.len);
+    if (!stream)
+        goto end;
+    stream->pos = MAGIC_SIZE;
+
+    uint32_t image_size;
+    if (!stream_read_u32_le(stream, &image_size))
+        goto end;
+    const size_t image_offset = stream->pos;
+    if (!stream_skip(stream, image_size))
+        goto end;
+
+    tags = PyList_New(0);
+    if (!tags)
+        goto end;
+
+    while (stream->pos < stream->size)
+    {
+        unsigned char *chunk_name;
+        uint32_t chunk_size;
+        unsigned char *chunk_data;
+        if (!stream_read_view(stream, &chunk_name, CHUNK_NAME_SIZE))
+            goto end;
+        if (!stream_read_u32_le(stream, &chunk_size))
+            goto end;
+        if (!stream_read_view(stream, &chunk_data, chunk_size))
+            goto end;
+
+        if (memcmp(chunk_name, TAGS_CHUNK_NAME, CHUNK_NAME_SIZE))
+        {
+            PyErr_Format(
+                PyExc_NotImplementedError,
+                "Unknown chunk: %.4s",
+                chunk_name);
+            goto end;
+        }
+        if (!tlg0_tags_read(chunk_data, chunk_size, tags))
+            goto end;
+    }
+
+    // hand out the inner image as a view into the input rather than a copy
+    view = PyMemoryView_FromObject(input);
+    if (!view)
+        goto end;
+    image = PySequence_GetSlice(view, image_offset, image_offset + image_size);
+    if (!image)
+        goto end;
+
+    output = PyTuple_Pack(2, image, tags);
+
+end:
+    if (stream)
+        stream_destroy(stream);
+    Py_XDECREF(view);
+    Py_XDECREF(image);
+    Py_XDECREF(tags);
+    PyBuffer_Release(&input_data);
+    if (!output && !PyErr_Occurred())
+        error_raise_pending();
+    return output;
+}
+
+static size_t tlg0_decimal_size(size_t number)
+{
+    size_t size = 1;
+    while (number >= 10)
+    {
+        number /= 10;
+        size++;
+    }
+    return size;
+}
+
+static size_t tlg0_string_size(const Py_buffer *buffer)
+{
+    return tlg0_decimal_size(buffer->len) + 1 + buffer->len;
+}
+
+static unsigned char *tlg0_string_write(
+    unsigned char *target, const Py_buffer *buffer)
+{
+    const size_t digit_count = tlg0_decimal_size(buffer->len);
+    size_t number = buffer->len;
+    for (size_t i = digit_count; i > 0; i--)
+    {
+        target[i - 1] = '0' + number % 10;
+        number /= 10;
+    }
+    target += digit_count;
+    *target++ = ':';
+    memcpy(target, buffer->buf, buffer->len);
+    return target + buffer->len;
+}
+
+static unsigned char *tlg0_u32_le_write(
+    unsigned char *target, const uint32_t value)
+{
+    target[0] = value;
+    target[1] = value >> 8;
+    target[2] = value >> 16;
+    target[3] = value >> 24;
+    return target + 4;
+}
+
+// Lays out a container with room for an image of the given size and fills in
+// everything but the image, whose offset is returned. The container is a
+// bytearray when it has to be written to after it's handed out, and bytes
+// otherwise.
+static PyObject *tlg0_container_create(
+    PyObject *tags_input,
+    const size_t image_size,
+    const int is_mutable,
+    size_t *image_offset)
+{
+    PyObject *tags = NULL;
+    Py_buffer *tag_buffers = NULL;
+    Py_ssize_t tag_count = 0;
+    Py_ssize_t buffer_count = 0;
+    PyObject *output = NULL;
+
+    tags = PySequence_Fast(tags_input, "Tags must be a sequence");
+    if (!tags)
+        goto end;
+    tag_count = PySequence_Fast_GET_SIZE(tags);
+
+    // keys and values alternate
+    tag_buffers = PyMem_Calloc(tag_count * 2 + 1, sizeof(Py_buffer));
+    if (!tag_buffers)
+    {
+        PyErr_NoMemory();
+        goto end;
+    }
+
+    size_t chunk_size = 0;
+    for (Py_ssize_t i = 0; i < tag_count; i++)
+    {
+        PyObject *tag = PySequence_Fast_GET_ITEM(tags, i);
+        if (!PyArg_ParseTuple(
+                tag,
+                "y*y*;Tags must be (key, value) tuples",
+                &tag_buffers[i * 2],
+                &tag_buffers[i * 2 + 1]))
+        {
+            goto end;
+        }
+        buffer_count = i * 2 + 2;
+        if (i)
+            chunk_size++;
+        chunk_size += tlg0_string_size(&tag_buffers[i * 2]) + 1;
+        chunk_size += tlg0_string_size(&tag_buffers[i * 2 + 1]);
+    }
+
+    if (image_size > UINT32_MAX || chunk_size > UINT32_MAX)
+    {
+        PyErr_SetString(PyExc_ValueError, "Data too large");
+        goto end;
+    }
+
+    size_t output_size = MAGIC_SIZE + 4 + image_size;
+    if (tag_count)
+        output_size += CHUNK_NAME_SIZE + 4 + chunk_size;
+
+    output = is_mutable
+        ? PyByteArray_FromStringAndSize(NULL, output_size)
+        : PyBytes_FromStringAndSize(NULL, output_size);
+    if (!output)
+        goto end;
+
+    unsigned char *start = is_mutable
+        ? (unsigned char*)PyByteArray_AS_STRING(output)
+        : (unsigned char*)PyBytes_AS_STRING(output);
+    unsigned char *target = start;
+    memcpy(target, MAGIC, MAGIC_SIZE);
+    target += MAGIC_SIZE;
+    target = tlg0_u32_le_write(target, image_size);
+    *image_offset = target - start;
+    target += image_size;
+
+    if (tag_count)
+    {
+        memcpy(target, TAGS_CHUNK_NAME, CHUNK_NAME_SIZE);
+        target += CHUNK_NAME_SIZE;
+        target = tlg0_u32_le_write(target, chunk_size);
+        for (Py_ssize_t i = 0; i < tag_count; i++)
+        {
+            if (i)
+                *target++ = ',';
+            target = tlg0_string_write(target, &tag_buffers[i * 2]);
+            *target++ = '=';
+            target = tlg0_string_write(target, &tag_buffers[i * 2 + 1]);
+        }
+    }
+    assert(target == start + output_size);
+
+end:
+    for (Py_ssize_t i = 0; i < buffer_count; i++)
+        PyBuffer_Release(&tag_buffers[i]);
+    PyMem_Free(tag_buffers);
+    Py_XDECREF(tags);
+    return output;
+}
+
+static PyObject *tlg0_write(PyObject *self, PyObject *args)
+{
+    Py_buffer image_data = {0};
+    PyObject *tags = NULL;
+    PyObject *output = NULL;
+    size_t image_offset;
+
+    if (!PyArg_ParseTuple(args, "y*O", &image_data, &tags))
+        return NULL;
+
+    output = tlg0_container_create(tags, image_data.len, 0, &image_offset);
+    if (output)
+    {
+        memcpy(
+            PyBytes_AS_STRING(output) + image_offset,
+            image_data.buf,
+            image_data.len);
+    }
+    PyBuffer_Release(&image_data);
+    return output;
+}
+
+static PyObject *tlg0_create(PyObject *self, PyObject *args)
+{
+    Py_ssize_t image_size;
+    PyObject *tags = NULL;
+    PyObject *output = NULL;
+    PyObject *view = NULL;
+    PyObject *image = NULL;
+    PyObject *ret = NULL;
+    size_t image_offset;
+
+    if (!PyArg_ParseTuple(args, "nO", &image_size, &tags))
+        return NULL;
+    if (image_size < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid image size");
+        return NULL;
+    }
+
+    output = tlg0_container_create(tags, image_size, 1, &image_offset);
+    if (!output)
+        goto end;
+    view = PyMemoryView_FromObject(output);
+    if (!view)
+        goto end;
+    image = PySequence_GetSlice(view, image_offset, image_offset + image_size);
+    if (!image)
+        goto end;
+    ret = PyTuple_Pack(2, output, image);
+
+end:
+    Py_XDECREF(output);
+    Py_XDECREF(view);
+    Py_XDECREF(image);
+    return ret;
+}
+
+static PyMethodDef Methods[] = {
+    {
+        "read_tlg_0",
+        tlg0_read,
+        METH_VARARGS,
+        "Split a tlg0 container into a view of the inner image and its tags"
+    },
+    {
+        "write_tlg_0",
+        tlg0_write,
+        METH_VARARGS,
+        "Wrap an encoded image and its tags into a tlg0 container"
+    },
+    {
+        "create_tlg_0",
+        tlg0_create,
+        METH_VARARGS,
+        "Lay out a tlg0 container for an image of the given size that is yet "
+        "to be written; returns the container and a view of the image slot"
+    },
+    STATS_METHODS,
+    {NULL, NULL, 0, NULL}
+};
+
+static int tlg0_exec(PyObject *module)
+{
+    PyObject *magic = PyBytes_FromStringAndSize(MAGIC, MAGIC_SIZE);
+    if (!magic || PyModule_AddObject(module, "MAGIC", magic))
+    {
+        Py_XDECREF(magic);
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, tlg0_exec},
+    MODULE_SLOTS
+};
+
+static struct PyModuleDef module_definition = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib.tlg._tlg0",
+    .m_methods = Methods,
+    .m_slots = module_slots,
+};
+
+PyMODINIT_FUNC PyInit__tlg0(void)
+{
+    return PyModuleDef_Init(&module_definition);
+}
@@ -1,11 +1,33 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <pythread.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "decode.h"
+#include "error.h"
+#include "format.h"
+#include "hash.h"
+#include "kernels.h"
+#include "module.h"
+#include "scratch.h"
+#include "stats.h"
 #include "stream.h"
 #include "lzss.h"
 #include "pixel.h"
 
 #define MAGIC "TLG5.0\x00raw\x1A"
 #define MAGIC_SIZE 11
+#define TLG5_HEADER_SIZE 13
+#define TLG5_BLOCK_HEIGHT 16
+
+// for some reason, even though the dummy lzss compression seems to work
+// correctly, the game crashes... therefore we'll stick to raw mode
+#define TLG5_USE_LZSS 0
+
+// scratch slots 0-3 hold the decompressed block of each channel
+#define SCRATCH_BLOCK_DATA 0
 
 typedef struct
 {
@@ -21,34 +43,23 @@ typedef struct
     size_t data_size;
 } Tlg5BlockInfo;
 
-static Tlg5BlockInfo *tlg5_block_info_create_empty(void)
-{
-    Tlg5BlockInfo *block_info = PyMem_RawMalloc(sizeof(Tlg5BlockInfo));
-    if (!block_info)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
-        return NULL;
-    }
-    block_info->data = NULL;
-    block_info->data_size = 0;
-    return block_info;
-}
-
 static Tlg5BlockInfo *tlg5_block_info_create_for_data(const size_t data_size)
 {
     Tlg5BlockInfo *block_info = PyMem_RawMalloc(sizeof(Tlg5BlockInfo));
     if (!block_info)
     {
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return NULL;
     }
     block_info->data = PyMem_RawMalloc(data_size);
     if (!block_info->data)
     {
         PyMem_RawFree(block_info);
-        PyErr_SetNone(PyExc_MemoryError);
+        error_set_no_memory();
         return NULL;
     }
+    STATS_ALLOCATION(sizeof(Tlg5BlockInfo));
+    STATS_ALLOCATION(data_size);
     block_info->data_size = data_size;
     return block_info;
 }
@@ -64,65 +75,47 @@ static int tlg5_block_info_read(
     Tlg5BlockInfo *block_info,
     Stream *stream,
     const Tlg5Header *header,
+    unsigned char *buffer,
     uint8_t *dict,
     size_t *dict_pos)
 {
     assert(block_info);
     assert(stream);
     assert(header);
+    assert(buffer);
     assert(dict);
     assert(dict_pos);
 
     uint8_t mark;
     uint32_t data_comp_size;
-    unsigned char *data_comp = NULL;
-    unsigned char *data_orig = NULL;
-    int ret = 0;
+    unsigned char *data_comp;
 
-    const size_t data_orig_size = header->image_width * header->block_height;
+    const size_t data_orig_size =
+        (size_t)header->image_width * header->block_height;
 
     if (!stream_read_u8(stream, &mark))
-        goto end;
+        return 0;
 
     if (!stream_read_u32_le(stream, &data_comp_size))
-        goto end;
+        return 0;
 
     if (mark == 0)
     {
-        data_comp = PyMem_RawMalloc(data_comp_size);
-        if (!data_comp)
-        {
-            PyErr_SetNone(PyExc_MemoryError);
-            goto end;
-        }
-        if (!stream_read_data(stream, data_comp, data_comp_size))
-            goto end;
-
-        data_orig = lzss_decompress(
-            data_comp, data_comp_size, data_orig_size, dict, dict_pos);
-        if (!data_orig)
-            goto end;
+        if (!stream_read_view(stream, &data_comp, data_comp_size))
+            return 0;
+        lzss_decompress(
+            data_comp, data_comp_size, buffer, data_orig_size, dict, dict_pos);
+        block_info->data = buffer;
     }
     else
     {
-        data_orig = PyMem_RawMalloc(data_comp_size);
-        if (!data_orig)
-        {
-            PyErr_SetNone(PyExc_MemoryError);
-            goto end;
-        }
-        if (!stream_read_data(stream, data_orig, data_orig_size))
-            goto end;
+        // raw blocks are used straight from the input, without copying
+        if (!stream_read_view(stream, &block_info->data, data_orig_size))
+            return 0;
     }
 
-    block_info->data = data_orig;
     block_info->data_size = data_orig_size;
-
-    ret = 1;
-end:
-    if (data_comp)
-        PyMem_RawFree(data_comp);
-    return ret;
+    return 1;
 }
 
 static int tlg5_block_info_write(
@@ -145,18 +138,28 @@ static int tlg5_block_info_write(
     unsigned char *data_comp = NULL;
     size_t data_comp_size = 0;
 
-    data_comp = lzss_compress(
-        block_info->data,
-        block_info->data_size,
-        &data_comp_size,
-        dict,
-        dict_pos);
-
-    // for some reason, even though the dummy lzss compression seems to work
-    // correctly, the game crashes... therefore we'll stick to raw mode
-    if (0 && data_comp_size < data_orig_size)
+    // running the compressor is by far the most expensive part of encoding,
+    // so don't do it only to throw its output away
+    unsigned char new_dict[4096];
+    size_t new_dict_pos = *dict_pos;
+    if (TLG5_USE_LZSS)
     {
+        memcpy(new_dict, dict, sizeof(new_dict));
+        data_comp = lzss_compress(
+            block_info->data,
+            block_info->data_size,
+            &data_comp_size,
+            new_dict,
+            &new_dict_pos);
         if (!data_comp) goto end;
+    }
+
+    // the decoder only feeds compressed blocks through the dictionary, so it
+    // must not remember blocks that end up stored raw
+    if (data_comp && data_comp_size < data_orig_size)
+    {
+        memcpy(dict, new_dict, sizeof(new_dict));
+        *dict_pos = new_dict_pos;
         if (!stream_write_u8(stream, 0)) goto end;
         if (!stream_write_u32_le(stream, data_comp_size)) goto end;
         if (!stream_write_data(stream, data_comp, data_comp_size)) goto end;
@@ -198,231 +201,552 @@ static int tlg5_header_write(Stream *stream, Tlg5Header *header)
     return 1;
 }
 
-static int tlg5_load_pixel_block_row(
-    Pixel *image_data,
-    const size_t image_data_size,
+static void tlg5_load_pixel_block_row(
+    RowSink *sink,
     Tlg5BlockInfo **block_data,
     const Tlg5Header *header,
-    size_t block_y)
+    const uint32_t block_y,
+    Pixel **prev_line)
 {
-    size_t max_y = block_y + header->block_height;
-    if (max_y > header->image_height)
-        max_y = header->image_height;
+    const Kernels *kernels = kernels_get();
+    uint32_t max_y = block_y + header->block_height;
+    if (max_y > sink->height)
+        max_y = sink->height;
     int use_alpha = header->channel_count == 4;
 
-    for (size_t y = block_y; y < max_y; y++)
+    for (uint32_t y = block_y; y < max_y; y++)
     {
-        size_t block_y_shift = (y - block_y) * header->image_width;
-        Pixel prev_pixel = {0, 0, 0, 0};
+        size_t block_y_shift = (size_t)(y - block_y) * header->image_width;
+        Pixel *line = sink->row_begin(sink, y);
+        STATS_BEGIN(start_clock);
+        const uint8_t *planes[4];
+        for (int channel = 0; channel < header->channel_count; channel++)
+            planes[channel] = block_data[channel]->data + block_y_shift;
+        if (!use_alpha)
+            planes[3] = NULL;
+        kernels->tlg5_reconstruct_row(
+            line, *prev_line, planes, sink->width, use_alpha);
+        STATS_END(
+            STATS_TLG5_RECONSTRUCT,
+            start_clock,
+            sink->width * header->channel_count,
+            sink->width * sizeof(Pixel));
+
+        sink->row_end(sink, y);
+        *prev_line = line;
+    }
+}
 
-        for (size_t x = 0; x < header->image_width; x++)
+// Computes the residuals of one row and splits them into the B, G, R and A
+// planes in a single pass. top_line is NULL for the first row of the image.
+static void tlg5_save_pixel_row(
+    const Pixel *line,
+    const Pixel *top_line,
+    unsigned char *const *planes,
+    const size_t width)
+{
+    size_t x = 0;
+    // vertical residual of the pixel left of x
+    Pixel prev_pixel = {0, 0, 0, 0};
+
+#ifdef __SSE2__
+    const __m128i mask_low = _mm_set1_epi16(0x00FF);
+    const __m128i mask_r = _mm_set1_epi32(0x000000FF);
+    const __m128i mask_b = _mm_set1_epi32(0x00FF0000);
+    __m128i carry = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i residuals[4];
+        for (int i = 0; i < 4; i++)
         {
-            Pixel pixel;
-            pixel.b = block_data[0]->data[block_y_shift + x];
-            pixel.g = block_data[1]->data[block_y_shift + x];
-            pixel.r = block_data[2]->data[block_y_shift + x];
-            pixel.a = use_alpha
-                ? block_data[3]->data[block_y_shift + x]
-                : 0xFF;
-            pixel.b += pixel.g;
-            pixel.r += pixel.g;
-
-            prev_pixel.r += pixel.r;
-            prev_pixel.g += pixel.g;
-            prev_pixel.b += pixel.b;
-            prev_pixel.a += pixel.a;
-
-            Pixel *target_pixel = image_data + y * header->image_width + x;
-            if (target_pixel >= image_data + image_data_size/sizeof(Pixel))
+            __m128i vertical =
+                _mm_loadu_si128((const __m128i*)(line + x + i * 4));
+            if (top_line)
             {
-                PyErr_SetString(PyExc_ValueError, "Corrupt data");
-                return 0;
+                vertical = _mm_sub_epi8(
+                    vertical,
+                    _mm_loadu_si128((const __m128i*)(top_line + x + i * 4)));
             }
+            const __m128i left = _mm_or_si128(
+                _mm_slli_si128(vertical, 4), _mm_srli_si128(carry, 12));
+            carry = vertical;
+            __m128i residual = _mm_sub_epi8(vertical, left);
+            // move g under r and b to take it out of both
+            const __m128i green = _mm_or_si128(
+                _mm_and_si128(_mm_srli_epi32(residual, 8), mask_r),
+                _mm_and_si128(_mm_slli_epi32(residual, 8), mask_b));
+            residuals[i] = _mm_sub_epi8(residual, green);
+        }
 
-            target_pixel->r = prev_pixel.r;
-            target_pixel->g = prev_pixel.g;
-            target_pixel->b = prev_pixel.b;
-            target_pixel->a = prev_pixel.a;
-            if (y > 0)
-            {
-                Pixel *top_pixel = target_pixel - header->image_width;
-                target_pixel->r += top_pixel->r;
-                target_pixel->g += top_pixel->g;
-                target_pixel->b += top_pixel->b;
-                target_pixel->a += top_pixel->a;
-            }
-            if (!use_alpha)
-                image_data[y * header->image_width + x].a = 0xFF;
+        // RGBA -> RB/GA pairs of 8 pixels -> planes of 16 pixels
+        const __m128i rb0 = _mm_packus_epi16(
+            _mm_and_si128(residuals[0], mask_low),
+            _mm_and_si128(residuals[1], mask_low));
+        const __m128i rb1 = _mm_packus_epi16(
+            _mm_and_si128(residuals[2], mask_low),
+            _mm_and_si128(residuals[3], mask_low));
+        const __m128i ga0 = _mm_packus_epi16(
+            _mm_srli_epi16(residuals[0], 8), _mm_srli_epi16(residuals[1], 8));
+        const __m128i ga1 = _mm_packus_epi16(
+            _mm_srli_epi16(residuals[2], 8), _mm_srli_epi16(residuals[3], 8));
+        _mm_storeu_si128(
+            (__m128i*)(planes[0] + x),
+            _mm_packus_epi16(_mm_srli_epi16(rb0, 8), _mm_srli_epi16(rb1, 8)));
+        _mm_storeu_si128(
+            (__m128i*)(planes[1] + x),
+            _mm_packus_epi16(
+                _mm_and_si128(ga0, mask_low), _mm_and_si128(ga1, mask_low)));
+        _mm_storeu_si128(
+            (__m128i*)(planes[2] + x),
+            _mm_packus_epi16(
+                _mm_and_si128(rb0, mask_low), _mm_and_si128(rb1, mask_low)));
+        _mm_storeu_si128(
+            (__m128i*)(planes[3] + x),
+            _mm_packus_epi16(_mm_srli_epi16(ga0, 8), _mm_srli_epi16(ga1, 8)));
+    }
+    const uint32_t carry_pixel = _mm_cvtsi128_si32(_mm_srli_si128(carry, 12));
+    memcpy(&prev_pixel, &carry_pixel, sizeof(prev_pixel));
+#endif
+
+    for (; x < width; x++)
+    {
+        Pixel pixel = line[x];
+
+        if (top_line)
+        {
+            const Pixel *top_pixel = top_line + x;
+            pixel.r -= top_pixel->r;
+            pixel.g -= top_pixel->g;
+            pixel.b -= top_pixel->b;
+            pixel.a -= top_pixel->a;
         }
+
+        const Pixel vertical = pixel;
+        pixel.r -= prev_pixel.r;
+        pixel.g -= prev_pixel.g;
+        pixel.b -= prev_pixel.b;
+        pixel.a -= prev_pixel.a;
+        prev_pixel = vertical;
+
+        pixel.b -= pixel.g;
+        pixel.r -= pixel.g;
+        planes[0][x] = pixel.b;
+        planes[1][x] = pixel.g;
+        planes[2][x] = pixel.r;
+        planes[3][x] = pixel.a;
     }
-    return 1;
 }
 
-static int tlg5_save_pixel_block_row(
-    const Pixel *image_data,
-    const size_t image_data_size,
-    Tlg5BlockInfo **block_data,
+typedef struct
+{
+    Tlg5Header header;
+    Tlg5BlockInfo *block_info[4];
+    // copy of the last row written, which the next one is predicted from
+    Pixel *prev_line;
+    uint32_t y;
+    Stream *stream;
+    size_t block_sizes_offset;
+    unsigned char dict[4096];
+    size_t dict_pos;
+} Tlg5Encoder;
+
+// Blocks are stored raw unless compressing them makes them smaller, so this
+// is the exact size of the output with raw blocks and an upper bound
+// otherwise.
+static size_t tlg5_encoded_size(const Tlg5Header *header)
+{
+    const size_t block_count =
+        (header->image_height - 1) / header->block_height + 1;
+    const size_t block_size =
+        5 + (size_t)header->image_width * header->block_height;
+    return MAGIC_SIZE
+        + TLG5_HEADER_SIZE
+        + block_count * (4 + header->channel_count * block_size);
+}
+
+static void tlg5_encoder_destroy(Tlg5Encoder *encoder)
+{
+    assert(encoder);
+    for (int channel = 0; channel < 4; channel++)
+    {
+        if (encoder->block_info[channel])
+            tlg5_block_info_destroy(encoder->block_info[channel]);
+        encoder->block_info[channel] = NULL;
+    }
+    PyMem_RawFree(encoder->prev_line);
+    encoder->prev_line = NULL;
+    if (encoder->stream)
+        stream_destroy(encoder->stream);
+    encoder->stream = NULL;
+}
+
+// Sets up an encoder writing into output, which has to hold at least
+// tlg5_encoded_size() bytes.
+static int tlg5_encoder_init(
+    Tlg5Encoder *encoder,
     const Tlg5Header *header,
-    size_t block_y)
+    unsigned char *output,
+    const size_t output_size)
 {
-    size_t max_y = block_y + header->block_height;
-    if (max_y > header->image_height)
-        max_y = header->image_height;
+    assert(encoder);
+    assert(header);
+    assert(output);
+
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->header = *header;
+
+    encoder->stream = stream_create_for_data(output, output_size);
+    if (!encoder->stream)
+        goto fail;
+    if (!stream_write_data(encoder->stream, (unsigned char*)MAGIC, MAGIC_SIZE))
+        goto fail;
+    if (!tlg5_header_write(encoder->stream, &encoder->header))
+        goto fail;
+
+    // the block sizes are patched in as block rows are finished
+    encoder->block_sizes_offset = encoder->stream->pos;
+    const size_t block_count =
+        (header->image_height - 1) / header->block_height + 1;
+    for (size_t i = 0; i < block_count; i++)
+        if (!stream_write_u32_le(encoder->stream, 0))
+            goto fail;
 
-    for (size_t y = block_y; y < max_y; y++)
+    for (int channel = 0; channel < 4; channel++)
     {
-        size_t block_y_shift = (y - block_y) * header->image_width;
-        Pixel prev_pixel = {0, 0, 0, 0};
+        encoder->block_info[channel] = tlg5_block_info_create_for_data(
+            (size_t)header->image_width * header->block_height);
+        if (!encoder->block_info[channel])
+            goto fail;
+    }
 
-        for (size_t x = 0; x < header->image_width; x++)
-        {
-            const Pixel *source_pixel =
-                image_data + y * header->image_width + x;
-            if (source_pixel >= image_data + image_data_size/sizeof(Pixel))
-            {
-                PyErr_SetString(PyExc_ValueError, "Corrupt data");
-                return 0;
-            }
+    encoder->prev_line = PyMem_RawMalloc(header->image_width * sizeof(Pixel));
+    if (!encoder->prev_line)
+    {
+        error_set_no_memory();
+        goto fail;
+    }
+    STATS_ALLOCATION(header->image_width * sizeof(Pixel));
+    return 1;
 
-            Pixel pixel = *source_pixel;
+fail:
+    tlg5_encoder_destroy(encoder);
+    return 0;
+}
 
-            if (y > 0)
-            {
-                const Pixel *top_pixel = source_pixel - header->image_width;
-                pixel.r -= top_pixel->r;
-                pixel.g -= top_pixel->g;
-                pixel.b -= top_pixel->b;
-                pixel.a -= top_pixel->a;
-            }
+static int tlg5_encoder_flush(Tlg5Encoder *encoder)
+{
+    const Tlg5Header *header = &encoder->header;
+    const uint32_t block_y =
+        (encoder->y - 1) / header->block_height * header->block_height;
+
+    // raw blocks are always written whole, so clear the rows past the end of
+    // the image rather than leaking whatever the buffer held
+    const size_t used_size =
+        (size_t)(encoder->y - block_y) * header->image_width;
+    for (int channel = 0; channel < 4; channel++)
+    {
+        memset(
+            encoder->block_info[channel]->data + used_size,
+            0,
+            encoder->block_info[channel]->data_size - used_size);
+    }
 
-            pixel.r -= prev_pixel.r;
-            pixel.g -= prev_pixel.g;
-            pixel.b -= prev_pixel.b;
-            pixel.a -= prev_pixel.a;
-
-            prev_pixel.r += pixel.r;
-            prev_pixel.g += pixel.g;
-            prev_pixel.b += pixel.b;
-            prev_pixel.a += pixel.a;
-
-            pixel.b -= pixel.g;
-            pixel.r -= pixel.g;
-            block_data[0]->data[block_y_shift + x] = pixel.b;
-            block_data[1]->data[block_y_shift + x] = pixel.g;
-            block_data[2]->data[block_y_shift + x] = pixel.r;
-            block_data[3]->data[block_y_shift + x] = pixel.a;
+    Stream *stream = encoder->stream;
+    size_t old_pos = stream->pos;
+    for (int channel = 0; channel < header->channel_count; channel++)
+    {
+        if (!tlg5_block_info_write(
+            encoder->block_info[channel],
+            stream,
+            header,
+            encoder->dict,
+            &encoder->dict_pos))
+        {
+            return 0;
         }
     }
+    size_t collective_size = stream->pos - old_pos;
+
+    old_pos = stream->pos;
+    stream->pos =
+        encoder->block_sizes_offset + 4 * (block_y / header->block_height);
+    if (!stream_write_u32_le(stream, collective_size))
+        return 0;
+    stream->pos = old_pos;
     return 1;
 }
 
-static PyObject *tlg5_decode(PyObject *self, PyObject *args)
+// Encodes the next row_count rows of the image. Block rows are written out
+// as soon as they are complete, so rows can be fed in strips of any height.
+static int tlg5_encoder_write_rows(
+    Tlg5Encoder *encoder, const Pixel *rows, const size_t row_count)
 {
-    Stream *stream = NULL;
-    Pixel *image_data = NULL;
-    Py_buffer input = {0};
-    PyObject *output = NULL;
-    Tlg5Header header;
-    Tlg5BlockInfo *block_info[4] = {NULL, NULL, NULL, NULL};
+    const Tlg5Header *header = &encoder->header;
+    const size_t width = header->image_width;
 
-    if (!PyArg_ParseTuple(args, "y*", &input))
-        goto end;
+    if (row_count > header->image_height - encoder->y)
+    {
+        error_set(PyExc_ValueError, "Too many rows");
+        return 0;
+    }
+    if (header->channel_count == 3
+        && !format_is_opaque(rows, row_count * width))
+    {
+        error_set(PyExc_ValueError, "Image is not opaque");
+        return 0;
+    }
 
-    stream = stream_create_for_data(input.buf, input.len);
-    if (!stream)
-        goto end;
+    for (size_t i = 0; i < row_count; i++)
+    {
+        const Pixel *line = rows + i * width;
+        const Pixel *top_line =
+            i ? line - width : encoder->y ? encoder->prev_line : NULL;
+        const size_t block_y_shift =
+            (size_t)(encoder->y % header->block_height) * width;
+        unsigned char *planes[4];
+        for (int channel = 0; channel < 4; channel++)
+        {
+            planes[channel] =
+                encoder->block_info[channel]->data + block_y_shift;
+        }
+        STATS_BEGIN(start_clock);
+        tlg5_save_pixel_row(line, top_line, planes, width);
+        STATS_END(
+            STATS_TLG5_RESIDUALS, start_clock, width * sizeof(Pixel), width * 4);
+
+        encoder->y++;
+        if (encoder->y % header->block_height == 0
+            || encoder->y == header->image_height)
+        {
+            if (!tlg5_encoder_flush(encoder))
+                return 0;
+        }
+    }
 
-    if (memcmp(stream->data, MAGIC, MAGIC_SIZE))
+    if (row_count)
     {
-        PyErr_SetString(PyExc_ValueError, "Not a TLG5 image");
-        goto end;
+        memcpy(
+            encoder->prev_line,
+            rows + (row_count - 1) * width,
+            width * sizeof(Pixel));
     }
-    stream->pos += MAGIC_SIZE;
+    return 1;
+}
 
-    if (!tlg5_header_read(stream, &header))
-        goto end;
-    if (header.channel_count != 3 && header.channel_count != 4)
+// Checks that the whole image was written and tells the size of the output.
+static int tlg5_encoder_finish(Tlg5Encoder *encoder, size_t *output_size)
+{
+    if (encoder->y != encoder->header.image_height)
     {
-        PyErr_SetString(PyExc_ValueError, "Unsupported channel count");
-        goto end;
+        error_set(PyExc_ValueError, "Missing rows");
+        return 0;
     }
+    *output_size = encoder->stream->pos;
+    return 1;
+}
+
+static int tlg5_read_header_checked(Stream *stream, Tlg5Header *header)
+{
+    assert(stream);
+    assert(header);
 
-    const size_t image_data_size =
-        header.image_height * header.image_width * 4;
-    image_data = PyMem_RawMalloc(image_data_size);
-    if (!image_data)
+    if (stream->size < MAGIC_SIZE || memcmp(stream->data, MAGIC, MAGIC_SIZE))
     {
-        PyErr_SetNone(PyExc_MemoryError);
-        goto end;
+        error_set(PyExc_ValueError, "Not a TLG5 image");
+        return 0;
     }
+    stream->pos += MAGIC_SIZE;
 
-    // ignore block sizes
+    if (!tlg5_header_read(stream, header))
+        return 0;
+    if (header->channel_count != 3 && header->channel_count != 4)
+    {
+        error_set(PyExc_ValueError, "Unsupported channel count");
+        return 0;
+    }
+    if (!header->image_width || !header->image_height || !header->block_height)
+    {
+        error_set(PyExc_ValueError, "Corrupt data");
+        return 0;
+    }
+    return 1;
+}
+
+static int tlg5_read_size(
+    const unsigned char *data,
+    const size_t data_size,
+    uint32_t *image_width,
+    uint32_t *image_height)
+{
+    Tlg5Header header;
+    int ret = 0;
+
+    Stream *stream = stream_create_for_data((unsigned char*)data, data_size);
+    if (!stream)
+        goto end;
+    if (!tlg5_read_header_checked(stream, &header))
+        goto end;
+
+    *image_width = header.image_width;
+    *image_height = header.image_height;
+    ret = 1;
+end:
+    if (stream) stream_destroy(stream);
+    return ret;
+}
+
+static int tlg5_decode_image(
+    const unsigned char *data,
+    const size_t data_size,
+    Scratch *scratch,
+    RowSink *sink)
+{
+    Stream *stream = NULL;
+    Tlg5Header header;
+    Tlg5BlockInfo block_infos[4];
+    Tlg5BlockInfo *block_info[4] = {
+        &block_infos[0], &block_infos[1], &block_infos[2], &block_infos[3]};
+    unsigned char *block_buffers[4];
+    int ret = 0;
+
+    stream = stream_create_for_data((unsigned char*)data, data_size);
+    if (!stream)
+        goto end;
+
+    if (!tlg5_read_header_checked(stream, &header))
+        goto end;
+
+    // the block sizes aren't needed: even the blocks above a region have to
+    // be decompressed for the sake of the shared dictionary, and their rows
+    // reconstructed for the sake of the vertical predictor. Decoding can stop
+    // after the last block the sink needs though.
     size_t block_count = (header.image_height - 1) / header.block_height + 1;
-    stream->pos += 4 * block_count;
+    if (!stream_skip(stream, 4 * block_count))
+        goto end;
 
-    for (int channel = 0; channel < 4; channel++)
+    for (int channel = 0; channel < header.channel_count; channel++)
     {
-        block_info[channel] = tlg5_block_info_create_empty();
-        if (!block_info[channel])
+        block_buffers[channel] = scratch_get(
+            scratch,
+            SCRATCH_BLOCK_DATA + channel,
+            (size_t)header.image_width * header.block_height);
+        if (!block_buffers[channel])
             goto end;
     }
 
     unsigned char dict[4096] = {0};
     size_t dict_pos = 0;
+    Pixel *prev_line = NULL;
 
-    for (size_t y = 0; y < header.image_height; y += header.block_height)
+    for (uint32_t y = 0; y < sink->height; y += header.block_height)
     {
         for (int channel = 0; channel < header.channel_count; channel++)
         {
             if (!tlg5_block_info_read(
-                block_info[channel], stream, &header, dict, &dict_pos))
+                block_info[channel],
+                stream,
+                &header,
+                block_buffers[channel],
+                dict,
+                &dict_pos))
             {
                 goto end;
             }
         }
-        if (!tlg5_load_pixel_block_row(
-            image_data, image_data_size, block_info, &header, y))
-        {
-            goto end;
-        }
-    }
-    for (int channel = 0; channel < 4; channel++)
-    {
-        tlg5_block_info_destroy(block_info[channel]);
-        block_info[channel] = NULL;
+        tlg5_load_pixel_block_row(sink, block_info, &header, y, &prev_line);
     }
 
-    PyObject *output_image_width = PyLong_FromLong(header.image_width);
-    PyObject *output_image_height = PyLong_FromLong(header.image_height);
-    PyObject *output_image_data = PyBytes_FromStringAndSize(
-        (char*)image_data, image_data_size);
-    output = PyTuple_Pack(
-        3,
-        output_image_width,
-        output_image_height,
-        output_image_data);
-    Py_DECREF(output_image_width);
-    Py_DECREF(output_image_height);
-    Py_DECREF(output_image_data);
-
+    ret = 1;
 end:
-    for (int channel = 0; channel < 4; channel++)
-        if (block_info[channel])
-            tlg5_block_info_destroy(block_info[channel]);
-    if (image_data) PyMem_RawFree(image_data);
     if (stream) stream_destroy(stream);
-    PyBuffer_Release(&input);
-    return output;
+    return ret;
+}
+
+static const Codec tlg5_codec = {
+    &tlg5_read_size,
+    &tlg5_decode_image,
+};
+
+static PyObject *tlg5_decode(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_single(self, &tlg5_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg5_decode_region(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_region(self, &tlg5_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg5_decode_thumbnail(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_thumbnail(self, &tlg5_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg5_decode_many(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_many(self, &tlg5_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg5_decoder_new(
+    PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    return decoder_new(type, args, kwds, &tlg5_codec);
+}
+
+static int tlg5_encode_header_parse(
+    Tlg5Header *header,
+    const int image_width,
+    const int image_height,
+    const int channel_count)
+{
+    if (image_width <= 0 || image_height <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid image size");
+        return 0;
+    }
+    if (channel_count != 3 && channel_count != 4)
+    {
+        PyErr_SetString(PyExc_ValueError, "Unsupported channel count");
+        return 0;
+    }
+    header->channel_count = channel_count;
+    header->image_width = image_width;
+    header->image_height = image_height;
+    header->block_height = TLG5_BLOCK_HEIGHT;
+    return 1;
+}
+
+static PyObject *tlg5_encoded_size_get(PyObject *self, PyObject *args)
+{
+    int image_width;
+    int image_height;
+    int channel_count;
+    Tlg5Header header;
+    if (!PyArg_ParseTuple(
+            args, "iii", &image_width, &image_height, &channel_count))
+    {
+        return NULL;
+    }
+    if (!tlg5_encode_header_parse(
+            &header, image_width, image_height, channel_count))
+    {
+        return NULL;
+    }
+    return PyLong_FromSize_t(tlg5_encoded_size(&header));
 }
 
 static PyObject *tlg5_encode(PyObject *self, PyObject *args)
 {
-    Tlg5BlockInfo *block_info[4] = {NULL, NULL, NULL, NULL};
+    Tlg5Encoder encoder = {0};
     int input_image_width;
     int input_image_height;
     Py_buffer input_image_data = {0};
-    Stream *stream = NULL;
     PyObject *output = NULL;
+    int ok = 0;
 
     if (!PyArg_ParseTuple(
             args,
@@ -440,105 +764,339 @@ static PyObject *tlg5_encode(PyObject *self, PyObject *args)
         goto end;
     }
 
-    stream = stream_create_empty();
-    if (!stream)
+    // the decoder fills in an opaque alpha by itself when there are only
+    // three channels, so opaque images don't need to store it
+    const int channel_count = format_is_opaque(
+        input_image_data.buf, input_image_data.len / sizeof(Pixel)) ? 3 : 4;
+    Tlg5Header header;
+    if (!tlg5_encode_header_parse(
+            &header, input_image_width, input_image_height, channel_count))
+    {
         goto end;
+    }
 
-    if (!stream_write_data(stream, (unsigned char*)MAGIC, MAGIC_SIZE))
+    output = PyBytes_FromStringAndSize(NULL, tlg5_encoded_size(&header));
+    if (!output)
         goto end;
 
-    Tlg5Header header;
-    header.channel_count = 4;
-    header.image_width = input_image_width;
-    header.image_height = input_image_height;
-    header.block_height = 16;
-    if (!tlg5_header_write(stream, &header))
+    size_t output_size;
+    if (!tlg5_encoder_init(
+            &encoder,
+            &header,
+            (unsigned char*)PyBytes_AS_STRING(output),
+            PyBytes_GET_SIZE(output)))
+    {
+        goto end;
+    }
+    if (!tlg5_encoder_write_rows(
+            &encoder, input_image_data.buf, header.image_height))
+    {
+        goto end;
+    }
+    if (!tlg5_encoder_finish(&encoder, &output_size))
+        goto end;
+    if (_PyBytes_Resize(&output, output_size) < 0)
         goto end;
+    ok = 1;
 
-    size_t block_sizes_offset = stream->pos;
-    size_t block_count = (header.image_height - 1) / header.block_height + 1;
-    for (size_t i = 0; i < block_count; i++)
-        if (!stream_write_u32_le(stream, 0))
-            goto end;
+end:
+    tlg5_encoder_destroy(&encoder);
+    PyBuffer_Release(&input_image_data);
+    if (!ok)
+    {
+        Py_CLEAR(output);
+        if (!PyErr_Occurred())
+            error_raise_pending();
+    }
+    return output;
+}
 
-    for (int channel = 0; channel < 4; channel++)
+typedef struct
+{
+    PyObject_HEAD
+    Tlg5Encoder encoder;
+    // either a bytes object the encoder owns, or a buffer supplied by the
+    // caller
+    PyObject *output;
+    Py_buffer sink;
+    int finished;
+    // without a GIL, nothing else keeps two threads from writing at once
+    PyThread_type_lock lock;
+} Tlg5EncoderObject;
+
+static PyObject *tlg5_encoder_object_new(
+    PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *keywords[] = {
+        "width", "height", "channel_count", "sink", NULL};
+    int image_width;
+    int image_height;
+    int channel_count;
+    PyObject *sink = Py_None;
+    Tlg5Header header;
+
+    if (!PyArg_ParseTupleAndKeywords(
+            args,
+            kwds,
+            "iii|O",
+            keywords,
+            &image_width,
+            &image_height,
+            &channel_count,
+            &sink))
     {
-        block_info[channel] = tlg5_block_info_create_for_data(
-            header.image_width * header.block_height);
-        if (!block_info[channel])
-            goto end;
+        return NULL;
+    }
+    if (!tlg5_encode_header_parse(
+            &header, image_width, image_height, channel_count))
+    {
+        return NULL;
     }
 
-    unsigned char dict[4096] = {0};
-    size_t dict_pos = 0;
+    Tlg5EncoderObject *self = (Tlg5EncoderObject*)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock)
+    {
+        PyErr_SetNone(PyExc_MemoryError);
+        goto fail;
+    }
 
-    for (size_t y = 0; y < header.image_height; y += header.block_height)
+    const size_t output_size = tlg5_encoded_size(&header);
+    unsigned char *output;
+    if (sink == Py_None)
     {
-        size_t old_pos = stream->pos;
-        for (int channel = 0; channel < header.channel_count; channel++)
+        self->output = PyBytes_FromStringAndSize(NULL, output_size);
+        if (!self->output)
+            goto fail;
+        output = (unsigned char*)PyBytes_AS_STRING(self->output);
+    }
+    else
+    {
+        if (PyObject_GetBuffer(sink, &self->sink, PyBUF_WRITABLE) < 0)
+            goto fail;
+        if ((size_t)self->sink.len != output_size)
         {
-            if (!tlg5_save_pixel_block_row(
-                input_image_data.buf,
-                input_image_data.len,
-                block_info,
-                &header,
-                y))
-            {
-                goto end;
-            }
-
-            if (!tlg5_block_info_write(
-                block_info[channel],
-                stream,
-                &header,
-                dict,
-                &dict_pos))
-            {
-                goto end;
-            }
+            PyErr_Format(
+                PyExc_ValueError, "Sink must hold %zu bytes", output_size);
+            goto fail;
         }
-        size_t collective_size = stream->pos - old_pos;
-
-        old_pos = stream->pos;
-        stream->pos = block_sizes_offset + 4 * y / header.block_height;
-        if (!stream_write_u32_le(stream, collective_size))
-            goto end;
-        stream->pos = old_pos;
+        output = self->sink.buf;
     }
-    for (int channel = 0; channel < 4; channel++)
+
+    if (!tlg5_encoder_init(&self->encoder, &header, output, output_size))
     {
-        tlg5_block_info_destroy(block_info[channel]);
-        block_info[channel] = NULL;
+        error_raise_pending();
+        goto fail;
     }
+    return (PyObject*)self;
+
+fail:
+    Py_DECREF(self);
+    return NULL;
+}
 
-    output = PyBytes_FromStringAndSize(
-        (char*)stream->data, stream->size);
+static void tlg5_encoder_object_dealloc(Tlg5EncoderObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+    tlg5_encoder_destroy(&self->encoder);
+    Py_XDECREF(self->output);
+    PyBuffer_Release(&self->sink);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject *tlg5_encoder_object_write(
+    Tlg5EncoderObject *self, PyObject *args)
+{
+    Py_buffer rows = {0};
+    PyObject *ret = NULL;
+    if (!PyArg_ParseTuple(args, "y*", &rows))
+        return NULL;
+
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    const size_t row_size = self->encoder.header.image_width * sizeof(Pixel);
+    if (self->finished)
+    {
+        PyErr_SetString(PyExc_ValueError, "Encoder is finished");
+        goto end;
+    }
+    if ((size_t)rows.len % row_size)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid data size");
+        goto end;
+    }
+    if (!tlg5_encoder_write_rows(
+            &self->encoder, rows.buf, rows.len / row_size))
+    {
+        error_raise_pending();
+        goto end;
+    }
+    ret = Py_None;
+    Py_INCREF(ret);
 
 end:
-    for (int channel = 0; channel < 4; channel++)
-        if (block_info[channel])
-            tlg5_block_info_destroy(block_info[channel]);
-    if (stream)
-        stream_destroy(stream);
-    PyBuffer_Release(&input_image_data);
+    PyThread_release_lock(self->lock);
+    PyBuffer_Release(&rows);
+    return ret;
+}
+
+static PyObject *tlg5_encoder_object_finish(
+    Tlg5EncoderObject *self, PyObject *Py_UNUSED(args))
+{
+    size_t output_size;
+    PyThread_acquire_lock(self->lock, WAIT_LOCK);
+    if (self->finished)
+    {
+        PyThread_release_lock(self->lock);
+        PyErr_SetString(PyExc_ValueError, "Encoder is finished");
+        return NULL;
+    }
+    if (!tlg5_encoder_finish(&self->encoder, &output_size))
+    {
+        PyThread_release_lock(self->lock);
+        return error_raise_pending();
+    }
+    self->finished = 1;
+    tlg5_encoder_destroy(&self->encoder);
+    PyObject *output = self->output;
+    self->output = NULL;
+    PyThread_release_lock(self->lock);
+
+    // a caller-supplied sink is sized for raw blocks, so tell how much of
+    // it was actually used rather than let it assume the whole of it
+    if (!output)
+        return PyLong_FromSize_t(output_size);
+    if (_PyBytes_Resize(&output, output_size) < 0)
+        return NULL;
     return output;
 }
 
+static PyMethodDef tlg5_encoder_methods[] = {
+    {
+        "write",
+        (PyCFunction)tlg5_encoder_object_write,
+        METH_VARARGS,
+        "Encode the next rows of the image, given as RGBA data"
+    },
+    {
+        "finish",
+        (PyCFunction)tlg5_encoder_object_finish,
+        METH_NOARGS,
+        "Finish the image; returns it, or the number of bytes written when it "
+        "went to a sink"
+    },
+    {NULL, NULL, 0, NULL}
+};
+
+static PyObject *tlg5_encoder_type_create(void)
+{
+    PyType_Slot slots[] = {
+        {Py_tp_new, tlg5_encoder_object_new},
+        {Py_tp_dealloc, tlg5_encoder_object_dealloc},
+        {Py_tp_methods, tlg5_encoder_methods},
+        {0, NULL},
+    };
+    PyType_Spec spec = {
+        "lib.tlg.tlg5.Encoder",
+        sizeof(Tlg5EncoderObject),
+        0,
+        Py_TPFLAGS_DEFAULT,
+        slots,
+    };
+    return PyType_FromSpec(&spec);
+}
+
 static PyMethodDef Methods[] = {
-    {"decode_tlg_5", tlg5_decode, METH_VARARGS, "Decode a tlg5 image"},
+    {
+        "decode_tlg_5",
+        (PyCFunction)(void(*)(void))tlg5_decode,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a tlg5 image"
+    },
+    {
+        "decode_tlg_5_many",
+        (PyCFunction)(void(*)(void))tlg5_decode_many,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a sequence of tlg5 images in parallel"
+    },
+    {
+        "decode_tlg_5_region",
+        (PyCFunction)(void(*)(void))tlg5_decode_region,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode part of a tlg5 image, given as (data, x, y, width, height)"
+    },
+    {
+        "decode_tlg_5_thumbnail",
+        (PyCFunction)(void(*)(void))tlg5_decode_thumbnail,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a tlg5 image shrunk by a factor of 2, 4 or 8"
+    },
     {"encode_tlg_5", tlg5_encode, METH_VARARGS, "Encode a tlg5 image"},
+    {
+        "encoded_size",
+        tlg5_encoded_size_get,
+        METH_VARARGS,
+        "Size of the sink an Encoder needs, given (width, height, channels)"
+    },
+    STATS_METHODS,
+    KERNELS_METHODS,
     {NULL, NULL, 0, NULL}
 };
 
+static int tlg5_exec(PyObject *module)
+{
+    kernels_init();
+    PyObject *magic = PyBytes_FromStringAndSize(MAGIC, MAGIC_SIZE);
+    if (!magic || PyModule_AddObject(module, "MAGIC", magic))
+    {
+        Py_XDECREF(magic);
+        return -1;
+    }
+    if (!decode_module_init(module))
+        return -1;
+    PyObject *decoder_type = decoder_type_create(
+        module, "lib.tlg.tlg5.Decoder", tlg5_decoder_new);
+    if (!decoder_type || PyModule_AddObject(module, "Decoder", decoder_type))
+    {
+        Py_XDECREF(decoder_type);
+        return -1;
+    }
+    PyObject *encoder_type = tlg5_encoder_type_create();
+    if (!encoder_type || PyModule_AddObject(module, "Encoder", encoder_type))
+    {
+        Py_XDECREF(encoder_type);
+        return -1;
+    }
+    PyObject *hasher_type = hasher_type_create("lib.tlg.tlg5.Hasher");
+    if (!hasher_type || PyModule_AddObject(module, "Hasher", hasher_type))
+    {
+        Py_XDECREF(hasher_type);
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, tlg5_exec},
+    MODULE_SLOTS
+};
+
 static struct PyModuleDef module_definition = {
-   PyModuleDef_HEAD_INIT, "lib.tlg.tlg5", NULL, -1, Methods,
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib.tlg.tlg5",
+    .m_size = sizeof(DecodeState),
+    .m_methods = Methods,
+    .m_slots = module_slots,
+    .m_traverse = decode_module_traverse,
+    .m_clear = decode_module_clear,
+    .m_free = decode_module_free,
 };
 
 PyMODINIT_FUNC PyInit_tlg5(void)
 {
-    PyObject *magic_key = Py_BuildValue("s", "MAGIC");
-    PyObject *magic_value = Py_BuildValue("y#", MAGIC, MAGIC_SIZE);
-    PyObject *module = PyModule_Create(&module_definition);
-    PyObject_SetAttr(module, magic_key, magic_value);
-    return module;
+    return PyModuleDef_Init(&module_definition);
 }
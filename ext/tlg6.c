@@ -1,20 +1,29 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <string.h>
+#include "decode.h"
+#include "error.h"
 #include "stream.h"
+#include "golomb.h"
+#include "kernels.h"
+#include "module.h"
 #include "lzss.h"
 #include "pixel.h"
+#include "scratch.h"
+#include "stats.h"
+#include "tables.h"
 
 #define MAGIC "TLG6.0\x00raw\x1A"
 #define MAGIC_SIZE 11
 
 #define W_BLOCK_SIZE 8
 #define H_BLOCK_SIZE 8
-#define GOLOMB_N_COUNT 4
-#define LEADING_ZERO_TABLE_BITS 12
-#define LEADING_ZERO_TABLE_SIZE (1 << LEADING_ZERO_TABLE_BITS)
 
-static uint8_t leading_zero_table[LEADING_ZERO_TABLE_SIZE];
-static uint8_t golomb_bit_size_table[GOLOMB_N_COUNT * 2 * 128][GOLOMB_N_COUNT];
+#define SCRATCH_FILTER_TYPES 0
+#define SCRATCH_BLOCK_DATA 1
+#define SCRATCH_ZERO_LINE 2
+#define SCRATCH_BIT_POOL 3
+#define SCRATCH_PLANES 4
 
 typedef struct
 {
@@ -40,113 +49,42 @@ static inline uint32_t tlg6_pixel_to_bgra(const Pixel *p)
     return p->b | (p->g << 8) | (p->r << 16) | (p->a << 24);
 }
 
-static void tlg6_transformer0(Pixel *p)
-{
-}
-
-static void tlg6_transformer1(Pixel *p)
-{
-    p->r += p->g;
-    p->b += p->g;
-}
-
-static void tlg6_transformer2(Pixel *p)
-{
-    p->g += p->b;
-    p->r += p->g;
-}
-
-static void tlg6_transformer3(Pixel *p)
-{
-    p->g += p->r;
-    p->b += p->g;
-}
-
-static void tlg6_transformer4(Pixel *p)
-{
-    p->b += p->r;
-    p->g += p->b;
-    p->r += p->g;
-}
-
-static void tlg6_transformer5(Pixel *p)
-{
-    p->b += p->r;
-    p->g += p->b;
-}
-
-static void tlg6_transformer6(Pixel *p)
-{
-    p->b += p->g;
-}
-
-static void tlg6_transformer7(Pixel *p)
-{
-    p->g += p->b;
-}
-
-static void tlg6_transformer8(Pixel *p)
-{
-    p->r += p->g;
-}
-
-static void tlg6_transformer9(Pixel *p)
-{
-    p->r += p->b;
-    p->g += p->r;
-    p->b += p->g;
-}
-
-static void tlg6_transformerA(Pixel *p)
-{
-    p->b += p->r;
-    p->g += p->r;
-}
-
-static void tlg6_transformerB(Pixel *p)
-{
-    p->r += p->b;
-    p->g += p->b;
-}
-
-static void tlg6_transformerC(Pixel *p)
-{
-    p->r += p->b;
-    p->g += p->r;
-}
-
-static void tlg6_transformerD(Pixel *p)
-{
-    p->b += p->g;
-    p->r += p->b;
-    p->g += p->r;
-}
-
-static void tlg6_transformerE(Pixel *p)
-{
-    p->g += p->r;
-    p->b += p->g;
-    p->r += p->b;
-}
-
-static void tlg6_transformerF(Pixel *p)
-{
-    p->g += p->b << 1;
-    p->r += p->b << 1;
-}
+// Each colour transform adds some channels to others, in order. The Golomb
+// output keeps pixels as BGRA words, so channels are named by their byte.
+#define CHANNEL_B 0
+#define CHANNEL_G 1
+#define CHANNEL_R 2
 
-static void (*tlg6_transformers[16])(Pixel *p) =
+typedef struct
 {
-    &tlg6_transformer0, &tlg6_transformer1,
-    &tlg6_transformer2, &tlg6_transformer3,
-    &tlg6_transformer4, &tlg6_transformer5,
-    &tlg6_transformer6, &tlg6_transformer7,
-    &tlg6_transformer8, &tlg6_transformer9,
-    &tlg6_transformerA, &tlg6_transformerB,
-    &tlg6_transformerC, &tlg6_transformerD,
-    &tlg6_transformerE, &tlg6_transformerF,
+    int step_count;
+    Tlg6TransformStep steps[3];
+} Tlg6Transform;
+
+#define STEP(target, source) {CHANNEL_##target, CHANNEL_##source, 1}
+
+static const Tlg6Transform tlg6_transforms[16] =
+{
+    {0, {{0, 0, 0}}},
+    {2, {STEP(R, G), STEP(B, G)}},
+    {2, {STEP(G, B), STEP(R, G)}},
+    {2, {STEP(G, R), STEP(B, G)}},
+    {3, {STEP(B, R), STEP(G, B), STEP(R, G)}},
+    {2, {STEP(B, R), STEP(G, B)}},
+    {1, {STEP(B, G)}},
+    {1, {STEP(G, B)}},
+    {1, {STEP(R, G)}},
+    {3, {STEP(R, B), STEP(G, R), STEP(B, G)}},
+    {2, {STEP(B, R), STEP(G, R)}},
+    {2, {STEP(R, B), STEP(G, B)}},
+    {2, {STEP(R, B), STEP(G, R)}},
+    {3, {STEP(B, G), STEP(R, B), STEP(G, R)}},
+    {3, {STEP(G, R), STEP(B, G), STEP(R, B)}},
+    {2, {{CHANNEL_G, CHANNEL_B, 2}, {CHANNEL_R, CHANNEL_B, 2}}},
 };
 
+#undef STEP
+
 static inline uint32_t make_gt_mask(const uint32_t a, const uint32_t b)
 {
     const uint32_t tmp2 = ~b;
@@ -183,90 +121,39 @@ static inline uint32_t tlg6_filter_avg(
         + ((a ^ b) & 0x01010101), v);
 }
 
-static uint32_t (*tlg6_filters[2])(
+static uint32_t (*const tlg6_filters[2])(
     const uint32_t, const uint32_t, const uint32_t, const uint32_t) =
 {
     &tlg6_filter_med,
     &tlg6_filter_avg,
 };
 
-static void tlg6_init_tables(void)
-{
-    short golomb_compression_table[GOLOMB_N_COUNT][9] =
-    {
-        {3, 7, 15, 27, 63, 108, 223, 448, 130},
-        {3, 5, 13, 24, 51, 95, 192, 384, 257},
-        {2, 5, 12, 21, 39, 86, 155, 320, 384},
-        {2, 3, 9, 18, 33, 61, 129, 258, 511},
-    };
-
-    for (int i = 0; i < LEADING_ZERO_TABLE_SIZE; i++)
-    {
-        int cnt = 0;
-        int j = 1;
-
-        while (j != LEADING_ZERO_TABLE_SIZE && !(i & j))
-        {
-            j <<= 1;
-            cnt++;
-        }
-
-        cnt++;
-
-        if (j == LEADING_ZERO_TABLE_SIZE)
-            cnt = 0;
-
-        leading_zero_table[i] = cnt;
-    }
-
-    for (int n = 0; n < GOLOMB_N_COUNT; n++)
-    {
-        int a = 0;
-        for (int i = 0; i < 9; i++)
-        {
-            for (int j = 0; j < golomb_compression_table[n][i]; j++)
-                golomb_bit_size_table[a++][n] = i;
-        }
-    }
-}
-
-static Tlg6FilterTypes *tlg6_ft_create(void)
-{
-    Tlg6FilterTypes *ft = PyMem_RawMalloc(sizeof(Tlg6FilterTypes));
-    if (!ft)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
-        return NULL;
-    }
-    ft->data = NULL;
-    ft->data_size = 0;
-    return ft;
-}
-
 static int tlg6_ft_read(
-    Tlg6FilterTypes *ft, Stream *stream, const Tlg6Header *header)
+    Tlg6FilterTypes *ft,
+    Stream *stream,
+    const Tlg6Header *header,
+    Scratch *scratch)
 {
     assert(ft);
     assert(stream);
     assert(header);
-    unsigned char *data_comp = NULL;
-    int ret = 0;
+    assert(scratch);
 
     const size_t data_orig_size =
         header->x_block_count * header->y_block_count;
 
     uint32_t data_comp_size = 0;
     if (!stream_read_u32_le(stream, &data_comp_size))
-        goto end;
+        return 0;
 
-    data_comp = PyMem_RawMalloc(data_comp_size);
-    if (!data_comp)
-    {
-        PyErr_SetString(PyExc_ValueError, "Reading beyond EOF");
-        goto end;
-    }
-    if (!stream_read_data(stream, data_comp, data_comp_size))
-        goto end;
+    unsigned char *data_comp = NULL;
+    if (!stream_read_view(stream, &data_comp, data_comp_size))
+        return 0;
+
+    unsigned char *data_orig = scratch_get(
+        scratch, SCRATCH_FILTER_TYPES, data_orig_size);
+    if (!data_orig)
+        return 0;
 
     unsigned char dict[4096] = {0};
     unsigned char *dict_ptr = dict;
@@ -280,27 +167,12 @@ static int tlg6_ft_read(
     }
     size_t dict_pos = 0;
 
-    unsigned char *data_orig = lzss_decompress(
-        data_comp, data_comp_size, data_orig_size, dict, &dict_pos);
-
-    if (!data_orig)
-        goto end;
+    lzss_decompress(
+        data_comp, data_comp_size, data_orig, data_orig_size, dict, &dict_pos);
 
     ft->data = data_orig;
     ft->data_size = data_orig_size;
-    ret = 1;
-end:
-    if (data_comp)
-        PyMem_RawFree(data_comp);
-    return ret;
-}
-
-static void tlg6_ft_destroy(Tlg6FilterTypes *ft)
-{
-    assert(ft);
-    if (ft->data)
-        PyMem_RawFree(ft->data);
-    PyMem_RawFree(ft);
+    return 1;
 }
 
 static int tlg6_header_read(Stream *stream, Tlg6Header *header)
@@ -319,10 +191,11 @@ static int tlg6_header_read(Stream *stream, Tlg6Header *header)
     return 1;
 }
 
+// Decodes one channel of a band into its own contiguous plane.
 static void tlg6_decode_golomb_values(
-    uint8_t *block_data, const int pixel_count, uint8_t *bit_pool)
+    uint8_t *plane, const int pixel_count, uint8_t *bit_pool)
 {
-    assert(block_data);
+    assert(plane);
     assert(bit_pool);
 
     int n = GOLOMB_N_COUNT - 1;
@@ -330,23 +203,25 @@ static void tlg6_decode_golomb_values(
 
     int bit_pos = 1;
     uint8_t zero = (*bit_pool & 1) ? 0 : 1;
-    uint8_t *limit = block_data + pixel_count * 4;
+    uint8_t *limit = plane + pixel_count;
 
-    while (block_data < limit)
+    while (plane < limit)
     {
         int count;
         {
             uint32_t t = *((uint32_t*)bit_pool) >> bit_pos;
-            int b = leading_zero_table[t & (LEADING_ZERO_TABLE_SIZE - 1)];
+            int b = tlg6_leading_zero_table[
+                t & (TLG6_LEADING_ZERO_TABLE_SIZE - 1)];
             int bit_count = b;
             while (!b)
             {
-                bit_count += LEADING_ZERO_TABLE_BITS;
-                bit_pos += LEADING_ZERO_TABLE_BITS;
+                bit_count += TLG6_LEADING_ZERO_TABLE_BITS;
+                bit_pos += TLG6_LEADING_ZERO_TABLE_BITS;
                 bit_pool += bit_pos >> 3;
                 bit_pos &= 7;
                 t = *((uint32_t*)bit_pool) >> bit_pos;
-                b = leading_zero_table[t & (LEADING_ZERO_TABLE_SIZE - 1)];
+                b = tlg6_leading_zero_table[
+                    t & (TLG6_LEADING_ZERO_TABLE_SIZE - 1)];
                 bit_count += b;
             }
 
@@ -366,12 +241,10 @@ static void tlg6_decode_golomb_values(
 
         if (zero)
         {
-            do
-            {
-                *block_data = 0;
-                block_data += 4;
-            }
-            while (--count && block_data < limit);
+            if (count > limit - plane)
+                count = limit - plane;
+            memset(plane, 0, count);
+            plane += count;
         }
         else
         {
@@ -383,18 +256,18 @@ static void tlg6_decode_golomb_values(
                 uint32_t t = *((uint32_t*)bit_pool) >> bit_pos;
                 if (t)
                 {
-                    b = leading_zero_table[
-                        t & (LEADING_ZERO_TABLE_SIZE - 1)];
+                    b = tlg6_leading_zero_table[
+                        t & (TLG6_LEADING_ZERO_TABLE_SIZE - 1)];
                     bit_count = b;
                     while (!b)
                     {
-                        bit_count += LEADING_ZERO_TABLE_BITS;
-                        bit_pos += LEADING_ZERO_TABLE_BITS;
+                        bit_count += TLG6_LEADING_ZERO_TABLE_BITS;
+                        bit_pos += TLG6_LEADING_ZERO_TABLE_BITS;
                         bit_pool += bit_pos >> 3;
                         bit_pos &= 7;
                         t = *((uint32_t*)bit_pool) >> bit_pos;
-                        b = leading_zero_table[
-                            t & (LEADING_ZERO_TABLE_SIZE - 1)];
+                        b = tlg6_leading_zero_table[
+                            t & (TLG6_LEADING_ZERO_TABLE_SIZE - 1)];
                         bit_count += b;
                     }
                     bit_count--;
@@ -408,7 +281,7 @@ static void tlg6_decode_golomb_values(
                     b = 0;
                 }
 
-                if (a >= GOLOMB_N_COUNT * 2 * 128) a = 0;
+                if (a >= GOLOMB_A_COUNT) a = 0;
                 if (n >= GOLOMB_N_COUNT) n = 0;
 
                 int k = golomb_bit_size_table[a][n];
@@ -417,8 +290,7 @@ static void tlg6_decode_golomb_values(
                 v >>= 1;
                 a += v;
 
-                *((uint8_t*)block_data) = ((v ^ sign) + sign + 1);
-                block_data += 4;
+                *plane++ = ((v ^ sign) + sign + 1);
 
                 bit_pos += b;
                 bit_pos += k;
@@ -431,7 +303,7 @@ static void tlg6_decode_golomb_values(
                     n = GOLOMB_N_COUNT - 1;
                 }
             }
-            while (--count && block_data < limit);
+            while (--count && plane < limit);
         }
 
         zero ^= 1;
@@ -495,23 +367,15 @@ static void tlg6_decode_line(
                 const uint32_t,
                 const uint32_t) =
             tlg6_filters[filter_types[i] & 1];
-        void (*transformer)(Pixel *) = tlg6_transformers[filter_types[i] >> 1];
 
         do
         {
-            Pixel inn;
-            inn.a = *in >> 24;
-            inn.r = *in >> 16;
-            inn.g = *in >> 8;
-            inn.b = *in;
-            transformer(&inn);
-
             Pixel top = *prev_line;
             uint32_t result = filter(
                 tlg6_pixel_to_bgra(&left),
                 tlg6_pixel_to_bgra(&top),
                 tlg6_pixel_to_bgra(&top_left),
-                tlg6_pixel_to_bgra(&inn));
+                *in);
             left.a = result >> 24;
             left.r = result >> 16;
             left.g = result >> 8;
@@ -533,72 +397,104 @@ static void tlg6_decode_line(
     }
 }
 
-static PyObject *tlg6_decode(PyObject *self, PyObject *args)
+static int tlg6_read_header_checked(Stream *stream, Tlg6Header *header)
 {
-    Stream *stream = NULL;
-    Tlg6FilterTypes *ft = NULL;
-    Pixel *block_data = NULL;
-    Pixel *zero_line = NULL;
-    Pixel *prev_line = NULL;
-    Pixel *image_data = NULL;
-    Py_buffer input = {0};
-    PyObject *output = NULL;
-    Tlg6Header header;
-
-    if (!PyArg_ParseTuple(args, "y*", &input))
-        goto end;
-
-    stream = stream_create_for_data(input.buf, input.len);
-    if (!stream)
-        goto end;
+    assert(stream);
+    assert(header);
 
-    if (memcmp(stream->data, MAGIC, MAGIC_SIZE))
+    if (stream->size < MAGIC_SIZE || memcmp(stream->data, MAGIC, MAGIC_SIZE))
     {
-        PyErr_SetString(PyExc_ValueError, "Not a TLG6 image");
-        goto end;
+        error_set(PyExc_ValueError, "Not a TLG6 image");
+        return 0;
     }
     stream->pos += MAGIC_SIZE;
 
-    if (!tlg6_header_read(stream, &header))
-        goto end;
-    if (header.channel_count != 3 && header.channel_count != 4)
+    if (!tlg6_header_read(stream, header))
+        return 0;
+    if (header->channel_count != 3 && header->channel_count != 4)
     {
-        PyErr_SetString(PyExc_ValueError, "Unsupported channel count");
-        goto end;
+        error_set(PyExc_ValueError, "Unsupported channel count");
+        return 0;
     }
+    if (!header->image_width || !header->image_height)
+    {
+        error_set(PyExc_ValueError, "Corrupt data");
+        return 0;
+    }
+    return 1;
+}
 
-    ft = tlg6_ft_create();
-    if (!ft)
+static int tlg6_read_size(
+    const unsigned char *data,
+    const size_t data_size,
+    uint32_t *image_width,
+    uint32_t *image_height)
+{
+    Tlg6Header header;
+    int ret = 0;
+
+    Stream *stream = stream_create_for_data((unsigned char*)data, data_size);
+    if (!stream)
         goto end;
-    if (!tlg6_ft_read(ft, stream, &header))
+    if (!tlg6_read_header_checked(stream, &header))
         goto end;
 
-    const size_t image_data_size =
-        header.image_height * header.image_width * 4;
-    image_data = PyMem_RawMalloc(image_data_size);
-    if (!image_data)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
+    *image_width = header.image_width;
+    *image_height = header.image_height;
+    ret = 1;
+end:
+    if (stream) stream_destroy(stream);
+    return ret;
+}
+
+static int tlg6_decode_image(
+    const unsigned char *data,
+    const size_t data_size,
+    Scratch *scratch,
+    RowSink *sink)
+{
+    Stream *stream = NULL;
+    Tlg6FilterTypes ft;
+    Pixel *block_data = NULL;
+    uint8_t *planes = NULL;
+    Pixel *zero_line = NULL;
+    Pixel *prev_line = NULL;
+    Tlg6Header header;
+    const Kernels *kernels = kernels_get();
+    int ret = 0;
+
+    stream = stream_create_for_data((unsigned char*)data, data_size);
+    if (!stream)
+        goto end;
+
+    if (!tlg6_read_header_checked(stream, &header))
+        goto end;
+
+    if (!tlg6_ft_read(&ft, stream, &header, scratch))
         goto end;
-    }
 
-    block_data = PyMem_RawMalloc(4 * header.image_width * H_BLOCK_SIZE);
+    block_data = (Pixel*)scratch_get(
+        scratch, SCRATCH_BLOCK_DATA, 4 * header.image_width * H_BLOCK_SIZE);
     if (!block_data)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
         goto end;
-    }
-    zero_line = PyMem_RawMalloc(4 * header.image_width);
+    planes = scratch_get(
+        scratch, SCRATCH_PLANES, 4 * header.image_width * H_BLOCK_SIZE);
+    if (!planes)
+        goto end;
+    zero_line = (Pixel*)scratch_get(
+        scratch, SCRATCH_ZERO_LINE, 4 * header.image_width);
     if (!zero_line)
-    {
-        PyErr_SetNone(PyExc_MemoryError);
         goto end;
-    }
     memset(zero_line, 0, 4 * header.image_width);
     prev_line = zero_line;
 
+    // every band up to the last one the sink needs has to be decoded in
+    // full, but the blocks right of the sink's width can be left out
     uint32_t main_count = header.image_width / W_BLOCK_SIZE;
-    for (size_t y = 0; y < header.image_height; y += H_BLOCK_SIZE)
+    const uint32_t block_limit = (sink->width - 1) / W_BLOCK_SIZE + 1;
+    if (main_count > block_limit)
+        main_count = block_limit;
+    for (size_t y = 0; y < sink->height; y += H_BLOCK_SIZE)
     {
         size_t ylim = y + H_BLOCK_SIZE;
         if (ylim >= header.image_height)
@@ -614,7 +510,7 @@ static PyObject *tlg6_decode(PyObject *self, PyObject *args)
             int method = (bit_size >> 30) & 3;
             if (method != 0)
             {
-                PyErr_SetString(
+                error_set(
                     PyExc_NotImplementedError, "Unsupported encoding method");
                 goto end;
             }
@@ -624,31 +520,57 @@ static PyObject *tlg6_decode(PyObject *self, PyObject *args)
             // Although decode_golomb_values accesses only valid bits, it casts
             // to uint32_t* which might access bits out of bounds. This is to
             // make sure those calls don't cause access violations.
-            unsigned char *bit_pool = PyMem_RawMalloc(byte_size + 4);
+            unsigned char *bit_pool = scratch_get(
+                scratch, SCRATCH_BIT_POOL, byte_size + 4);
             if (!bit_pool)
-            {
-                PyErr_SetNone(PyExc_MemoryError);
                 goto end;
-            }
             if (!stream_read_data(stream, bit_pool, byte_size))
-            {
-                PyMem_RawFree(bit_pool);
                 goto end;
-            }
+            memset(bit_pool + byte_size, 0, 4);
 
+            STATS_BEGIN(start_clock);
             tlg6_decode_golomb_values(
-                ((uint8_t*)block_data) + c, pixel_count, bit_pool);
-
-            PyMem_RawFree(bit_pool);
+                planes + c * pixel_count, pixel_count, bit_pool);
+            STATS_END(STATS_TLG6_GOLOMB, start_clock, byte_size, pixel_count);
         }
+        if (header.channel_count == 3)
+            memset(planes + 3 * pixel_count, 0xFF, pixel_count);
+        STATS_BEGIN(interleave_clock);
+        kernels->tlg6_interleave((uint32_t*)block_data, planes, pixel_count);
+        STATS_END(
+            STATS_TLG6_INTERLEAVE,
+            interleave_clock,
+            4 * pixel_count,
+            4 * pixel_count);
 
         uint8_t *ft_data =
-            ft->data + (y / H_BLOCK_SIZE) * header.x_block_count;
+            ft.data + (y / H_BLOCK_SIZE) * header.x_block_count;
         int skip_bytes = (ylim - y) * W_BLOCK_SIZE;
 
-        for (size_t yy = y; yy < ylim; yy++)
+        STATS_BEGIN(transform_clock);
+        for (uint32_t i = 0; i < block_limit; i++)
+        {
+            size_t w = header.image_width - i * W_BLOCK_SIZE;
+            if (w > W_BLOCK_SIZE)
+                w = W_BLOCK_SIZE;
+            const Tlg6Transform *transform = &tlg6_transforms[ft_data[i] >> 1];
+            kernels->tlg6_transform(
+                ((uint32_t*)block_data) + i * skip_bytes,
+                w * (ylim - y),
+                transform->steps,
+                transform->step_count);
+        }
+        STATS_END(
+            STATS_TLG6_TRANSFORM,
+            transform_clock,
+            4 * pixel_count,
+            4 * pixel_count);
+
+        const size_t row_limit = ylim < sink->height ? ylim : sink->height;
+        for (size_t yy = y; yy < row_limit; yy++)
         {
-            Pixel *current_line = image_data + yy * header.image_width;
+            Pixel *current_line = sink->row_begin(sink, yy);
+            STATS_BEGIN(predict_clock);
             int dir = (yy & 1) ^ 1;
             int odd_skip = ((ylim - yy -1) - (yy - y));
 
@@ -671,7 +593,7 @@ static PyObject *tlg6_decode(PyObject *self, PyObject *args)
                     &header);
             }
 
-            if (main_count != header.x_block_count)
+            if (main_count < block_limit)
             {
                 int ww = header.image_width - main_count * W_BLOCK_SIZE;
                 if (ww > W_BLOCK_SIZE)
@@ -691,48 +613,126 @@ static PyObject *tlg6_decode(PyObject *self, PyObject *args)
                     &header);
             }
 
+            STATS_END(
+                STATS_TLG6_PREDICT,
+                predict_clock,
+                4 * header.image_width,
+                sink->width * sizeof(Pixel));
+
+            sink->row_end(sink, yy);
             prev_line = current_line;
         }
     }
 
-    PyObject *output_image_width = PyLong_FromLong(header.image_width);
-    PyObject *output_image_height = PyLong_FromLong(header.image_height);
-    PyObject *output_image_data = PyBytes_FromStringAndSize(
-        (char*)image_data, image_data_size);
-    output = PyTuple_Pack(
-        3,
-        output_image_width,
-        output_image_height,
-        output_image_data);
-    Py_DECREF(output_image_width);
-    Py_DECREF(output_image_height);
-    Py_DECREF(output_image_data);
-
+    ret = 1;
 end:
-    if (image_data) PyMem_RawFree(image_data);
-    if (block_data) PyMem_RawFree(block_data);
-    if (zero_line) PyMem_RawFree(zero_line);
     if (stream) stream_destroy(stream);
-    if (ft) tlg6_ft_destroy(ft);
-    PyBuffer_Release(&input);
-    return output;
+    return ret;
+}
+
+static const Codec tlg6_codec = {
+    &tlg6_read_size,
+    &tlg6_decode_image,
+};
+
+static PyObject *tlg6_decode(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_single(self, &tlg6_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg6_decode_region(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_region(self, &tlg6_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg6_decode_thumbnail(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_thumbnail(self, &tlg6_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg6_decode_many(
+    PyObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return decode_many(self, &tlg6_codec, args, nargs, kwnames);
+}
+
+static PyObject *tlg6_decoder_new(
+    PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    return decoder_new(type, args, kwds, &tlg6_codec);
 }
 
 static PyMethodDef Methods[] = {
-    {"decode_tlg_6", tlg6_decode, METH_VARARGS, "Decode a tlg6 image"},
+    {
+        "decode_tlg_6",
+        (PyCFunction)(void(*)(void))tlg6_decode,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a tlg6 image"
+    },
+    {
+        "decode_tlg_6_many",
+        (PyCFunction)(void(*)(void))tlg6_decode_many,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a sequence of tlg6 images in parallel"
+    },
+    {
+        "decode_tlg_6_region",
+        (PyCFunction)(void(*)(void))tlg6_decode_region,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode part of a tlg6 image, given as (data, x, y, width, height)"
+    },
+    {
+        "decode_tlg_6_thumbnail",
+        (PyCFunction)(void(*)(void))tlg6_decode_thumbnail,
+        METH_FASTCALL | METH_KEYWORDS,
+        "Decode a tlg6 image shrunk by a factor of 2, 4 or 8"
+    },
+    STATS_METHODS,
+    KERNELS_METHODS,
     {NULL, NULL, 0, NULL}
 };
 
+static int tlg6_exec(PyObject *module)
+{
+    kernels_init();
+    PyObject *magic = PyBytes_FromStringAndSize(MAGIC, MAGIC_SIZE);
+    if (!magic || PyModule_AddObject(module, "MAGIC", magic))
+    {
+        Py_XDECREF(magic);
+        return -1;
+    }
+    if (!decode_module_init(module))
+        return -1;
+    PyObject *decoder_type = decoder_type_create(
+        module, "lib.tlg.tlg6.Decoder", tlg6_decoder_new);
+    if (!decoder_type || PyModule_AddObject(module, "Decoder", decoder_type))
+    {
+        Py_XDECREF(decoder_type);
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, tlg6_exec},
+    MODULE_SLOTS
+};
+
 static struct PyModuleDef module_definition = {
-   PyModuleDef_HEAD_INIT, "lib.tlg.tlg6", NULL, -1, Methods,
+    PyModuleDef_HEAD_INIT,
+    .m_name = "lib.tlg.tlg6",
+    .m_size = sizeof(DecodeState),
+    .m_methods = Methods,
+    .m_slots = module_slots,
+    .m_traverse = decode_module_traverse,
+    .m_clear = decode_module_clear,
+    .m_free = decode_module_free,
 };
 
 PyMODINIT_FUNC PyInit_tlg6(void)
 {
-    tlg6_init_tables();
-    PyObject *magic_key = Py_BuildValue("s", "MAGIC");
-    PyObject *magic_value = Py_BuildValue("y#", MAGIC, MAGIC_SIZE);
-    PyObject *module = PyModule_Create(&module_definition);
-    PyObject_SetAttr(module, magic_key, magic_value);
-    return module;
+    return PyModuleDef_Init(&module_definition);
 }
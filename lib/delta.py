@@ -0,0 +1,178 @@
+import struct
+from pathlib import Path
+from typing import Any, Dict, List, Tuple
+from lib import _delta, engine
+from lib.open_ext import ExtendedHandle, open_ext
+
+
+# the layout is described in ext/delta.c, which applies deltas
+MAGIC = b'ARCDELTA'
+ORIGIN_SOURCE = 0
+ORIGIN_PATCH = 1
+# ranges are compared this many bytes at a time, so that no entry has to be
+# held in memory twice
+COMPARE_SIZE = 1024 * 1024
+
+Operation = Tuple[int, int, int]  # origin, offset, size
+
+
+class Source:
+    # The archive as it was before pack touched it. Patching rewrites the
+    # file table in place and appends after the old end, and repacking
+    # replaces the file, so a handle opened beforehand plus a copy of the
+    # table is enough to read any of it afterwards.
+    def __init__(
+            self, path: Path, file_name_hash_map: Dict[int, str]) -> None:
+        self.path = path
+        self.handle = open_ext(path, 'rb')
+        try:
+            self.size, self.hash = _delta.hash_file(self.handle.fileno())
+            table = engine.read_file_table(self.handle, file_name_hash_map)
+            table_size = self.handle.tell()
+            self.handle.seek(0)
+            self.head = self.handle.read(table_size)
+        except BaseException:
+            self.handle.close()
+            raise
+        # where each entry's stored bytes were
+        self.ranges = {
+            entry.file_name_hash: (entry.offset, entry.size_compressed)
+            for entry in table.entries
+            if entry.is_extractable
+        }  # type: Dict[int, Tuple[int, int]]
+
+    def __enter__(self) -> 'Source':
+        return self
+
+    def __exit__(self, *unused: Any) -> None:
+        self.handle.close()
+
+    def read(self, offset: int, size: int) -> bytes:
+        if offset < len(self.head):
+            end = min(offset + size, len(self.head))
+            return self.head[offset:end] + self.read(end, size - end + offset)
+        with self.handle.peek(offset):
+            return self.handle.read(size)
+
+
+def read_range(handle: ExtendedHandle, offset: int, size: int) -> bytes:
+    with handle.peek(offset):
+        return handle.read(size)
+
+
+def same_bytes(
+        source: Source,
+        source_offset: int,
+        target: ExtendedHandle,
+        target_offset: int,
+        size: int) -> bool:
+    if source_offset + size > source.size:
+        return False
+    for start in range(0, size, COMPARE_SIZE):
+        chunk_size = min(COMPARE_SIZE, size - start)
+        if (source.read(source_offset + start, chunk_size)
+                != read_range(target, target_offset + start, chunk_size)):
+            return False
+    return True
+
+
+def plan(
+        source: Source,
+        target: ExtendedHandle,
+        target_size: int,
+        target_table: engine.FileTable) -> List[Operation]:
+    # Splits the target into the ranges of its entries and whatever lies
+    # between them, such as the file table, and takes each range from the
+    # source where the same bytes already are: where the same entry was
+    # stored, or at the same offset. Anything else, including every range
+    # of an entry whose name is unknown, ends up in the delta. For ranges
+    # in the delta, the offset is the one within the target for now.
+    ranges = sorted(
+        (entry.offset, entry.size_compressed, entry.file_name_hash)
+        for entry in target_table.entries
+        if entry.is_extractable and entry.size_compressed)
+    pieces = []  # type: List[Tuple[int, int, int]]
+    position = 0
+    for offset, size, file_name_hash in ranges:
+        if offset < position:
+            continue
+        if offset > position:
+            pieces.append((position, offset - position, position))
+        source_offset, source_size = source.ranges.get(
+            file_name_hash, (offset, size))
+        pieces.append(
+            (offset, size, source_offset if source_size == size else offset))
+        position = offset + size
+    if position < target_size:
+        pieces.append((position, target_size - position, position))
+
+    operations = []  # type: List[Operation]
+    for offset, size, source_offset in pieces:
+        if same_bytes(source, source_offset, target, offset, size):
+            operation = (ORIGIN_SOURCE, source_offset, size)
+        else:
+            operation = (ORIGIN_PATCH, offset, size)
+        # neighbours that continue one another become one operation
+        if operations:
+            origin, last_offset, last_size = operations[-1]
+            if origin == operation[0] and last_offset + last_size == (
+                    operation[1]):
+                operations[-1] = (origin, last_offset, last_size + size)
+                continue
+        operations.append(operation)
+    return operations
+
+
+def write_delta(
+        path: Path,
+        source: Source,
+        target_path: Path,
+        file_name_hash_map: Dict[int, str]) -> Tuple[int, int]:
+    # returns how many bytes of the target the delta carries, and the size
+    # of the target
+    with open_ext(target_path, 'rb') as target:
+        target_size, target_hash = _delta.hash_file(target.fileno())
+        table = engine.read_file_table(target, file_name_hash_map)
+        operations = plan(source, target, target_size, table)
+
+        name = source.path.name.encode()
+        header = (
+            MAGIC
+            + struct.pack('<II', _delta.VERSION, len(name))
+            + name
+            + struct.pack(
+                '<QQQQQ',
+                source.size,
+                source.hash,
+                target_size,
+                target_hash,
+                len(operations)))
+        position = len(header) + 24 * len(operations)
+        records = []  # type: List[bytes]
+        for origin, offset, size in operations:
+            if origin == ORIGIN_PATCH:
+                records.append(struct.pack('<IIQQ', origin, 0, position, size))
+                position += size
+            else:
+                records.append(struct.pack('<IIQQ', origin, 0, offset, size))
+
+        with open_ext(path, 'wb') as handle:
+            handle.write(header + b''.join(records))
+            for origin, offset, size in operations:
+                if origin != ORIGIN_PATCH:
+                    continue
+                for start in range(0, size, COMPARE_SIZE):
+                    handle.write(read_range(
+                        target,
+                        offset + start,
+                        min(COMPARE_SIZE, size - start)))
+        return position - len(header) - 24 * len(operations), target_size
+
+
+def read_name(path: Path) -> str:
+    # the name of the archive a delta applies to
+    with open_ext(path, 'rb') as handle:
+        if handle.read(len(MAGIC)) != MAGIC:
+            raise ValueError('{} is not a delta'.format(path))
+        _version, name_size = struct.unpack('<II', handle.read(8))
+        return handle.read(name_size).decode()
@@ -0,0 +1,108 @@
+import os
+import time
+import hashlib
+import tempfile
+from pathlib import Path
+from typing import Any, List, Optional, Tuple
+
+
+# temporary files left behind by workers that died mid-insert are removed
+# once they are this old
+STALE_TEMP_AGE = 24 * 60 * 60
+TEMP_PREFIX = '.tmp-'
+
+
+class CacheStats:
+    def __init__(self) -> None:
+        self.hits = 0
+        self.misses = 0
+        self.inserts = 0
+        self.evictions = 0
+
+    def __str__(self) -> str:
+        return '{} hits, {} misses, {} inserts, {} evictions'.format(
+            self.hits, self.misses, self.inserts, self.evictions)
+
+
+class EncodeCache:
+    # Content-addressed store of encoded images. Entries live under
+    # <path>/<first two key digits>/<key> and are only ever renamed into
+    # place, so several pack processes can share the directory. Reading an
+    # entry bumps its mtime, which is what eviction goes by.
+    def __init__(self, path: Path, max_size: int) -> None:
+        self.path = path
+        self.max_size = max_size
+        self.stats = CacheStats()
+        self.path.mkdir(parents=True, exist_ok=True)
+        self._size = sum(size for _path, size, _mtime in self._scan())
+
+    @property
+    def size(self) -> int:
+        return self._size
+
+    @staticmethod
+    def key(*parts: Any) -> str:
+        return hashlib.sha256(repr(parts).encode()).hexdigest()
+
+    def get(self, key: str) -> Optional[bytes]:
+        path = self._entry_path(key)
+        try:
+            with path.open('rb') as handle:
+                content = handle.read()
+            os.utime(str(path))
+        except FileNotFoundError:
+            # possibly evicted by another process in the meantime
+            self.stats.misses += 1
+            return None
+        self.stats.hits += 1
+        return content
+
+    def put(self, key: str, content: bytes) -> None:
+        path = self._entry_path(key)
+        path.parent.mkdir(exist_ok=True)
+        handle, temp_path = tempfile.mkstemp(
+            dir=str(path.parent), prefix=TEMP_PREFIX)
+        try:
+            with os.fdopen(handle, 'wb') as temp_handle:
+                temp_handle.write(content)
+            os.replace(temp_path, str(path))
+        except BaseException:
+            os.unlink(temp_path)
+            raise
+        self.stats.inserts += 1
+        self._size += len(content)
+        if self._size > self.max_size:
+            self.trim()
+
+    def trim(self) -> None:
+        # the running size is only an estimate when the directory is shared,
+        # so it is recounted from disk before anything is removed
+        entries = sorted(self._scan(), key=lambda entry: entry[2])
+        self._size = sum(size for _path, size, _mtime in entries)
+        for path, size, _mtime in entries:
+            if self._size <= self.max_size:
+                break
+            try:
+                path.unlink()
+                self.stats.evictions += 1
+            except FileNotFoundError:
+                pass
+            self._size -= size
+
+    def _entry_path(self, key: str) -> Path:
+        return self.path.joinpath(key[:2], key)
+
+    def _scan(self) -> List[Tuple[Path, int, float]]:
+        entries = []  # type: List[Tuple[Path, int, float]]
+        now = time.time()
+        for path in self.path.glob('*/*'):
+            try:
+                stat = path.stat()
+                if path.name.startswith(TEMP_PREFIX):
+                    if now - stat.st_mtime > STALE_TEMP_AGE:
+                        path.unlink()
+                    continue
+            except FileNotFoundError:
+                continue
+            entries.append((path, stat.st_size, stat.st_mtime))
+        return entries
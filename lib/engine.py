@@ -1,20 +1,18 @@
 #!/usr/bin/python3
-import math
-import struct
 import zlib
 from enum import IntEnum
 from typing import Dict, Optional, List
-from lib.crc64 import crc64
+from lib import _deflate, _engine
 from lib.open_ext import ExtendedHandle
 
 
 GAME_TITLE = '辻堂さんの純愛ロード'
-SCRIPT_HASH = crc64(GAME_TITLE.encode('sjis'))
+SCRIPT_HASH = _engine.crc64(GAME_TITLE.encode('sjis'))
 ENTRY_COUNT_HASH = 0x26ACA46E
 
 
 def get_file_name_hash(name: str) -> int:
-    return crc64(name.encode('sjis'))
+    return _engine.crc64(name.encode('sjis'))
 
 
 class FileType(IntEnum):
@@ -127,62 +125,69 @@ def write_file_entry(handle: ExtendedHandle, entry: FileEntry) -> None:
 
 
 def read_file_content(handle: ExtendedHandle, entry: FileEntry) -> bytes:
-    if entry.file_type == FileType.COMPRESSED:
-        with handle.peek(entry.offset):
-            content = handle.read(entry.size_compressed)
-            content = _transform_script_content(content, entry.file_name_hash)
-            return zlib.decompress(content)
+    content = read_raw_file_content(handle, entry)
+    content = transform_file_content(entry, content)
+    return decompress_file_content(entry, content)
+
 
+def read_raw_file_content(handle: ExtendedHandle, entry: FileEntry) -> bytes:
+    # the stored bytes, still obfuscated and compressed; this is the only
+    # part that needs the handle
     with handle.peek(entry.offset):
-        content = handle.read(entry.size_compressed)
-        if entry.file_type == FileType.OBFUSCATED:
-            assert entry.file_name is not None
-            assert entry.size_compressed is not None
-            content = _transform_regular_content(
-                content, entry.file_name, entry.size_compressed)
-        return content
+        return handle.read(entry.size_compressed)
 
 
-def write_file_content(
-        handle: ExtendedHandle, entry: FileEntry, content: bytes) -> None:
-    entry.offset = handle.tell()
-    entry.size_original = len(content)
+def transform_file_content(entry: FileEntry, content: bytes) -> bytes:
+    # the obfuscation is a plain XOR, so the same call applies and undoes it
+    if entry.file_type == FileType.COMPRESSED:
+        return _transform_script_content(content, entry.file_name_hash)
+    if entry.file_type == FileType.OBFUSCATED:
+        assert entry.file_name is not None
+        return _transform_regular_content(content, entry.file_name)
+    return content
+
 
+def decompress_file_content(entry: FileEntry, content: bytes) -> bytes:
     if entry.file_type == FileType.COMPRESSED:
-        content = zlib.compress(content)
-        content = _transform_script_content(content, entry.file_name_hash)
-        handle.write(content)
-        entry.size_compressed = handle.tell() - entry.offset
-        return
+        return zlib.decompress(content)
+    return content
 
-    entry.size_compressed = entry.size_original
 
-    if entry.file_type == FileType.OBFUSCATED:
-        assert entry.file_name is not None
-        assert entry.size_compressed is not None
-        content = _transform_regular_content(
-            content, entry.file_name, entry.size_compressed)
+def compress_file_content(
+        entry: FileEntry, content: bytes, compression_level: int = -1
+) -> bytes:
+    if entry.file_type == FileType.COMPRESSED:
+        # deflated in parallel chunks, but still a single zlib stream
+        return _deflate.compress(content, level=compression_level)
+    return content
+
+
+def write_file_content(
+        handle: ExtendedHandle,
+        entry: FileEntry,
+        content: bytes,
+        compression_level: int = -1) -> None:
+    size_original = len(content)
+    content = compress_file_content(entry, content, compression_level)
+    content = transform_file_content(entry, content)
+    write_raw_file_content(handle, entry, content, size_original)
+
+
+def write_raw_file_content(
+        handle: ExtendedHandle,
+        entry: FileEntry,
+        content: bytes,
+        size_original: int) -> None:
+    entry.offset = handle.tell()
+    entry.size_original = size_original
     handle.write(content)
+    entry.size_compressed = handle.tell() - entry.offset
 
 
 def _transform_script_content(content: bytes, content_hash: int) -> bytes:
-    xor = (content_hash ^ SCRIPT_HASH) & 0xFFFFFFFF
-    result = b''
-    for _ in range(math.floor(len(content) / 4)):
-        result += struct.pack('<I', struct.unpack('<I', content[0:4])[0] ^ xor)
-        content = content[4:]
-    result += content
-    return result
-
-
-def _transform_regular_content(
-        content: bytes, file_name: str, limit: int) -> bytes:
-    name = file_name.encode('sjis')
-    block_len = math.floor(limit / len(name))
-    content = bytearray(content)
-    pos = 0
-    for j in range(len(name) - 1):
-        for k in range(block_len):
-            content[pos] ^= name[j]
-            pos += 1
-    return content
+    return _engine.xor_words(
+        content, (content_hash ^ SCRIPT_HASH) & 0xFFFFFFFF)
+
+
+def _transform_regular_content(content: bytes, file_name: str) -> bytes:
+    return _engine.xor_name(content, file_name.encode('sjis'))
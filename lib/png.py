@@ -1,11 +1,19 @@
 import io
-from typing import Tuple
+from typing import Tuple, Iterator, Iterable
 import PIL.Image
 
 
-def raw_to_png(width: int, height: int, raw_data: bytes) -> bytes:
-    image = PIL.Image.frombytes(
-        mode='RGBA', size=(width, height), data=raw_data)
+def raw_to_png(
+        width: int, height: int, raw_data: bytes, opaque: bool = False
+) -> bytes:
+    # raw_data is always RGBA; opaque images drop the alpha channel to save
+    # space
+    if opaque:
+        image = PIL.Image.frombytes(
+            'RGB', (width, height), raw_data, 'raw', 'RGBX')
+    else:
+        image = PIL.Image.frombytes(
+            mode='RGBA', size=(width, height), data=raw_data)
     with io.BytesIO() as handle:
         image.save(handle, format='png')
         return handle.getvalue()
@@ -14,7 +22,43 @@ def raw_to_png(width: int, height: int, raw_data: bytes) -> bytes:
 def png_to_raw(png_content: bytes) -> Tuple[int, int, bytes]:
     with io.BytesIO(bytes(png_content)) as handle:
         image = PIL.Image.open(handle)
+        if image.mode != 'RGBA':
+            image = image.convert('RGBA')
         return (
             image.width,
             image.height,
             b''.join(bytes(b) for b in image.getdata()))
+
+
+class _Strips:
+    def __init__(self, image: PIL.Image.Image, strip_height: int) -> None:
+        self._image = image
+        self._strip_height = strip_height
+
+    def __iter__(self) -> Iterator[bytes]:
+        image = self._image
+        for y in range(0, image.height, self._strip_height):
+            strip = image.crop((
+                0, y, image.width, min(y + self._strip_height, image.height)))
+            if strip.mode != 'RGBA':
+                strip = strip.convert('RGBA')
+            yield strip.tobytes()
+
+
+def png_to_strips(
+        png_content: bytes, strip_height: int
+) -> Tuple[int, int, bool, Iterable[bytes]]:
+    # hands out the image as RGBA strips of strip_height rows, so that no
+    # full-size RGBA copy is made on top of the decoded PNG; PIL still
+    # decodes the whole image up front, so memory stays proportional to it.
+    # The strips can be walked more than once
+    image = PIL.Image.open(io.BytesIO(png_content))
+    image.load()
+    bands = image.getbands()
+    if 'transparency' in image.info:
+        opaque = False
+    elif 'A' in bands:
+        opaque = image.getextrema()[bands.index('A')][0] == 0xFF
+    else:
+        opaque = True
+    return image.width, image.height, opaque, _Strips(image, strip_height)
@@ -0,0 +1,211 @@
+import json
+import time
+import platform
+import threading
+import contextlib
+import concurrent.futures
+from pathlib import Path
+from typing import Any, Callable, Dict, Iterator, List, Optional
+
+
+class StageStats:
+    def __init__(self) -> None:
+        self.count = 0
+        self.total = 0.0
+        self.max = 0.0
+
+    def add(self, seconds: float) -> None:
+        self.count += 1
+        self.total += seconds
+        self.max = max(self.max, seconds)
+
+    def to_json(self) -> Dict[str, Any]:
+        return {
+            'count': self.count,
+            'total': self.total,
+            'mean': self.total / self.count if self.count else 0.0,
+            'max': self.max,
+        }
+
+
+class PoolStats:
+    def __init__(self) -> None:
+        self.executors = 0
+        # sum of workers * lifetime over every executor of the pool
+        self.capacity = 0.0
+        self.busy = StageStats()
+        self.queue_wait = StageStats()
+
+    def to_json(self) -> Dict[str, Any]:
+        return {
+            'executors': self.executors,
+            'tasks': self.busy.count,
+            'capacity': self.capacity,
+            'busy': self.busy.total,
+            'utilization':
+                self.busy.total / self.capacity if self.capacity else 0.0,
+            'task_time': self.busy.to_json(),
+            'queue_wait': self.queue_wait.to_json(),
+        }
+
+
+class _ProfiledExecutor(concurrent.futures.ThreadPoolExecutor):
+    # times every task from submission to start (queue wait) and from start
+    # to finish (busy time); Executor.map goes through submit as well
+    def __init__(
+            self, profiler: 'Profiler', name: str, max_workers: int) -> None:
+        super().__init__(max_workers=max_workers)
+        self._profiler = profiler
+        self._name = name
+        self._workers = max_workers
+        self._start = time.perf_counter()
+
+    def submit(
+            self, fn: Callable[..., Any], *args: Any, **kwargs: Any
+    ) -> 'concurrent.futures.Future[Any]':
+        submitted = time.perf_counter()
+
+        def task() -> Any:
+            started = time.perf_counter()
+            try:
+                return fn(*args, **kwargs)
+            finally:
+                self._profiler.add_task(
+                    self._name,
+                    started - submitted,
+                    time.perf_counter() - started)
+
+        return super().submit(task)
+
+    def shutdown(self, *args: Any, **kwargs: Any) -> None:
+        super().shutdown(*args, **kwargs)
+        self._profiler.add_executor(
+            self._name,
+            self._workers * (time.perf_counter() - self._start))
+
+
+class Profiler:
+    # Collects wall-clock time per pipeline stage, both in aggregate and per
+    # entry, along with queue waits and utilization of the executors it hands
+    # out. A disabled profiler records nothing and hands out plain executors,
+    # so call sites don't need to check whether profiling is on.
+    def __init__(self, enabled: bool = True) -> None:
+        self.enabled = enabled
+        self._lock = threading.Lock()
+        self._start = time.perf_counter()
+        self._stages = {}  # type: Dict[str, StageStats]
+        self._entries = {}  # type: Dict[str, Dict[str, float]]
+        self._pools = {}  # type: Dict[str, PoolStats]
+
+    @contextlib.contextmanager
+    def stage(self, name: str, entry: Optional[str] = None) -> Iterator[None]:
+        if not self.enabled:
+            yield
+            return
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.add(name, time.perf_counter() - start, entry)
+
+    def add(
+            self, name: str, seconds: float, entry: Optional[str] = None
+    ) -> None:
+        if not self.enabled:
+            return
+        with self._lock:
+            self._stages.setdefault(name, StageStats()).add(seconds)
+            if entry is not None:
+                stages = self._entries.setdefault(entry, {})
+                stages[name] = stages.get(name, 0.0) + seconds
+
+    def add_task(self, pool: str, queue_wait: float, seconds: float) -> None:
+        with self._lock:
+            stats = self._pools.setdefault(pool, PoolStats())
+            stats.queue_wait.add(queue_wait)
+            stats.busy.add(seconds)
+
+    def add_executor(self, pool: str, capacity: float) -> None:
+        with self._lock:
+            stats = self._pools.setdefault(pool, PoolStats())
+            stats.executors += 1
+            stats.capacity += capacity
+
+    def executor(
+            self, name: str, max_workers: Optional[int]
+    ) -> concurrent.futures.ThreadPoolExecutor:
+        if not self.enabled:
+            return concurrent.futures.ThreadPoolExecutor(
+                max_workers=max_workers)
+        return _ProfiledExecutor(self, name, max_workers or 1)
+
+    def slowest(self, top: int) -> List[Dict[str, Any]]:
+        with self._lock:
+            entries = [
+                (sum(stages.values()), entry, dict(stages))
+                for entry, stages in self._entries.items()
+            ]
+        entries.sort(key=lambda item: item[0], reverse=True)
+        return [
+            {'entry': entry, 'total': total, 'stages': stages}
+            for total, entry, stages in entries[:top]
+        ]
+
+    def report(self, top: int) -> Dict[str, Any]:
+        slowest = self.slowest(top)
+        with self._lock:
+            return {
+                'machine': {
+                    'platform': platform.platform(),
+                    'processor': platform.processor(),
+                    'python': platform.python_version(),
+                },
+                'wall_time': time.perf_counter() - self._start,
+                'stages': {
+                    name: stats.to_json()
+                    for name, stats in self._stages.items()
+                },
+                'pools': {
+                    name: stats.to_json()
+                    for name, stats in self._pools.items()
+                },
+                'entries': {
+                    entry: dict(stages)
+                    for entry, stages in self._entries.items()
+                },
+                'slowest': slowest,
+            }
+
+    def summary(self, top: int) -> str:
+        report = self.report(top)
+        lines = ['Wall time: {:.2f} s'.format(report['wall_time'])]
+        for name, stats in sorted(
+                report['stages'].items(),
+                key=lambda item: item[1]['total'],
+                reverse=True):
+            lines.append(
+                '{:<20} {:>10.3f} s {:>8} calls {:>10.2f} ms max'.format(
+                    name, stats['total'], stats['count'], stats['max'] * 1000))
+        for name, stats in sorted(report['pools'].items()):
+            lines.append(
+                'Pool {}: {} tasks, {:.1%} utilization, '
+                '{:.2f} ms mean queue wait'.format(
+                    name,
+                    stats['tasks'],
+                    stats['utilization'],
+                    stats['queue_wait']['mean'] * 1000))
+        if report['slowest']:
+            lines.append('Slowest {} entries:'.format(len(report['slowest'])))
+        for item in report['slowest']:
+            stage, seconds = max(
+                item['stages'].items(), key=lambda stage: stage[1])
+            lines.append('{:>10.3f} s {} (mostly {}, {:.3f} s)'.format(
+                item['total'], item['entry'], stage, seconds))
+        return '\n'.join(lines)
+
+    def write(self, path: Path, top: int) -> None:
+        with path.open('w') as handle:
+            json.dump(self.report(top), handle, indent=4, sort_keys=True)
+
+
+NO_PROFILER = Profiler(enabled=False)
@@ -0,0 +1,164 @@
+import os
+import json
+import mmap
+import socket
+from pathlib import Path
+from typing import Any, Dict, List, Optional, Tuple
+
+
+# The archive service speaks a line protocol over a Unix stream socket. Each
+# request is one line holding a JSON object; each reply starts with one line
+# holding a JSON header, followed by `size` bytes of payload. Requests that
+# set "fd" get no payload; the reply header arrives together with a sealed
+# memfd (or the archive itself, at header["offset"]) holding the same bytes.
+#
+#   {"op": "list"}
+#   {"op": "get", "name": ..., "kind": "raw" | "rgba" | "png"}
+#   {"op": "region", "name": ..., "x": ..., "y": ..., "width": ...,
+#    "height": ...}
+#   {"op": "stats"}
+#
+# Failed requests get {"ok": false, "error": ...} and no payload.
+DEFAULT_SOCKET = 'archive.sock'
+MAX_LINE = 64 * 1024
+KINDS = ('raw', 'rgba', 'png')
+
+
+class ServiceError(Exception):
+    pass
+
+
+def read_line(sock: socket.socket, buffer: bytearray) -> Optional[bytes]:
+    # returns None once the peer hangs up; whatever follows the line stays
+    # in buffer
+    while True:
+        end = buffer.find(b'\n')
+        if end >= 0:
+            line = bytes(buffer[:end])
+            del buffer[:end + 1]
+            return line
+        if len(buffer) > MAX_LINE:
+            raise ServiceError('Line too long')
+        chunk = sock.recv(4096)
+        if not chunk:
+            return None
+        buffer += chunk
+
+
+def encode_line(message: Dict[str, Any]) -> bytes:
+    return json.dumps(message, separators=(',', ':')).encode() + b'\n'
+
+
+class Client:
+    # one connection, reused for any number of requests
+    def __init__(self, path: Path = Path(DEFAULT_SOCKET)) -> None:
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(str(path))
+        self._buffer = bytearray()
+
+    def __enter__(self) -> 'Client':
+        return self
+
+    def __exit__(self, *unused: Any) -> None:
+        self.close()
+
+    def close(self) -> None:
+        self._sock.close()
+
+    def list(self) -> List[Dict[str, Any]]:
+        _header, payload = self.request({'op': 'list'})
+        return json.loads(payload.decode())
+
+    def stats(self) -> Dict[str, Any]:
+        _header, payload = self.request({'op': 'stats'})
+        return json.loads(payload.decode())
+
+    def get(self, name: str, kind: str = 'raw') -> bytes:
+        _header, payload = self.request(
+            {'op': 'get', 'name': name, 'kind': kind})
+        return payload
+
+    def get_image(self, name: str) -> Tuple[int, int, bytes]:
+        header, payload = self.request(
+            {'op': 'get', 'name': name, 'kind': 'rgba'})
+        return header['width'], header['height'], payload
+
+    def get_region(
+            self, name: str, x: int, y: int, width: int, height: int
+    ) -> Tuple[int, int, bytes]:
+        header, payload = self.request({
+            'op': 'region',
+            'name': name,
+            'x': x,
+            'y': y,
+            'width': width,
+            'height': height,
+        })
+        return header['width'], header['height'], payload
+
+    def map(
+            self, name: str, kind: str = 'raw'
+    ) -> Tuple[Dict[str, Any], memoryview]:
+        # maps the server's copy instead of receiving it; the mapping is
+        # read-only and stays valid after the server evicts or reloads it
+        header, fd = self.request_fd(
+            {'op': 'get', 'name': name, 'kind': kind})
+        try:
+            offset = header.get('offset', 0)
+            start = offset - offset % mmap.ALLOCATIONGRANULARITY
+            mapping = mmap.mmap(
+                fd,
+                offset - start + header['size'],
+                prot=mmap.PROT_READ,
+                offset=start)
+        finally:
+            os.close(fd)
+        return header, memoryview(mapping)[offset - start:]
+
+    def request(self, message: Dict[str, Any]) -> Tuple[Dict[str, Any], bytes]:
+        self._sock.sendall(encode_line(message))
+        header = self._read_header()
+        payload = bytearray()
+        while len(payload) < header['size']:
+            if self._buffer:
+                chunk = bytes(self._buffer[:header['size'] - len(payload)])
+                del self._buffer[:len(chunk)]
+            else:
+                chunk = self._sock.recv(
+                    min(header['size'] - len(payload), 1 << 20))
+                if not chunk:
+                    raise ServiceError('Connection closed')
+            payload += chunk
+        return header, bytes(payload)
+
+    def request_fd(self, message: Dict[str, Any]) -> Tuple[Dict[str, Any], int]:
+        message = dict(message, fd=True)
+        self._sock.sendall(encode_line(message))
+        assert not self._buffer
+        line, fds, _flags, _address = socket.recv_fds(self._sock, MAX_LINE, 1)
+        if not line.endswith(b'\n'):
+            for fd in fds:
+                os.close(fd)
+            raise ServiceError('Truncated reply')
+        try:
+            header = self._parse_header(line[:-1])
+        except BaseException:
+            for fd in fds:
+                os.close(fd)
+            raise
+        if not fds:
+            raise ServiceError('No descriptor in reply')
+        return header, fds[0]
+
+    def _read_header(self) -> Dict[str, Any]:
+        line = read_line(self._sock, self._buffer)
+        if line is None:
+            raise ServiceError('Connection closed')
+        return self._parse_header(line)
+
+    @staticmethod
+    def _parse_header(line: bytes) -> Dict[str, Any]:
+        header = json.loads(line.decode())
+        if not header['ok']:
+            raise ServiceError(header['error'])
+        return header
@@ -17,6 +17,15 @@ class Artifact:
 
 
 class Snapshot:
+    # hash of the decoded pixels of an image, so that pack can tell a PNG
+    # that was merely touched from an edited one; snapshots pickled before
+    # this was recorded fall back to None
+    pixel_hash = None  # type: Optional[int]
+    # whether the artifacts hold the real content; a lazy unpack leaves an
+    # empty main artifact in place of most entries, which pack copies over
+    # from the original archive as they are
+    materialized = True
+
     def __init__(self, file_entry: engine.FileEntry) -> None:
         self.entry = file_entry
         self.extra_artifacts = {}  # type: Dict[str, Artifact]
@@ -26,6 +35,11 @@ class Snapshot:
         util.save_file(path, content)
         self.main_artifact = Artifact(path)
 
+    def save_placeholder(self, path: Path) -> None:
+        util.save_file(path, b'')
+        self.main_artifact = Artifact(path)
+        self.materialized = False
+
     def save_extra_artifact(
             self, artifact_id: str, path: Path, content: bytes) -> None:
         util.save_file(path, content)
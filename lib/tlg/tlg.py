@@ -1,10 +1,21 @@
-from typing import Tuple, Any
-from lib.png import raw_to_png, png_to_raw
+import os
+import struct
+from typing import Tuple, Any, List, Sequence, Union, Iterable, Optional
+from lib.png import raw_to_png, png_to_strips
+from lib.encode_cache import EncodeCache
+from lib.profiler import Profiler, NO_PROFILER
 from lib.tlg import tlg0
 from lib.tlg import tlg5
 from lib.tlg import tlg6
 
 
+Image = Tuple[int, int, bytes]
+# PNG rows are fed to the encoder one TLG5 block row at a time
+STRIP_HEIGHT = 16
+# part of encode cache keys; bump whenever the encoder output changes
+ENCODER = ('tlg0', 'tlg5', 1)
+
+
 def is_tlg(content: bytes) -> bool:
     return content.startswith((tlg0.MAGIC, tlg5.MAGIC, tlg6.MAGIC))
 
@@ -12,16 +23,215 @@ def is_tlg(content: bytes) -> bool:
 def tlg_to_png(content: bytes) -> Tuple[bytes, Any]:
     metadata = None
     if content.startswith(tlg0.MAGIC):
-        width, height, raw_data, metadata = tlg0.decode_tlg_0(content)
-    elif content.startswith(tlg5.MAGIC):
-        width, height, raw_data = tlg5.decode_tlg_5(content)
-    elif content.startswith(tlg6.MAGIC):
-        width, height, raw_data = tlg6.decode_tlg_6(content)
+        content, metadata = tlg0.read_tlg_0(content)
+    if tlg0.has_magic(content, tlg5.MAGIC):
+        image = tlg5.decode_tlg_5(content)
+    elif tlg0.has_magic(content, tlg6.MAGIC):
+        image = tlg6.decode_tlg_6(content)
     else:
         assert False, 'Not a TLG image'
-    return raw_to_png(width, height, raw_data), metadata
+    return (
+        raw_to_png(image.width, image.height, image.data, image.opaque),
+        metadata)
+
+
+class Decoder:
+    # keeps native scratch buffers alive between calls, so decoding a series
+    # of similarly sized images doesn't allocate per image
+    def __init__(self) -> None:
+        self._decoders = [
+            (tlg5.MAGIC, tlg5.Decoder()),
+            (tlg6.MAGIC, tlg6.Decoder()),
+        ]  # type: List[Tuple[bytes, Any]]
+
+    def decode(
+            self, content: bytes, format: str = 'RGBA'
+    ) -> Tuple[Image, Any]:
+        decoder, content, metadata = self._find(content)
+        return decoder.decode(content, format=format), metadata
+
+    def decode_region(
+            self,
+            content: bytes,
+            x: int,
+            y: int,
+            width: int,
+            height: int,
+            format: str = 'RGBA'
+    ) -> Tuple[Image, Any]:
+        decoder, content, metadata = self._find(content)
+        return (
+            decoder.decode_region(
+                content, x, y, width, height, format=format),
+            metadata)
+
+    def decode_thumbnail(
+            self, content: bytes, scale: int, format: str = 'RGBA'
+    ) -> Tuple[Image, Any]:
+        decoder, content, metadata = self._find(content)
+        return (
+            decoder.decode_thumbnail(content, scale, format=format),
+            metadata)
+
+    def _find(self, content: bytes) -> Tuple[Any, bytes, Any]:
+        metadata = None
+        if content.startswith(tlg0.MAGIC):
+            content, metadata = tlg0.read_tlg_0(content)
+        for magic, decoder in self._decoders:
+            if tlg0.has_magic(content, magic):
+                return decoder, content, metadata
+        raise ValueError('Not a TLG image')
+
+
+def decode_region(
+        content: bytes,
+        x: int,
+        y: int,
+        width: int,
+        height: int,
+        format: str = 'RGBA'
+) -> Image:
+    if content.startswith(tlg0.MAGIC):
+        content, _metadata = tlg0.read_tlg_0(content)
+    if tlg0.has_magic(content, tlg5.MAGIC):
+        return tlg5.decode_tlg_5_region(
+            content, x, y, width, height, format=format)
+    if tlg0.has_magic(content, tlg6.MAGIC):
+        return tlg6.decode_tlg_6_region(
+            content, x, y, width, height, format=format)
+    raise ValueError('Not a TLG image')
+
+
+def decode_thumbnail(
+        content: bytes, scale: int, format: str = 'RGBA') -> Image:
+    if content.startswith(tlg0.MAGIC):
+        content, _metadata = tlg0.read_tlg_0(content)
+    if tlg0.has_magic(content, tlg5.MAGIC):
+        return tlg5.decode_tlg_5_thumbnail(content, scale, format=format)
+    if tlg0.has_magic(content, tlg6.MAGIC):
+        return tlg6.decode_tlg_6_thumbnail(content, scale, format=format)
+    raise ValueError('Not a TLG image')
+
+
+def _decode_many(
+        contents: Sequence[bytes], scale: int = 1, format: str = 'RGBA'
+) -> List[Union[Tuple[Image, Any], Exception]]:
+    results = [None] * len(contents)  # type: List[Any]
+    metadata = [None] * len(contents)  # type: List[Any]
+    batches = [
+        (tlg5.MAGIC, tlg5.decode_tlg_5_many, [], []),
+        (tlg6.MAGIC, tlg6.decode_tlg_6_many, [], []),
+    ]  # type: List[Tuple[bytes, Any, List[int], List[bytes]]]
+
+    for i, content in enumerate(contents):
+        try:
+            if content.startswith(tlg0.MAGIC):
+                content, metadata[i] = tlg0.read_tlg_0(content)
+        except Exception as ex:
+            results[i] = ex
+            continue
+        for magic, _decoder, indices, payloads in batches:
+            if tlg0.has_magic(content, magic):
+                indices.append(i)
+                payloads.append(content)
+                break
+        else:
+            results[i] = ValueError('Not a TLG image')
+
+    for _magic, decoder, indices, payloads in batches:
+        if payloads:
+            for i, result in zip(indices, decoder(
+                    payloads, 0, scale, format=format)):
+                results[i] = (
+                    result if isinstance(result, Exception)
+                    else (result, metadata[i]))
+    return results
+
+
+def decode_many(
+        contents: Sequence[bytes], scale: int = 1, format: str = 'RGBA'
+) -> List[Union[Image, Exception]]:
+    # results follow the input order; images that fail to decode get the
+    # exception in their slot instead of failing the whole batch
+    return [
+        result if isinstance(result, Exception) else result[0]
+        for result in _decode_many(contents, scale, format)
+    ]
+
+
+def pixel_hash(width: int, height: int, pixels: Iterable[bytes]) -> int:
+    # XXH64 of the size and the RGBA pixels, fed in any number of pieces
+    hasher = tlg5.Hasher()
+    hasher.update(struct.pack('<II', width, height))
+    for piece in pixels:
+        hasher.update(piece)
+    return hasher.digest()
+
+
+def tlg_to_png_many(
+        contents: Sequence[bytes],
+        scale: int = 1,
+        profiler: Profiler = NO_PROFILER,
+        keys: Optional[Sequence[str]] = None
+) -> List[Union[Tuple[bytes, Any, int], Exception]]:
+    # successful results are (png, metadata, pixel hash); keys name the
+    # contents in the profiler's per-entry timings
+    entry_keys = (
+        keys if keys is not None
+        else [None] * len(contents))  # type: Sequence[Optional[str]]
+
+    def work(
+            item: Tuple[Union[Tuple[Image, Any], Exception], Optional[str]]
+    ) -> Union[Tuple[bytes, Any, int], Exception]:
+        result, key = item
+        if isinstance(result, Exception):
+            return result
+        image, metadata = result
+        try:
+            with profiler.stage('png_encode', key):
+                png_content = raw_to_png(
+                    image.width, image.height, image.data, image.opaque)
+            with profiler.stage('pixel_hash', key):
+                digest = pixel_hash(image.width, image.height, [image.data])
+            return png_content, metadata, digest
+        except Exception as ex:
+            return ex
+
+    # the batch is decoded in one native call, so its time can only be
+    # told in aggregate
+    with profiler.stage('tlg_decode'):
+        decoded = _decode_many(contents, scale)
+    with profiler.executor('png_encode', os.cpu_count()) as executor:
+        return list(executor.map(work, zip(decoded, entry_keys)))
+
+
+def png_has_pixel_hash(png_content: bytes, expected_hash: int) -> bool:
+    width, height, _opaque, strips = png_to_strips(png_content, STRIP_HEIGHT)
+    return pixel_hash(width, height, strips) == expected_hash
+
 
+def png_to_tlg(
+        png_content: bytes,
+        metadata: Any,
+        cache: Optional[EncodeCache] = None,
+        original_hash: Optional[int] = None
+) -> Optional[bytes]:
+    # returns None when the pixels hash to original_hash, in which case the
+    # image the PNG was unpacked from can be kept as is
+    width, height, opaque, strips = png_to_strips(png_content, STRIP_HEIGHT)
+    key = None  # type: Optional[str]
+    if cache is not None or original_hash is not None:
+        digest = pixel_hash(width, height, strips)
+        if digest == original_hash:
+            return None
+        if cache is not None:
+            key = cache.key(digest, ENCODER, metadata)
+            content = cache.get(key)
+            if content is not None:
+                return content
 
-def png_to_tlg(png_content: bytes, metadata: Any) -> bytes:
-    width, height, raw_data = png_to_raw(png_content)
-    return tlg0.encode_tlg_0(width, height, raw_data, metadata)
+    content = tlg0.encode_tlg_0_strips(
+        width, height, opaque, strips, metadata)
+    if cache is not None and key is not None:
+        cache.put(key, content)
+    return content
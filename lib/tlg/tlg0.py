@@ -1,79 +1,63 @@
-import io
-from typing import Tuple, List
+from typing import Tuple, List, Iterable
+from lib.tlg import _tlg0
 from lib.tlg import tlg5
 from lib.tlg import tlg6
-from lib.open_ext import ExtendedHandle
 
 
-MAGIC = b'TLG0.0\x00sds\x1A'
+MAGIC = _tlg0.MAGIC
 Tags = List[Tuple[bytes, bytes]]
 
 
-def extract_string(input: bytes) -> Tuple[bytes, bytes]:
-    colon = input.index(b':')
-    size = int(input[0:colon])
-    input = input[colon+1:]
-    return input[:size], input[size:]
+def has_magic(content: bytes, magic: bytes) -> bool:
+    # works for the memoryviews read_tlg_0 hands out, which lack startswith
+    return content[:len(magic)] == magic
 
 
-def put_string(input: bytes) -> bytes:
-    return str(len(input)).encode('ascii') + b':' + input
+def read_tlg_0(content: bytes) -> Tuple[memoryview, Tags]:
+    # the inner image is a view into content rather than a copy, and can be
+    # passed to the decoders as is
+    return _tlg0.read_tlg_0(content)
 
 
 def decode_tlg_0(content: bytes) -> Tuple[int, int, bytes, Tags]:
-    with ExtendedHandle(io.BytesIO(content)) as handle:
-        assert handle.read(len(MAGIC)) == MAGIC
+    image, tags = read_tlg_0(content)
 
-        sub_file_size = handle.read_u32_le()
-        content = handle.read(sub_file_size)
+    if has_magic(image, tlg5.MAGIC):
+        width, height, raw_data = tlg5.decode_tlg_5(image)
+    elif has_magic(image, tlg6.MAGIC):
+        width, height, raw_data = tlg6.decode_tlg_6(image)
+    else:
+        assert False, 'Not a TLG image'
 
-        if content.startswith(tlg5.MAGIC):
-            width, height, raw_data = tlg5.decode_tlg_5(content)
-        elif content.startswith(tlg6.MAGIC):
-            width, height, raw_data = tlg6.decode_tlg_6(content)
-        else:
-            assert False, 'Not a TLG image'
-
-        tags = []  # type: Tags
-        while True:
-            chunk_name = handle.read(4)
-            if not chunk_name:
-                break
-            chunk_size = handle.read_u32_le()
-            chunk_data = handle.read(chunk_size)
-
-            if chunk_name == b'tags':
-                while chunk_data != b'':
-                    key, chunk_data = extract_string(chunk_data)
-                    assert chunk_data.startswith(b'='), 'Corrupt tags'
-                    chunk_data = chunk_data[1:]
-
-                    value, chunk_data = extract_string(chunk_data)
-                    assert not chunk_data or chunk_data.startswith(b','), \
-                        'Corrupt tags'
-                    chunk_data = chunk_data[1:]
-
-                    tags.append((key, value))
-            else:
-                raise NotImplementedError(
-                    'Unknown chunk: {}'.format(chunk_name))
-
-        return width, height, raw_data, tags
+    return width, height, raw_data, tags
 
 
 def encode_tlg_0(
         width: int, height: int, raw_data: bytes, tags: Tags) -> bytes:
-    with ExtendedHandle(io.BytesIO(b'')) as handle:
-        handle.write(MAGIC)
-        sub_file_content = tlg5.encode_tlg_5(width, height, raw_data)
-        handle.write_u32_le(len(sub_file_content))
-        handle.write(sub_file_content)
-        if tags:
-            chunk_data = b','.join([
-                put_string(key) + b'=' + put_string(value)
-                for key, value in tags
-            ])
-            handle.write(b'tags')
-            handle.write_u32_le(len(chunk_data))
-            handle.write(chunk_data)
-        return handle.getvalue()
+    return _tlg0.write_tlg_0(
+        tlg5.encode_tlg_5(width, height, raw_data), tags)
+
+
+def encode_tlg_0_strips(
+        width: int,
+        height: int,
+        opaque: bool,
+        strips: Iterable[bytes],
+        tags: Tags
+) -> bytes:
+    # strips of RGBA rows are encoded as they come, straight into the
+    # container, so no full raw copy of the image is made; the container
+    # itself still holds the whole encoded image
+    channel_count = 3 if opaque else 4
+    output, image = _tlg0.create_tlg_0(
+        tlg5.encoded_size(width, height, channel_count), tags)
+    encoder = tlg5.Encoder(width, height, channel_count, image)
+    for strip in strips:
+        encoder.write(strip)
+    # the container was laid out for the exact size of raw blocks; anything
+    # smaller would leave its size field and tags in the wrong place
+    if encoder.finish() != len(image):
+        raise ValueError('TLG5 image does not fill its TLG0 container')
+    # handed on as bytes like every other encoded image, which costs one
+    # copy of the encoded data but none of the raw pixels
+    return bytes(output)
@@ -1,6 +1,111 @@
+import os
+import sys
+import subprocess
 from distutils.core import setup, Extension
+from distutils.command.build_ext import build_ext
 
-setup(ext_modules=[
-    Extension('lib.tlg.tlg5', sources=['ext/tlg5.c', 'ext/stream.c', 'ext/lzss.c']),
-    Extension('lib.tlg.tlg6', sources=['ext/tlg6.c', 'ext/stream.c', 'ext/lzss.c']),
+# lookup tables are generated by ext/tables.py rather than filled in at import
+tables_source = os.path.join('build', 'generated', 'tables.c')
+
+
+class BuildExt(build_ext):
+    def run(self) -> None:
+        os.makedirs(os.path.dirname(tables_source), exist_ok=True)
+        subprocess.check_call(
+            [sys.executable, os.path.join('ext', 'tables.py'), tables_source])
+        super().run()
+
+
+# the codec kernels are built once per instruction set level, and the best one
+# the CPU runs is picked at module init
+kernel_sources = [
+    'ext/cpu.c',
+    'ext/kernels.c',
+    'ext/kernels_scalar.c',
+    'ext/kernels_sse2.c',
+    'ext/kernels_avx2.c',
+    'ext/kernels_avx512.c',
+]
+
+common_sources = [
+    'ext/decode.c',
+    'ext/error.c',
+    'ext/format.c',
+    'ext/hash.c',
+    'ext/pool.c',
+    'ext/scratch.c',
+    'ext/stream.c',
+    'ext/lzss.c',
+    'ext/stats.c',
+] + kernel_sources
+
+# TLG_STATS=1 builds the codecs with per-stage timing and allocation counters
+define_macros = [('TLG_STATS', None)] if os.environ.get('TLG_STATS') else []
+
+# TLG_PGO=generate builds the TLG5 and TLG6 codecs (and the benchmark module,
+# which measures LZSS on its own) instrumented, and after a training run
+# TLG_PGO=use rebuilds them from the recorded profile with LTO; ./pgo runs both
+# stages (GCC only)
+pgo_mode = os.environ.get('TLG_PGO')
+pgo_dir = os.path.abspath(os.environ.get('TLG_PGO_DIR', 'build/pgo'))
+if pgo_mode == 'generate':
+    # the codecs decode on worker threads, so the counters must be atomic
+    pgo_args = [
+        '-fprofile-generate=' + pgo_dir, '-fprofile-update=atomic']
+elif pgo_mode == 'use':
+    pgo_args = [
+        '-fprofile-use=' + pgo_dir,
+        '-fprofile-correction',
+        '-Wno-missing-profile',
+        '-flto=auto']
+elif pgo_mode:
+    raise SystemExit('TLG_PGO must be "generate" or "use"')
+else:
+    pgo_args = []
+
+setup(cmdclass={'build_ext': BuildExt}, ext_modules=[
+    Extension(
+        'lib._deflate',
+        sources=['ext/deflate.c', 'ext/error.c', 'ext/pool.c'],
+        libraries=['z', 'pthread']),
+    Extension(
+        'lib._engine',
+        sources=['ext/engine.c', tables_source] + kernel_sources,
+        include_dirs=['ext'],
+        libraries=['pthread']),
+    Extension(
+        'lib._script',
+        sources=['ext/script.c', 'ext/error.c']),
+    Extension(
+        'lib._delta',
+        sources=['ext/delta.c', 'ext/error.c', 'ext/hash.c']),
+    Extension(
+        'lib.tlg._tlg0',
+        sources=[
+            'ext/tlg0.c', 'ext/error.c', 'ext/stream.c', 'ext/stats.c'],
+        define_macros=define_macros,
+        libraries=['pthread']),
+    Extension(
+        'lib.tlg.tlg5',
+        sources=['ext/tlg5.c'] + common_sources,
+        define_macros=define_macros,
+        extra_compile_args=pgo_args,
+        extra_link_args=pgo_args,
+        libraries=['pthread']),
+    Extension(
+        'lib.tlg.tlg6',
+        sources=['ext/tlg6.c', tables_source] + common_sources,
+        include_dirs=['ext'],
+        define_macros=define_macros,
+        extra_compile_args=pgo_args,
+        extra_link_args=pgo_args,
+        libraries=['pthread']),
+    Extension(
+        'lib.tlg._bench',
+        sources=['ext/bench.c', tables_source] + common_sources,
+        include_dirs=['ext'],
+        define_macros=define_macros,
+        extra_compile_args=pgo_args,
+        extra_link_args=pgo_args,
+        libraries=['pthread']),
 ])